@@ -0,0 +1,590 @@
+/*
+ * dt42-batch.c - Parallel DT-42 batch renderer
+ *
+ * Copyright 2016 David Olofson
+ *
+ * Renders any number of .dt42 songs to WAV files, using a pool
+ * of worker threads. Each song gets its own mixer and sequencer,
+ * while the sample cache shares the sample data between all of them.
+ */
+
+#include "smixer.h"
+#include "smkernel.h"
+#include "smlog.h"
+#include "smring.h"
+#include "smwav.h"
+#include "sseq.h"
+#include "version.h"
+#include "SDL.h"
+#include "SDL_thread.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif
+
+/* Sample frames rendered per sm_mixer_render() call */
+#define	RENDER_BLOCK	SM_MAXFRAGMENT
+
+/* Max number of worker threads */
+#define	MAX_WORKERS	256
+
+
+/* One song to render */
+typedef struct
+{
+	char	*songfile;
+	char	*outfile;
+	int	result;		/* 0 if rendered, otherwise < 0 */
+	Uint32	frames;		/* Frames rendered */
+	int	time;		/* Time it took (ms) */
+} BATCH_job;
+
+/* State of one worker thread */
+typedef struct
+{
+	void		*buf;	/* Render buffer */
+	SM_mixer	*m;	/* Instances of the last song rendered */
+	SSEQ_seq	*sq;
+} BATCH_worker;
+
+
+/*-------------------------------------------------------------------
+	Options
+-------------------------------------------------------------------*/
+
+static char *outdir = NULL;		/* Output directory, or NULL */
+static SM_formats format = SM_FORMAT_S16;	/* Output sample format */
+static int rate = SM_DEFAULT_RATE;	/* Output sample rate */
+static float maxtime = 600.0f;		/* Max duration (seconds) */
+static float tailtime = 1.0f;		/* Release tail after end of song */
+static int maxloops = 0;		/* Loops to play before stopping */
+static int workers = 0;			/* Worker threads; 0 for auto */
+static int quiet = 0;			/* No per song info */
+static int voices = 0;			/* Voice pool size; 0 for default */
+
+/* The jobs, and the next one to be picked up by a worker */
+static BATCH_job *jobs = NULL;
+static int njobs = 0;
+static volatile int nextjob = 0;
+
+
+/* Add a job for 'songfile'. Returns -1 if out of memory. */
+static int add_job(const char *songfile)
+{
+	BATCH_job *nj;
+	if(!(njobs & 63))
+	{
+		nj = realloc(jobs, (njobs + 64) * sizeof(BATCH_job));
+		if(!nj)
+			return -1;
+		jobs = nj;
+	}
+	memset(&jobs[njobs], 0, sizeof(BATCH_job));
+	jobs[njobs].songfile = strdup(songfile);
+	if(!jobs[njobs].songfile)
+		return -1;
+	++njobs;
+	return 0;
+}
+
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+
+/* Add a job for every .dt42 file in 'dir', in alphabetical order */
+static int add_dir(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	char **names = NULL;
+	int i, n = 0;
+	int res = 0;
+	if(!d)
+	{
+		fprintf(stderr, "Could not open directory \"%s\": %s\n",
+				dir, strerror(errno));
+		return -1;
+	}
+	while((de = readdir(d)))
+	{
+		int len = strlen(de->d_name);
+		char **nn;
+		if((len < 5) || strcmp(de->d_name + len - 5, ".dt42"))
+			continue;
+		nn = realloc(names, (n + 1) * sizeof(char *));
+		if(!nn)
+		{
+			res = -1;
+			break;
+		}
+		names = nn;
+		names[n] = malloc(strlen(dir) + len + 2);
+		if(!names[n])
+		{
+			res = -1;
+			break;
+		}
+		sprintf(names[n++], "%s/%s", dir, de->d_name);
+	}
+	closedir(d);
+	if(n)
+		qsort(names, n, sizeof(char *), compare_names);
+	for(i = 0; i < n; ++i)
+	{
+		if(!res)
+			res = add_job(names[i]);
+		free(names[i]);
+	}
+	free(names);
+	return res;
+}
+
+
+/* Add jobs for the songs listed in 'fn', one per line, or stdin for "-" */
+static int add_list(const char *fn)
+{
+	char line[1024];
+	FILE *f = strcmp(fn, "-") ? fopen(fn, "r") : stdin;
+	if(!f)
+	{
+		fprintf(stderr, "Could not open song list \"%s\": %s\n",
+				fn, strerror(errno));
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f))
+	{
+		int len = strlen(line);
+		while(len && ((line[len - 1] == '\n') ||
+				(line[len - 1] == '\r')))
+			line[--len] = 0;
+		if(!len)
+			continue;
+		if(add_job(line) < 0)
+		{
+			if(f != stdin)
+				fclose(f);
+			return -1;
+		}
+	}
+	if(f != stdin)
+		fclose(f);
+	return 0;
+}
+
+
+/* Add a song, or all songs in a directory */
+static int add_path(const char *path)
+{
+	DIR *d = opendir(path);
+	if(d)
+	{
+		closedir(d);
+		return add_dir(path);
+	}
+	return add_job(path);
+}
+
+
+/*
+ * Name the output file of 'j'; song.dt42 ==> song.wav, either next to
+ * the song, or in 'outdir'.
+ */
+static int name_output(BATCH_job *j)
+{
+	const char *base = j->songfile;
+	char *dot;
+	int len;
+	if(outdir)
+	{
+		const char *slash = strrchr(base, '/');
+#ifdef _WIN32
+		const char *bslash = strrchr(base, '\\');
+		if(bslash && (!slash || bslash > slash))
+			slash = bslash;
+#endif
+		if(slash)
+			base = slash + 1;
+	}
+	len = (outdir ? strlen(outdir) + 1 : 0) + strlen(base);
+	j->outfile = malloc(len + 5);
+	if(!j->outfile)
+		return -1;
+	if(outdir)
+		sprintf(j->outfile, "%s/%s", outdir, base);
+	else
+		strcpy(j->outfile, base);
+	dot = strrchr(j->outfile, '.');
+	if(dot && !strchr(dot, '/'))
+		*dot = 0;
+	strcat(j->outfile, ".wav");
+	return 0;
+}
+
+
+/* Returns 1 for -h, or -1 for bad or missing arguments */
+static int parse_args(int argc, char *argv[])
+{
+	int i;
+	for(i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "-h") == 0)
+			return 1;
+		else if(strncmp(argv[i], "-o", 2) == 0)
+		{
+			free(outdir);
+			outdir = strdup(argv[i] + 2);
+		}
+		else if(strncmp(argv[i], "-i", 2) == 0)
+		{
+			if(add_list(argv[i] + 2) < 0)
+				return -1;
+		}
+		else if(strncmp(argv[i], "-j", 2) == 0)
+		{
+			workers = atoi(argv[i] + 2);
+			if(workers <= 0)
+				return -1;
+		}
+		else if(strncmp(argv[i], "-F", 2) == 0)
+			format = SM_FORMAT_FLOAT;
+		else if(strncmp(argv[i], "-b", 2) == 0)
+		{
+			switch(atoi(argv[i] + 2))
+			{
+			  case 16:
+				format = SM_FORMAT_S16;
+				break;
+			  case 24:
+				format = SM_FORMAT_S24;
+				break;
+			  case 32:
+				format = SM_FORMAT_FLOAT;
+				break;
+			  default:
+				return -1;
+			}
+		}
+		else if(strncmp(argv[i], "-r", 2) == 0)
+		{
+			rate = atoi(argv[i] + 2);
+			if(rate <= 0)
+				return -1;
+		}
+		else if(strncmp(argv[i], "-t", 2) == 0)
+		{
+			maxtime = atof(argv[i] + 2);
+			if(!(maxtime > 0.0f))
+				return -1;
+		}
+		else if(strncmp(argv[i], "-e", 2) == 0)
+		{
+			tailtime = atof(argv[i] + 2);
+			if(!(tailtime > 0.0f))
+				return -1;
+		}
+		else if(strncmp(argv[i], "-l", 2) == 0)
+			maxloops = atoi(argv[i] + 2);
+		else if(strncmp(argv[i], "-q", 2) == 0)
+			quiet = 1;
+		else if(strncmp(argv[i], "-v", 2) == 0)
+		{
+			voices = atoi(argv[i] + 2);
+			if(voices < 1 || voices > SM_MAXVOICES)
+				return -1;
+		}
+		else if(argv[i][0] != '-')
+		{
+			if(add_path(argv[i]) < 0)
+				return -1;
+		}
+		else
+			return -1;
+	}
+	if(!njobs)
+		return -1;
+
+	/* The frame counts must fit in a Uint32 and an int */
+	if(((double)maxtime * rate > 4294967295.0) ||
+			((double)tailtime * rate > 2147483647.0))
+		return -1;
+	if(outdir && !outdir[0])
+	{
+		free(outdir);
+		outdir = NULL;
+	}
+	for(i = 0; i < njobs; ++i)
+		if(name_output(&jobs[i]) < 0)
+			return -1;
+	return 0;
+}
+
+
+static void usage(const char *exename)
+{
+	fprintf(stderr, ".----------------------------------------------------\n");
+	fprintf(stderr, "| DT-42 DrumToy " VERSION " Batch Renderer\n");
+	fprintf(stderr, "| Copyright (C) 2006, 2016 David Olofson\n");
+	fprintf(stderr, "|----------------------------------------------------\n");
+	fprintf(stderr, "| Usage: %s [switches] <file|dir> ...\n", exename);
+	fprintf(stderr, "| Switches:  -o<x> Output directory\n");
+	fprintf(stderr, "|            -i<x> Song list file (- for stdin)\n");
+	fprintf(stderr, "|            -j<x> Worker threads (default: CPUs)\n");
+	fprintf(stderr, "|            -F    32 bit float output\n");
+	fprintf(stderr, "|            -b<x> Output bits; 16, 24 or 32 (float)\n");
+	fprintf(stderr, "|            -r<x> Sample rate (default: 44100)\n");
+	fprintf(stderr, "|            -t<x> Max duration in seconds\n");
+	fprintf(stderr, "|            -l<x> Loops to play (default: 0)\n");
+	fprintf(stderr, "|            -e<x> Release tail in seconds\n");
+	fprintf(stderr, "|            -q    Quiet\n");
+	fprintf(stderr, "|            -v<x> Voices (default: %d)\n",
+			SM_VOICES);
+	fprintf(stderr, "|            -h    Help\n");
+	fprintf(stderr, "'----------------------------------------------------\n");
+}
+
+
+/*-------------------------------------------------------------------
+	Rendering
+-------------------------------------------------------------------*/
+
+/* Same master processing as in DT-42 and dt42-render */
+static void audio_setup(SM_mixer *m)
+{
+	sm_mixer_set_bus(m, SM_BUS_FLOAT);
+	sm_mixer_master_insert(m, -1, sm_master_saturate, NULL);
+}
+
+
+/* Render the song of 'j' through 'sq' and 'm', into 'f' */
+static int render(BATCH_job *j, SM_mixer *m, SSEQ_seq *sq, FILE *f,
+		void *buf)
+{
+	int ended = 0;
+	int tail = (int)(tailtime * rate);
+	Uint32 maxframes = (Uint32)(maxtime * rate);
+	if(sm_wav_header(f, rate, format, 0) < 0)
+		return -1;
+	sseq_seq_pause(sq, 0);
+	while(j->frames < maxframes)
+	{
+		int n = RENDER_BLOCK;
+		if(n > maxframes - j->frames)
+			n = maxframes - j->frames;
+		if(ended)
+		{
+			if(tail <= 0)
+				break;
+			if(n > tail)
+				n = tail;
+			tail -= n;
+		}
+		sm_mixer_render(m, buf, n, format);
+		if(sm_wav_write(f, buf, n, format) < 0)
+			return -1;
+		j->frames += n;
+		if(!ended && ((sseq_seq_get_loops(sq) > maxloops) ||
+				(sseq_seq_get_next_position(sq) >=
+				sseq_seq_get_length(sq))))
+		{
+			/* Stop the sequencer and let the voices ring out */
+			sseq_seq_pause(sq, 1);
+			ended = 1;
+		}
+	}
+	if(fseek(f, 0, SEEK_SET) < 0)
+		return -1;
+	return sm_wav_header(f, rate, format,
+			j->frames * sm_wav_framesize(format));
+}
+
+
+/* Free the instances of the last song a worker rendered */
+static void drop_last(BATCH_worker *w)
+{
+	sseq_seq_free(w->sq);
+	if(w->m)
+		sm_mixer_close(w->m);
+	w->sq = NULL;
+	w->m = NULL;
+}
+
+
+/*
+ * Render one song with its own mixer and sequencer. These are kept
+ * until the next song has been loaded, so that any samples the songs
+ * have in common stay in the sample cache.
+ */
+static int run_job(BATCH_job *j, BATCH_worker *w)
+{
+	FILE *f;
+	SM_mixer *m;
+	SSEQ_seq *sq;
+	int start = SDL_GetTicks();
+	if(!(m = sm_mixer_new(rate)))
+		return -1;
+	if(voices && (sm_mixer_set_voices(m, voices) < 0))
+	{
+		sm_mixer_close(m);
+		return -1;
+	}
+	if(!(sq = sseq_seq_new(m)))
+	{
+		sm_mixer_close(m);
+		return -1;
+	}
+	audio_setup(m);
+	if(sseq_seq_load_song(sq, j->songfile) < 0)
+	{
+		sseq_seq_free(sq);
+		sm_mixer_close(m);
+		return -1;
+	}
+	drop_last(w);
+	w->m = m;
+	w->sq = sq;
+	if(!(f = fopen(j->outfile, "wb")))
+	{
+		fprintf(stderr, "Could not open/create file \"%s\": %s\n",
+				j->outfile, strerror(errno));
+		return -1;
+	}
+	if(render(j, m, sq, f, w->buf) < 0)
+	{
+		fprintf(stderr, "Error writing \"%s\": %s\n",
+				j->outfile, strerror(errno));
+		j->result = -1;
+	}
+	fclose(f);
+	j->time = SDL_GetTicks() - start;
+	if(!quiet && !j->result)
+		fprintf(stderr, "Rendered %.2f s of audio to \"%s\" in %.3f s\n",
+				(double)j->frames / rate, j->outfile,
+				j->time * 0.001);
+	return j->result;
+}
+
+
+/* Worker thread: Take jobs off the list until there are none left */
+static int worker(void *data)
+{
+	BATCH_worker w;
+	memset(&w, 0, sizeof(w));
+	w.buf = malloc(RENDER_BLOCK * 2 * sizeof(float));
+	if(!w.buf)
+	{
+		fprintf(stderr, "Couldn't allocate render buffer!\n");
+		return -1;
+	}
+	while(1)
+	{
+		int j = SM_ATOMIC_ADD(nextjob, 1) - 1;
+		if(j >= njobs)
+			break;
+		if(run_job(&jobs[j], &w) < 0)
+			jobs[j].result = -1;
+	}
+	drop_last(&w);
+	free(w.buf);
+	return 0;
+}
+
+
+/* Number of CPU cores available to us */
+static int cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#else
+	return 1;
+#endif
+}
+
+
+/*-------------------------------------------------------------------
+	main()
+-------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+	SDL_Thread *threads[MAX_WORKERS];
+	int i, n;
+	int start, elapsed;
+	int failed = 0;
+	double seconds = 0.0;
+	SMK_isa kernels;
+
+	if((i = parse_args(argc, argv)))
+	{
+		usage(argv[0]);
+		return i < 0 ? -1 : 0;
+	}
+	if(quiet)
+		sm_log_level(SM_LOG_WARNING);
+
+	if(SDL_Init(0) < 0)
+		return -1;
+	atexit(SDL_Quit);
+
+	if(!workers)
+		workers = cpu_count();
+	if(workers > njobs)
+		workers = njobs;
+	if(workers > MAX_WORKERS)
+		workers = MAX_WORKERS;
+
+	kernels = smk_init(SMK_AVX2);
+	if(!quiet)
+		fprintf(stderr, "Rendering %d songs on %d threads, using %s"
+				" mixing kernels.\n", njobs, workers,
+				smk_name(kernels));
+
+	start = SDL_GetTicks();
+	for(n = 0; n < workers; ++n)
+		if(!(threads[n] = SDL_CreateThread(worker, NULL)))
+		{
+			fprintf(stderr, "Could not start worker thread!\n");
+			break;
+		}
+	if(!n)
+		worker(NULL);
+	for(i = 0; i < n; ++i)
+		SDL_WaitThread(threads[i], NULL);
+	elapsed = SDL_GetTicks() - start;
+
+	for(i = 0; i < njobs; ++i)
+	{
+		if(jobs[i].result < 0)
+		{
+			fprintf(stderr, "FAILED: \"%s\"\n", jobs[i].songfile);
+			++failed;
+		}
+		else
+			seconds += (double)jobs[i].frames / rate;
+		free(jobs[i].songfile);
+		free(jobs[i].outfile);
+	}
+	free(jobs);
+	free(outdir);
+
+	fprintf(stderr, "Rendered %d of %d songs (%.2f s of audio) in %.3f s"
+			" on %d threads\n", njobs - failed, njobs, seconds,
+			elapsed * 0.001, n ? n : 1);
+	if(elapsed)
+		fprintf(stderr, "Throughput: %.2f songs/s, %.1f audio s/s\n",
+				(njobs - failed) / (elapsed * 0.001),
+				seconds / (elapsed * 0.001));
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * dt42-mkcache.c - DT-42 sample cache file builder
+ *
+ * Copyright 2016 David Olofson
+ *
+ * Builds the .dt42s cache files for the WAV files in one or more
+ * directories, so that the mixer can map them straight into memory
+ * instead of loading and converting the WAV files.
+ */
+
+#include "smixer.h"
+#include "version.h"
+#include "SDL.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+
+
+/*-------------------------------------------------------------------
+	Options
+-------------------------------------------------------------------*/
+
+static int force = 0;		/* Rebuild even if up to date */
+static int checkonly = 0;	/* Check cache files; don't build */
+static int quiet = 0;		/* Only report errors */
+
+/* Results */
+static int built = 0;
+static int uptodate = 0;
+static int skipped = 0;
+static int failed = 0;
+
+
+static void usage(const char *exename)
+{
+	fprintf(stderr, ".----------------------------------------------------\n");
+	fprintf(stderr, "| DT-42 DrumToy " VERSION " Sample Cache Builder\n");
+	fprintf(stderr, "| Copyright (C) 2006, 2016 David Olofson\n");
+	fprintf(stderr, "|----------------------------------------------------\n");
+	fprintf(stderr, "| Usage: %s [switches] <dir|file> ...\n", exename);
+	fprintf(stderr, "| Switches:  -f    Rebuild all cache files\n");
+	fprintf(stderr, "|            -c    Check cache files, with checksums\n");
+	fprintf(stderr, "|            -q    Quiet\n");
+	fprintf(stderr, "|            -h    Help\n");
+	fprintf(stderr, "'----------------------------------------------------\n");
+}
+
+
+/*-------------------------------------------------------------------
+	Building
+-------------------------------------------------------------------*/
+
+/* Build, or check, the cache file of one WAV file */
+static void do_file(const char *fn)
+{
+	int res;
+	if(!sm_cache_wanted(fn))
+	{
+		/* Not a format we cache, or streamed rather than loaded */
+		if(!quiet)
+			printf("%s: skipped\n", fn);
+		++skipped;
+		return;
+	}
+	res = sm_cache_check(fn, checkonly);
+	if(checkonly)
+	{
+		if(res > 0)
+			++uptodate;
+		else
+		{
+			fprintf(stderr, "%s: %s\n", fn, res < 0 ? "CORRUPT" :
+					"missing or stale");
+			++failed;
+		}
+		return;
+	}
+	if((res > 0) && !force)
+	{
+		++uptodate;
+		return;
+	}
+	if(sm_cache_build(fn) < 0)
+	{
+		fprintf(stderr, "Could not build cache file for \"%s\"!\n",
+				fn);
+		++failed;
+		return;
+	}
+	if(!quiet)
+		printf("%s%s\n", fn, SM_CACHE_SUFFIX);
+	++built;
+}
+
+
+/* Check if 'name' ends with ".wav", in any case */
+static int is_wav(const char *name)
+{
+	int len = strlen(name);
+	const char *ext = name + len - 4;
+	if(len < 5)
+		return 0;
+	return (ext[0] == '.') && ((ext[1] | 0x20) == 'w') &&
+			((ext[2] | 0x20) == 'a') && ((ext[3] | 0x20) == 'v');
+}
+
+
+static void do_dir(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	if(!d)
+	{
+		fprintf(stderr, "Could not open directory \"%s\": %s\n",
+				dir, strerror(errno));
+		++failed;
+		return;
+	}
+	while((de = readdir(d)))
+	{
+		char *fn;
+		if(!is_wav(de->d_name))
+			continue;
+		fn = malloc(strlen(dir) + strlen(de->d_name) + 2);
+		if(!fn)
+		{
+			++failed;
+			break;
+		}
+		sprintf(fn, "%s/%s", dir, de->d_name);
+		do_file(fn);
+		free(fn);
+	}
+	closedir(d);
+}
+
+
+/*-------------------------------------------------------------------
+	main()
+-------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int paths = 0;
+	for(i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "-f") == 0)
+			force = 1;
+		else if(strcmp(argv[i], "-c") == 0)
+			checkonly = 1;
+		else if(strcmp(argv[i], "-q") == 0)
+			quiet = 1;
+		else if(strcmp(argv[i], "-h") == 0)
+		{
+			usage(argv[0]);
+			return 0;
+		}
+		else if(argv[i][0] == '-')
+		{
+			usage(argv[0]);
+			return -1;
+		}
+		else
+			++paths;
+	}
+	if(!paths)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	if(SDL_Init(0) < 0)
+		return -1;
+	atexit(SDL_Quit);
+
+	for(i = 1; i < argc; ++i)
+	{
+		DIR *d;
+		if(argv[i][0] == '-')
+			continue;
+		if((d = opendir(argv[i])))
+		{
+			closedir(d);
+			do_dir(argv[i]);
+		}
+		else
+			do_file(argv[i]);
+	}
+
+	if(!quiet)
+	{
+		if(checkonly)
+			printf("%d OK, %d skipped, %d bad\n", uptodate,
+					skipped, failed);
+		else
+			printf("%d built, %d up to date, %d skipped, "
+					"%d failed\n", built, uptodate,
+					skipped, failed);
+	}
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,490 @@
+/*
+ * dt42-render.c - Headless DT-42 song renderer
+ *
+ * Copyright 2016 David Olofson
+ *
+ * Renders a .dt42 song straight to a WAV file, by running
+ * the sequencer and mixer in a tight loop, without any SDL
+ * video or audio device.
+ */
+
+#include "smixer.h"
+#include "smkernel.h"
+#include "smlog.h"
+#include "sseq.h"
+#include "smwav.h"
+#include "version.h"
+#include "SDL.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+# include <io.h>
+# include <fcntl.h>
+#else
+# include <unistd.h>
+#endif
+
+/*
+ * Sample frames rendered per sm_render() call. This is also
+ * the granularity at which we detect the end of the song.
+ */
+#define	RENDER_BLOCK	SM_MAXFRAGMENT
+
+
+/*-------------------------------------------------------------------
+	Options
+-------------------------------------------------------------------*/
+
+static char *songfilename = NULL;	/* Song to render */
+static char *outfilename = NULL;	/* Output file, or "-" for stdout */
+static SM_formats format = SM_FORMAT_S16;	/* Output sample format */
+static int rate = SM_DEFAULT_RATE;	/* Output sample rate */
+static float maxtime = 600.0f;		/* Max duration (seconds) */
+static float tailtime = 1.0f;		/* Release tail after end of song */
+static int maxloops = 0;		/* Loops to play before stopping */
+static int quiet = 0;			/* No progress info */
+static int bench = 0;			/* Benchmark voices; don't render */
+static int verify = 0;			/* Verify mixing kernels */
+static int print_stats = 0;		/* Print mixer timing statistics */
+static int voices = 0;			/* Voice pool size; 0 for default */
+static SMK_isa kernels = SMK_AVX2;	/* Best mixing kernels to use */
+
+
+/* Returns 1 for -h, or -1 for bad or missing arguments */
+static int parse_args(int argc, char *argv[])
+{
+	int i;
+	for(i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "--stats") == 0)
+			print_stats = 1;
+		else if(strcmp(argv[i], "-h") == 0)
+			return 1;
+		else if(strncmp(argv[i], "-o", 2) == 0)
+		{
+			free(outfilename);
+			outfilename = strdup(argv[i] + 2);
+		}
+		else if(strncmp(argv[i], "-F", 2) == 0)
+			format = SM_FORMAT_FLOAT;
+		else if(strncmp(argv[i], "-b", 2) == 0)
+		{
+			switch(atoi(argv[i] + 2))
+			{
+			  case 16:
+				format = SM_FORMAT_S16;
+				break;
+			  case 24:
+				format = SM_FORMAT_S24;
+				break;
+			  case 32:
+				format = SM_FORMAT_FLOAT;
+				break;
+			  default:
+				return -1;
+			}
+		}
+		else if(strncmp(argv[i], "-r", 2) == 0)
+		{
+			rate = atoi(argv[i] + 2);
+			if(rate <= 0)
+				return -1;
+		}
+		else if(strncmp(argv[i], "-t", 2) == 0)
+		{
+			maxtime = atof(argv[i] + 2);
+			if(!(maxtime > 0.0f))
+				return -1;
+		}
+		else if(strncmp(argv[i], "-e", 2) == 0)
+		{
+			tailtime = atof(argv[i] + 2);
+			if(!(tailtime > 0.0f))
+				return -1;
+		}
+		else if(strncmp(argv[i], "-l", 2) == 0)
+			maxloops = atoi(argv[i] + 2);
+		else if(strncmp(argv[i], "-q", 2) == 0)
+			quiet = 1;
+		else if(strncmp(argv[i], "-v", 2) == 0)
+		{
+			voices = atoi(argv[i] + 2);
+			if(voices < 1 || voices > SM_MAXVOICES)
+				return -1;
+		}
+		else if(strncmp(argv[i], "-B", 2) == 0)
+			bench = 1;
+		else if(strncmp(argv[i], "-K", 2) == 0)
+			verify = 1;
+		else if(strncmp(argv[i], "-k", 2) == 0)
+		{
+			if(!strcmp(argv[i] + 2, "scalar"))
+				kernels = SMK_SCALAR;
+			else if(!strcmp(argv[i] + 2, "sse2"))
+				kernels = SMK_SSE2;
+			else if(!strcmp(argv[i] + 2, "avx2"))
+				kernels = SMK_AVX2;
+			else
+				return -1;
+		}
+		else if(argv[i][0] != '-')
+		{
+			free(songfilename);
+			if(strchr(argv[i], '.'))
+				songfilename = strdup(argv[i]);
+			else
+			{
+				int len = strlen(argv[i]);
+				songfilename = malloc(len + 6);
+				memcpy(songfilename, argv[i], len);
+				memcpy(songfilename + len, ".dt42\0", 6);
+			}
+		}
+		else
+			return -1;
+	}
+	if(verify)
+		return 0;
+	if(!songfilename)
+		return -1;
+
+	/* The frame counts must fit in a Uint32 and an int */
+	if(((double)maxtime * rate > 4294967295.0) ||
+			((double)tailtime * rate > 2147483647.0))
+		return -1;
+	if(!outfilename || !outfilename[0])
+	{
+		/* song.dt42 ==> song.wav */
+		char *dot;
+		int len = strlen(songfilename);
+		free(outfilename);
+		outfilename = malloc(len + 5);
+		strcpy(outfilename, songfilename);
+		dot = strrchr(outfilename, '.');
+		if(dot && !strchr(dot, '/'))
+			*dot = 0;
+		strcat(outfilename, ".wav");
+	}
+	return 0;
+}
+
+
+static void usage(const char *exename)
+{
+	fprintf(stderr, ".----------------------------------------------------\n");
+	fprintf(stderr, "| DT-42 DrumToy " VERSION " Headless Renderer\n");
+	fprintf(stderr, "| Copyright (C) 2006, 2016 David Olofson\n");
+	fprintf(stderr, "|----------------------------------------------------\n");
+	fprintf(stderr, "| Usage: %s [switches] <file>\n", exename);
+	fprintf(stderr, "| Switches:  -o<x> Output file (- for stdout)\n");
+	fprintf(stderr, "|            -F    32 bit float output\n");
+	fprintf(stderr, "|            -b<x> Output bits; 16, 24 or 32 (float)\n");
+	fprintf(stderr, "|            -r<x> Sample rate (default: 44100)\n");
+	fprintf(stderr, "|            -t<x> Max duration in seconds\n");
+	fprintf(stderr, "|            -l<x> Loops to play (default: 0)\n");
+	fprintf(stderr, "|            -e<x> Release tail in seconds\n");
+	fprintf(stderr, "|            -q    Quiet\n");
+	fprintf(stderr, "|            -v<x> Voices (default: %d)\n",
+			SM_VOICES);
+	fprintf(stderr, "|            -B    Benchmark voices of song\n");
+	fprintf(stderr, "|            -k<x> Mixing kernels; scalar, sse2"
+			" or avx2\n");
+	fprintf(stderr, "|            -K    Verify mixing kernels\n");
+	fprintf(stderr, "|            --stats Print mixer timing\n");
+	fprintf(stderr, "|            -h    Help\n");
+	fprintf(stderr, "'----------------------------------------------------\n");
+}
+
+
+/*-------------------------------------------------------------------
+	Audio processing
+-------------------------------------------------------------------*/
+
+/*
+ * Same master processing as in DT-42, so that rendered songs sound
+ * the same, and so that peaks don't clip hard in 16 and 24 bit output.
+ */
+static void audio_setup(void)
+{
+	sm_set_bus(SM_BUS_FLOAT);
+	sm_master_insert(-1, sm_master_saturate, NULL);
+}
+
+
+/*-------------------------------------------------------------------
+	WAV output
+-------------------------------------------------------------------*/
+
+/*
+ * Get a binary stream for the WAV data on stdout, and move
+ * stdout over to stderr, so that informational messages from
+ * the sequencer don't end up in the audio data.
+ */
+static FILE *open_stdout(void)
+{
+	int fd;
+	fflush(stdout);
+#ifdef _WIN32
+	fd = _dup(1);
+	_dup2(2, 1);
+	_setmode(fd, _O_BINARY);
+	return _fdopen(fd, "wb");
+#else
+	fd = dup(1);
+	dup2(2, 1);
+	return fdopen(fd, "wb");
+#endif
+}
+
+
+/*-------------------------------------------------------------------
+	Voice benchmark
+-------------------------------------------------------------------*/
+
+/* Seconds of audio to render per measurement */
+#define	BENCH_SECONDS	60
+
+/*
+ * Render BENCH_SECONDS of audio with 'sound' retriggered on all voices
+ * for every block, or with no voices playing if 'sound' is -1.
+ * Returns the time it took in ms.
+ */
+static int bench_sound(void *buf, int sound)
+{
+	int frames, v;
+	int start = SDL_GetTicks();
+	for(frames = 0; frames < BENCH_SECONDS * rate;
+			frames += RENDER_BLOCK)
+	{
+		if(sound >= 0)
+			for(v = 0; v < sm_get_voices(); ++v)
+				sm_play(v, sound, 1.0f, 1.0f);
+		sm_render(buf, RENDER_BLOCK, SM_FORMAT_S16);
+	}
+	return SDL_GetTicks() - start;
+}
+
+
+/*
+ * Measure the mixing cost of one voice playing each of the sounds
+ * loaded by the song, with the cost of the empty mixer subtracted.
+ */
+static void bench_voices(void *buf)
+{
+	int i, base;
+	double frames = BENCH_SECONDS * rate;
+	double vframes = frames * sm_get_voices();
+
+	/* Detach the sequencer and master processing */
+	sm_set_control_cb(NULL);
+	sm_master_remove(0);
+	sm_set_bus(SM_BUS_FIXED);
+
+	base = bench_sound(buf, -1);
+	printf("Empty mixer: %.2f ns/frame\n", base * 1e6 / frames);
+	for(i = 0; i < sm_get_sounds(); ++i)
+	{
+		int t;
+		if(!sm_loaded(i))
+			continue;
+		t = bench_sound(buf, i) - base;
+		printf("Sound %2d (%s): %6.2f ns/frame/voice, %5.3f%% of"
+				" real time\n", i,
+				sm_loaded(i) == 1 ? "sample" : "synth ",
+				t * 1e6 / vframes,
+				t * 100.0 / (BENCH_SECONDS * 1000) /
+				sm_get_voices());
+	}
+}
+
+
+/*-------------------------------------------------------------------
+	Kernel verification
+-------------------------------------------------------------------*/
+
+/* Compare the output of all supported SIMD kernels to the scalar ones */
+static int verify_kernels(void)
+{
+	int isa;
+	int errors = 0;
+	for(isa = SMK_SSE2; isa <= SMK_AVX2; ++isa)
+	{
+		int d = smk_verify(isa);
+		if(d < 0)
+			printf("%6s: Not supported.\n", smk_name(isa));
+		else if(d > 0)
+		{
+			printf("%6s: FAILED! Max difference: %d\n",
+					smk_name(isa), d);
+			++errors;
+		}
+		else
+			printf("%6s: OK\n", smk_name(isa));
+	}
+	return errors ? -1 : 0;
+}
+
+
+/*-------------------------------------------------------------------
+	main()
+-------------------------------------------------------------------*/
+
+/*-------------------------------------------------------------------
+	Rendering
+-------------------------------------------------------------------*/
+
+/*
+ * Render the loaded song to 'f' if 'tostdout' is set, or otherwise to a
+ * new file 'outfilename'. The file is closed when done.
+ */
+static int render_song(FILE *f, int tostdout, void *buf)
+{
+	int res = 0;
+	int ended = 0;
+	int tail;
+	Uint32 maxframes, frames = 0, bytes;
+	int start, elapsed;
+
+	if(!tostdout)
+		f = fopen(outfilename, "wb");
+	if(!f)
+	{
+		fprintf(stderr, "Could not open/create file \"%s\": %s\n",
+				outfilename, strerror(errno));
+		return -1;
+	}
+
+	if(sm_wav_header(f, rate, format, tostdout ? 0xffffffff : 0) < 0)
+	{
+		fprintf(stderr, "Error writing \"%s\": %s\n",
+				outfilename, strerror(errno));
+		fclose(f);
+		return -1;
+	}
+
+	/* Render! */
+	maxframes = (Uint32)(maxtime * rate);
+	tail = (int)(tailtime * rate);
+	start = SDL_GetTicks();
+	sseq_pause(0);
+	while(frames < maxframes)
+	{
+		int n = RENDER_BLOCK;
+		if(n > maxframes - frames)
+			n = maxframes - frames;
+		if(ended)
+		{
+			if(tail <= 0)
+				break;
+			if(n > tail)
+				n = tail;
+			tail -= n;
+		}
+		sm_render(buf, n, format);
+		if(sm_wav_write(f, buf, n, format) < 0)
+		{
+			fprintf(stderr, "Error writing \"%s\": %s\n",
+					outfilename, strerror(errno));
+			res = -1;
+			break;
+		}
+		frames += n;
+		if(!ended && ((sseq_get_loops() > maxloops) ||
+				(sseq_get_next_position() >=
+				sseq_get_length())))
+		{
+			/* Stop the sequencer and let the voices ring out */
+			sseq_pause(1);
+			ended = 1;
+		}
+	}
+	elapsed = SDL_GetTicks() - start;
+
+	/* Fill in the sizes, if we can */
+	bytes = frames * sm_wav_framesize(format);
+	if(!tostdout && (fseek(f, 0, SEEK_SET) == 0))
+		sm_wav_header(f, rate, format, bytes);
+	fclose(f);
+
+	if(!quiet)
+		fprintf(stderr, "Rendered %.2f s of audio to \"%s\" in %.3f s"
+				" (%.0fx real time)\n",
+				(double)frames / rate, outfilename,
+				elapsed * 0.001,
+				elapsed ? (double)frames / rate /
+				(elapsed * 0.001) : 0.0);
+	if(print_stats)
+		sm_print_stats(stderr);
+	return res;
+}
+
+
+int main(int argc, char *argv[])
+{
+	FILE *f = NULL;
+	void *buf;
+	int res;
+	int tostdout;
+
+	if((res = parse_args(argc, argv)))
+	{
+		usage(argv[0]);
+		return res < 0 ? -1 : 0;
+	}
+
+	if(verify)
+		return verify_kernels();
+
+	if(SDL_Init(0) < 0)
+		return -1;
+	atexit(SDL_Quit);
+
+	buf = malloc(RENDER_BLOCK * 2 * sizeof(float));
+	if(!buf)
+	{
+		fprintf(stderr, "Couldn't allocate render buffer!\n");
+		return -1;
+	}
+
+	if((sm_open_offline(rate) < 0) ||
+			(voices && (sm_set_voices(voices) < 0)))
+	{
+		fprintf(stderr, "Couldn't start mixer!\n");
+		free(buf);
+		return -1;
+	}
+	kernels = smk_init(kernels);
+	if(!quiet)
+		fprintf(stderr, "Using %s mixing kernels.\n",
+				smk_name(kernels));
+	sseq_open();
+	audio_setup();
+
+	/*
+	 * Take over stdout before loading, so that the messages from the
+	 * loader don't end up in the WAV stream.
+	 */
+	tostdout = !strcmp(outfilename, "-");
+	if(tostdout && !bench)
+		f = open_stdout();
+	if(quiet)
+		sm_log_level(SM_LOG_WARNING);
+	if(sseq_load_song(songfilename) < 0)
+	{
+		res = -1;
+		if(f)
+			fclose(f);
+	}
+	else if(bench)
+		bench_voices(buf);
+	else
+		res = render_song(f, tostdout, buf);
+
+	sseq_close();
+	sm_close();
+	free(buf);
+	free(songfilename);
+	free(outfilename);
+	return res;
+}
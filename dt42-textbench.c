@@ -0,0 +1,362 @@
+/*
+ * dt42-textbench.c - DT-42 text rendering benchmark
+ *
+ * Copyright 2016 David Olofson
+ *
+ * Renders text into 16, 24 and 32 bpp offscreen surfaces, with
+ * gui_text(), and with a copy of the gui_text() that blitted each
+ * character from the font surface, checks that both produce the
+ * same pixels, and prints the speed of each. No video mode is set,
+ * so this runs headless.
+ */
+
+#include "gui.h"
+#include "version.h"
+#include "SDL.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Size of the test surfaces; the DT-42 screen */
+#define	BENCH_W		640
+#define	BENCH_H		480
+
+/* Duration of each measurement (ms) */
+#define	BENCH_MS	1000
+
+static int benchms = BENCH_MS;
+static SDL_Surface *screen = NULL;
+static SDL_Surface *oldfont = NULL;
+
+
+static void usage(const char *exename)
+{
+	fprintf(stderr, ".----------------------------------------------------\n");
+	fprintf(stderr, "| DT-42 DrumToy " VERSION " Text Rendering Benchmark\n");
+	fprintf(stderr, "| Copyright (C) 2006, 2016 David Olofson\n");
+	fprintf(stderr, "|----------------------------------------------------\n");
+	fprintf(stderr, "| Usage: %s [switches]\n", exename);
+	fprintf(stderr, "| Switches:  -t<x> Time per measurement (ms)\n");
+	fprintf(stderr, "|            -h    Help\n");
+	fprintf(stderr, "'----------------------------------------------------\n");
+}
+
+
+/*-------------------------------------------------------------------
+	Baseline; gui_text() as it was before the expanded font
+-------------------------------------------------------------------*/
+
+/*
+ * Draw character or bullet 'c' at (x, y), returning the affected area
+ * in 'dr'. Does not add any dirtyrects.
+ */
+static void old_draw_char(int x, int y, int c, SDL_Rect *dr,
+		SDL_Surface *dst)
+{
+	SDL_Rect sr;
+	dr->x = x;
+	dr->y = y;
+	if((c >= '\021') && (c <= '\027'))
+	{
+		SDL_Rect r;
+		int hlr = c & 1 ? 255 : 0;
+		int hlg = c & 2 ? 255 : 0;
+		int hlb = c & 4 ? 255 : 0;
+		Uint32 hlc = SDL_MapRGB(dst->format, hlr, hlg, hlb);
+		dr->w = FONT_CW;
+		dr->h = FONT_CH;
+		r = *dr;
+		SDL_FillRect(dst, &r, SDL_MapRGB(dst->format, 0, 0, 0));
+		r.x = x + 2;
+		r.y = y + 2;
+		r.w = FONT_CW - 6;
+		r.h = FONT_CH - 6;
+		SDL_FillRect(dst, &r, hlc);
+		return;
+	}
+	if(c < ' ' || c > 127)
+		c = 127;
+	c -= 32;
+	sr.x = (c % (oldfont->w / FONT_CW)) * FONT_CW;
+	sr.y = (c / (oldfont->w / FONT_CW)) * FONT_CH;
+	sr.w = FONT_CW;
+	sr.h = FONT_CH;
+	SDL_BlitSurface(oldfont, &sr, dst, dr);
+}
+
+
+static void old_gui_text(int x, int y, const char *txt, SDL_Surface *dst)
+{
+	int sx = x;
+	int sy = y;
+	const char *stxt = txt;
+	int highlights = 0;
+	while(*txt)
+	{
+		int c = *txt++;
+		switch(c)
+		{
+		  case 0:	/* terminator */
+			break;
+		  case '\n':	/* newline */
+			x = sx;
+			y += FONT_CH;
+			break;
+		  case '\t':	/* tab */
+			x -= sx;
+			x += 8 * FONT_CW;
+			x %= 8 * FONT_CW;
+			x += sx;
+			break;
+		  case '\001':	/* red highlight */
+		  case '\002':	/* green highlight */
+		  case '\003':	/* yellow highlight */
+		  case '\004':	/* blue highlight */
+		  case '\005':	/* purple highlight */
+		  case '\006':	/* cyan highlight */
+		  case '\007':	/* white highlight */
+			highlights = 1;
+			if(*txt == '\001')
+				txt += 2;
+			break;
+		  default:	/* bullets and printables */
+		  {
+			SDL_Rect dr;
+			old_draw_char(x, y, c, &dr, dst);
+			gui_dirty(&dr);
+			x += FONT_CW;
+			break;
+		  }
+		}
+	}
+	if(!highlights)
+		return;
+	x = sx;
+	y = sy;
+	txt = stxt;
+	while(*txt)
+	{
+		int c = *txt++;
+		switch(c)
+		{
+		  case 0:	/* terminator */
+			break;
+		  case '\n':	/* newline */
+			x = sx;
+			y += FONT_CH;
+			break;
+		  case '\t':	/* tab */
+			x -= sx;
+			x += 8 * FONT_CW;
+			x %= 8 * FONT_CW;
+			x += sx;
+			break;
+		  case '\001':	/* red highlight */
+		  case '\002':	/* green highlight */
+		  case '\003':	/* yellow highlight */
+		  case '\004':	/* blue highlight */
+		  case '\005':	/* purple highlight */
+		  case '\006':	/* cyan highlight */
+		  case '\007':	/* white highlight */
+		  {
+			int hlr = c & 1 ? 255 : 0;
+			int hlg = c & 2 ? 255 : 0;
+			int hlb = c & 4 ? 255 : 0;
+			Uint32 hlc = SDL_MapRGB(screen->format, hlr, hlg, hlb);
+			int hlw = 1;
+			if(*txt == '\001')
+			{
+				hlw = txt[1];
+				txt += 2;
+			}
+			gui_box(x - 2, y - 2,
+					FONT_CW * hlw + 2, FONT_CH + 2,
+					hlc, dst);
+			break;
+		  }
+		  default:	/* printables */
+			x += FONT_CW;
+			break;
+		}
+	}
+}
+
+
+/*-------------------------------------------------------------------
+	Benchmark
+-------------------------------------------------------------------*/
+
+typedef void (*text_cb)(int x, int y, const char *txt, SDL_Surface *dst);
+
+/*
+ * Render 'txt' with 'text', unclipped and clipped, into 'copy', which
+ * must be the size of the screen pixels. Returns -1 on failure.
+ */
+static int render_test(text_cb text, const char *txt, Uint8 *copy)
+{
+	SDL_Rect clip;
+	SDL_FillRect(screen, NULL, SDL_MapRGB(screen->format, 0, 48, 0));
+	text(5, 3, txt, screen);
+	clip.x = 21;
+	clip.y = 200;
+	clip.w = 301;
+	clip.h = 23;
+	SDL_SetClipRect(screen, &clip);
+	text(13, 197, txt, screen);
+	SDL_SetClipRect(screen, NULL);
+	if(SDL_MUSTLOCK(screen) && (SDL_LockSurface(screen) < 0))
+		return -1;
+	memcpy(copy, screen->pixels, screen->pitch * screen->h);
+	if(SDL_MUSTLOCK(screen))
+		SDL_UnlockSurface(screen);
+	return 0;
+}
+
+
+/* Check that both text paths render 'txt' the same. Returns 1 if not. */
+static int verify(const char *txt)
+{
+	int res;
+	int size = screen->pitch * screen->h;
+	Uint8 *a = malloc(size);
+	Uint8 *b = malloc(size);
+	if(!a || !b || (render_test(old_gui_text, txt, a) < 0) ||
+			(render_test(gui_text, txt, b) < 0))
+		res = 1;
+	else
+		res = memcmp(a, b, size) != 0;
+	free(a);
+	free(b);
+	return res;
+}
+
+
+/* Render rows of 'txt' with 'text' for 'benchms', and return glyphs/s */
+static double run(text_cb text, const char *txt)
+{
+	int i;
+	int y = 0;
+	double glyphs = 0;
+	Uint32 t;
+	Uint32 start = SDL_GetTicks();
+	do
+	{
+		for(i = 0; i < 64; ++i)
+		{
+			text(12, y, txt, screen);
+			y += FONT_CH;
+			if(y > screen->h - FONT_CH)
+				y = 0;
+		}
+		glyphs += 64 * strlen(txt);
+	} while((t = SDL_GetTicks() - start) < benchms);
+	return glyphs * 1000.0 / t;
+}
+
+
+/* Set up 'screen' and the fonts for 'bpp'; returns -1 on failure */
+static int open_depth(int bpp)
+{
+	SDL_Surface *img;
+	screen = SDL_CreateRGBSurface(SDL_SWSURFACE, BENCH_W, BENCH_H, bpp,
+			0, 0, 0, 0);
+	if(!screen)
+		return -1;
+	if(gui_open(screen) < 0)
+		return -1;
+	img = SDL_LoadBMP("font.bmp");
+	oldfont = img ? SDL_ConvertSurface(img, screen->format,
+			SDL_SWSURFACE) : NULL;
+	SDL_FreeSurface(img);
+	return oldfont ? 0 : -1;
+}
+
+
+static void close_depth(void)
+{
+	gui_close();
+	SDL_FreeSurface(oldfont);
+	oldfont = NULL;
+	SDL_FreeSurface(screen);
+	screen = NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const int depths[] = { 16, 24, 32 };
+	static const struct
+	{
+		const char	*name;
+		const char	*txt;
+	} rows[] = {
+		{ "editor row", "HiHat 0.0.1...\022.3.4...5.6.7...8.9.0.." },
+		{ "highlights", "\002Playing\003\001\007 Looping  \004Tempo" }
+	};
+	char test[320];
+	int i, n, d;
+	int errors = 0;
+
+	for(i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "-h") == 0)
+		{
+			usage(argv[0]);
+			return 0;
+		}
+		else if(strncmp(argv[i], "-t", 2) == 0)
+		{
+			benchms = atoi(argv[i] + 2);
+			if(benchms <= 0)
+			{
+				usage(argv[0]);
+				return -1;
+			}
+		}
+		else
+		{
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if(SDL_Init(0) < 0)
+		return -1;
+	atexit(SDL_Quit);
+
+	/* All characters, bullets and highlights, in lines of 32 */
+	for(i = 1, n = 0; i < 256; ++i)
+	{
+		if((i <= '\007') || (i == '\n') || (i == '\t'))
+			continue;
+		test[n++] = i;
+		if((n % 33) == 32)
+			test[n++] = '\n';
+	}
+	memcpy(test + n, "\003X\002\001\003Y\022Z", 9);
+
+	for(d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d)
+	{
+		int diff;
+		if(open_depth(depths[d]) < 0)
+		{
+			fprintf(stderr, "Couldn't set up %d bpp text rendering!\n",
+					depths[d]);
+			close_depth();
+			++errors;
+			continue;
+		}
+		diff = verify(test);
+		errors += diff;
+		for(i = 0; i < sizeof(rows) / sizeof(rows[0]); ++i)
+		{
+			double before = run(old_gui_text, rows[i].txt);
+			double after = run(gui_text, rows[i].txt);
+			printf("%2d bpp, %s: %10.0f glyphs/s before, %10.0f "
+					"glyphs/s after (%.2fx)%s\n",
+					depths[d], rows[i].name, before, after,
+					after / before, diff ? " MISMATCH!" : "");
+		}
+		close_depth();
+	}
+	return errors ? -1 : 0;
+}
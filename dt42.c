@@ -5,6 +5,8 @@
  */
 
 #include "smixer.h"
+#include "smring.h"
+#include "smlog.h"
 #include "sseq.h"
 #include "gui.h"
 #include "version.h"
@@ -43,6 +45,8 @@ static GUI_pages page = GUI_PAGE_MAIN;	/* Current GUI page */
 
 /* Audio */
 static int abuffer = 2048;		/* Audio buffer size*/
+static int arate = 0;			/* Sample rate; 0 for default */
+static int avoices = 0;			/* Voice pool size; 0 for default */
 /*
  * On Linux with the ALSA backend, OSCBUFFER needs to be
  * BUFFER * 3 for the oscilloscopes to be in sync with
@@ -54,25 +58,72 @@ static int abuffer = 2048;		/* Audio buffer size*/
  */
 static int dbuffer = -1;		/* Sync delay buffer size */
 
-/* Oscilloscopes */
-static int oscpos = 0;			/* Grab buffer position */
-static int plotpos = 0;			/* Plot position */
-static Sint32 *osc_left = NULL;		/* Left audio grab buffer */
-static Sint32 *osc_right = NULL;	/* Right audio grab buffer */
+/*
+ * Sequencer positions captured by the audio context, one per sample
+ * frame, and the estimated capture position of the frame being output
+ * right now.
+ */
+static SM_capture *pos_grab = NULL;	/* Sequencer positions */
+static unsigned grabpos = 0;		/* Last seen capture position */
+static unsigned plotpos = 0;		/* Estimated capture position */
+
+/*
+ * Oscilloscopes. The audio context reduces the output to the min and
+ * max values of each channel over columns of osc_colframes frames, and
+ * captures one DT_envelope per column. Column n starts at capture
+ * position n * osc_colframes.
+ */
+#define	OSC_WIDTH	192
+typedef struct DT_envelope
+{
+	float	min[2];
+	float	max[2];
+} DT_envelope;
+#define	OSC_STRIDE	(int)(sizeof(DT_envelope) / sizeof(float))
+static SM_capture *osc_grab = NULL;	/* Envelopes */
+static int osc_colframes = 1;		/* Frames per scope column */
+static DT_envelope osc_env[OSC_WIDTH];	/* Snapshot of envelopes */
+static DT_envelope osc_acc;		/* Column being built */
+static int osc_accframes = 0;		/* Frames in osc_acc */
+
+/*
+ * Song position moves made by the GUI, that aren't audible yet. The
+ * positions captured before 'frame' are shifted by 'delta', or, if
+ * 'delta' is MOVE_ABSOLUTE, replaced by 'pos'.
+ */
+#define	MAX_MOVES	32
+#define	MOVE_ABSOLUTE	0x7fffffff
+typedef struct
+{
+	unsigned	frame;
+	int		delta;
+	int		pos;
+} DT_move;
+static DT_move moves[MAX_MOVES];
+static int nmoves = 0;
 
 /* Sequencer control */
 static float tempo = 120.0f;		/* Current sequencer tempo */
-static short *playposbuf = NULL;	/* Sequencer pos grab buffer */
 static unsigned playpos = 0;		/* Current pos (calculated) */
 static unsigned last_playpos = -100000;
 static int playing = 0;
 static int looping = 0;
 
+/* DSP load meter */
+static int dspload = 0;			/* Percent */
+static Uint64 last_cbtime = 0;		/* Callback time, last update */
+static Uint64 last_audiotime = 0;	/* Audio time, last update */
+static int print_stats = 0;		/* Print statistics on exit */
+
+/* Message log */
+static FILE *logfile = NULL;		/* Log file, if any */
+
 /* Video */
 static int sdlflags = SDL_SWSURFACE;	/* SDL display init flags */
 
 /* Song file */
 static char *songfilename = NULL;	/* File name of current song */
+static char *loadfilename = NULL;	/* Song being loaded, if any */
 static int must_exist = 1;		/* Exit if file does not exist */
 
 /* Line editor */
@@ -82,6 +133,7 @@ static int ed_pos = 0;			/* Cursor position */
 /* Song editor */
 static unsigned scrollpos = 0;		/* Scroll position */
 static int edtrack = 0;			/* Cursor track */
+static int trackscroll = 0;		/* First track shown */
 static int editing = 0;			/* Editing enabled! */
 static int update_edit = 1;		/* Needs updating! */
 
@@ -90,7 +142,7 @@ static int sel_start_x = -1;		/* Start step */
 static int sel_start_y = -1;		/* Start track */
 static int sel_end_x = -1;		/* End step */
 static int sel_end_y = -1;		/* End track */
-static char *block[SSEQ_TRACKS];	/* Clip board */
+static char *block[SSEQ_MAXTRACKS];	/* Clip board */
 
 static int valid_selection(void)
 {
@@ -107,7 +159,9 @@ static int parse_args(int argc, char *argv[])
 	int i;
 	for(i = 1; i < argc; ++i)
 	{
-		if(strncmp(argv[i], "-f", 2) == 0)
+		if(strcmp(argv[i], "--stats") == 0)
+			print_stats = 1;
+		else if(strncmp(argv[i], "-f", 2) == 0)
 		{
 			sdlflags |= SDL_FULLSCREEN;
 			printf("Requesting fullscreen display.\n");
@@ -117,13 +171,34 @@ static int parse_args(int argc, char *argv[])
 			abuffer = atoi(argv[i] + 2);
 			printf("Requested audio buffer size: %d.\n", abuffer);
 		}
+		else if(strncmp(argv[i], "-r", 2) == 0)
+		{
+			arate = atoi(argv[i] + 2);
+			printf("Requested sample rate: %d.\n", arate);
+		}
 		else if(strncmp(argv[i], "-d", 2) == 0)
 		{
 			dbuffer = atoi(argv[i] + 2);
 			printf("Requested delay buffer size: %d.\n", dbuffer);
 		}
+		else if(strncmp(argv[i], "-v", 2) == 0)
+		{
+			avoices = atoi(argv[i] + 2);
+			printf("Requested voices: %d.\n", avoices);
+		}
 		else if(strncmp(argv[i], "-n", 2) == 0)
 			must_exist = 0;
+		else if(strncmp(argv[i], "-l", 2) == 0)
+		{
+			if(logfile)
+				fclose(logfile);
+			if(!(logfile = fopen(argv[i] + 2, "a")))
+			{
+				fprintf(stderr, "Could not open log file "
+						"\"%s\"!\n", argv[i] + 2);
+				return -1;
+			}
+		}
 		else if(argv[i][0] != '-')
 		{
 			free(songfilename);
@@ -152,9 +227,14 @@ static void usage(const char *exename)
 	fprintf(stderr, "|----------------------------------------------------\n");
 	fprintf(stderr, "| Usage: %s [switches] <file>\n", exename);
 	fprintf(stderr, "| Switches:  -b<x> Audio buffer size\n");
+	fprintf(stderr, "|            -r<x> Sample rate (Hz)\n");
 	fprintf(stderr, "|            -d<x> Delay buffer size\n");
+	fprintf(stderr, "|            -v<x> Voices (default: %d)\n",
+			SM_VOICES);
 	fprintf(stderr, "|            -f    Fullscreen display\n");
 	fprintf(stderr, "|            -n    Create ew song\n");
+	fprintf(stderr, "|            -l<x> Append messages to log file\n");
+	fprintf(stderr, "|            --stats Print audio timing on exit\n");
 	fprintf(stderr, "|            -h    Help\n");
 	fprintf(stderr, "'----------------------------------------------------\n");
 }
@@ -170,61 +250,90 @@ static void breakhandler(int a)
 	Audio processing
 -------------------------------------------------------------------*/
 
-/* Grab data for the oscilloscopes */
-static void grab_process(Sint32 *buf, int frames)
+/* Capture the scope envelopes and the song position for the GUI */
+static void grab_process(float *buf, int frames, void *userdata)
 {
-	int i;
-	short pp = sseq_get_position();
+	int i, ch;
+	short pp[SM_MASTER_CHUNK];
+	short p = sseq_get_position();
+	DT_envelope *e = &osc_acc;
 	for(i = 0; i < frames; ++i)
 	{
-		int ind = (oscpos + i) % dbuffer;
-		osc_left[ind] = buf[i * 2];
-		osc_right[ind] = buf[i * 2 + 1];
-		playposbuf[ind] = pp;
+		for(ch = 0; ch < 2; ++ch)
+		{
+			float s = buf[i * 2 + ch];
+			if(!osc_accframes || (s < e->min[ch]))
+				e->min[ch] = s;
+			if(!osc_accframes || (s > e->max[ch]))
+				e->max[ch] = s;
+		}
+		if(++osc_accframes == osc_colframes)
+		{
+			sm_capture_write(osc_grab, e, 1);
+			osc_accframes = 0;
+		}
 	}
-	oscpos = (oscpos + frames) % dbuffer;
-	plotpos = oscpos;
+
+	/* The position is the same for all frames; write it in pieces */
+	for(i = 0; i < SM_MASTER_CHUNK; ++i)
+		pp[i] = p;
+	for(i = 0; i < frames; i += SM_MASTER_CHUNK)
+		sm_capture_write(pos_grab, pp, frames - i < SM_MASTER_CHUNK ?
+				frames - i : SM_MASTER_CHUNK);
 }
 
 
-/* Soft saturation */
-static void saturate_process(Sint32 *buf, int frames)
+/* Master chain; soft saturation and clipping, and the scopes */
+static void audio_setup(void)
 {
-	int i;
-	frames *= 2;
-	for(i = 0; i < frames; ++i)
-	{
-		float s = (float)buf[i] * (1.0f / 0x800000);
-		buf[i] = (int)((1.5f * s - 0.5f * s*s*s) * 0x800000);
-	}
+	sm_set_bus(SM_BUS_FLOAT);
+	sm_master_insert(-1, sm_master_saturate, NULL);
+	sm_master_insert(-1, grab_process, NULL);
 }
 
 
-/* Clip samples so they don't wrap when converted to 16 bits */
-static void clip_process(Sint32 *buf, int frames)
+/*-------------------------------------------------------------------
+	Message log
+-------------------------------------------------------------------*/
+
+static void log_message(const SM_logrecord *rec, int show)
 {
-	int i;
-	int ind = 0;
-	for(i = 0; i < frames; ++i)
+	sm_log_print(rec, rec->level == SM_LOG_INFO ? stdout : stderr);
+	if(logfile)
+		fprintf(logfile, "%6u.%03u %s\n", rec->time / 1000,
+				rec->time % 1000, rec->text);
+	if(show)
+		gui_log(rec->level, rec->text);
+}
+
+
+/*
+ * Pass queued messages on to the terminal, the log file, and if 'show'
+ * is set, the Message Log page.
+ */
+static void log_messages(int show)
+{
+	SM_logrecord rec;
+	unsigned n;
+	while(sm_log_read(&rec))
+		log_message(&rec, show);
+	if((n = sm_log_dropped()))
 	{
-		if(buf[ind] < -0x800000)
-			buf[ind] = -0x800000;
-		else if (buf[ind] > 0x007fffff)
-			buf[ind] = 0x007fffff;
-		if(buf[ind + 1] < -0x800000)
-			buf[ind + 1] = -0x800000;
-		else if (buf[ind + 1] > 0x007fffff)
-			buf[ind + 1] = 0x007fffff;
-		ind += 2;
+		rec.time = SDL_GetTicks();
+		rec.level = SM_LOG_WARNING;
+		snprintf(rec.text, sizeof(rec.text), "(%u messages lost)", n);
+		log_message(&rec, show);
 	}
 }
 
 
-static void audio_process(Sint32 *buf, int frames)
+static void log_close(void)
 {
-	saturate_process(buf, frames);
-	clip_process(buf, frames);
-	grab_process(buf, frames);
+	log_messages(0);
+	sm_log_queue(0);
+	if(logfile)
+		fclose(logfile);
+	logfile = NULL;
 }
 
 
@@ -232,35 +341,91 @@ static void audio_process(Sint32 *buf, int frames)
 	Sequencer + GUI synchronized operations
 -------------------------------------------------------------------*/
 
-static void move(int notes)
+/*
+ * Song position of the frame at capture position 'frame', with the
+ * moves that weren't audible yet at that point applied.
+ */
+static int captured_position(unsigned frame)
 {
 	int i;
+	short pp;
+	sm_capture_snapshot(pos_grab, &pp, frame, 1);
+	while(nmoves && ((int)(frame - moves[0].frame) >= 0))
+	{
+		--nmoves;
+		memmove(moves, moves + 1, nmoves * sizeof(DT_move));
+	}
+	for(i = 0; i < nmoves; ++i)
+	{
+		if(moves[i].delta == MOVE_ABSOLUTE)
+			pp = moves[i].pos;
+		else
+			pp += moves[i].delta;
+		if(pp < 0)
+			pp = 0;
+	}
+	return pp;
+}
+
+
+static void move(int notes)
+{
 	int pos = sseq_get_position();
 	pos += notes;
 	if(pos < 0)
 		pos = 0;
 	sseq_set_position(pos);
+
+	/*
+	 * The block being mixed right now may not see the new position,
+	 * so we cover that too.
+	 */
+	if(nmoves == MAX_MOVES)
+	{
+		--nmoves;
+		memmove(moves, moves + 1, nmoves * sizeof(DT_move));
+	}
+	moves[nmoves].frame = sm_capture_position(pos_grab) + SM_MAXFRAGMENT;
 	if(playing)
 	{
 /*
 FIXME: This will not do the right thing with looping enabled!
 */
+		moves[nmoves].delta = notes;
 		playpos += notes;
-		for(i = 0; i < dbuffer; ++i)
-		{
-			playposbuf[i] += notes;
-			if(playposbuf[i] < 0)
-				playposbuf[i] = 0;
-		}
-		if(playpos < 0)
+		if((int)playpos < 0)
 			playpos = 0;
 	}
 	else
 	{
+		moves[nmoves].delta = MOVE_ABSOLUTE;
+		moves[nmoves].pos = pos;
 		playpos = pos;
-		for(i = 0; i < dbuffer; ++i)
-			playposbuf[i] = pos;
 	}
+	++nmoves;
+}
+
+
+/*
+ * Move the cursor to track 't', wrapping around, and scroll the editor
+ * to show it. The cursor can go one track past the last one, to add
+ * tracks by editing.
+ */
+static void set_edtrack(int t)
+{
+	int n = sseq_get_tracks() + 1;
+	if(n > SSEQ_MAXTRACKS)
+		n = SSEQ_MAXTRACKS;
+	if(t < 0)
+		t = n - 1;
+	else if(t >= n)
+		t = 0;
+	edtrack = t;
+	if(edtrack < trackscroll)
+		trackscroll = edtrack;
+	else if(edtrack >= trackscroll + GUI_TRACKS)
+		trackscroll = edtrack - GUI_TRACKS + 1;
+	update_edit = 1;
 }
 
 
@@ -324,10 +489,9 @@ static void switch_page(GUI_pages new_page)
 	File I/O
 -------------------------------------------------------------------*/
 
-static int load_song(const char *fn)
+static void song_loaded(const char *fn, int res)
 {
 	char buf[128];
-	int res = sseq_load_song(fn);
 	if(res < 0)
 		snprintf(buf, sizeof(buf), "ERROR Loading \"%s\"!", fn);
 	else
@@ -335,10 +499,55 @@ static int load_song(const char *fn)
 	gui_message(buf, -1);
 	move(-10000);
 	update_edit = 1;
+}
+
+
+static int load_song(const char *fn)
+{
+	int res = sseq_load_song(fn);
+	song_loaded(fn, res);
 	return res;
 }
 
 
+/* Start loading a song in the background. See check_load(). */
+static void start_load(const char *fn)
+{
+	char buf[128];
+	if(sseq_load_start(fn) < 0)
+	{
+		snprintf(buf, sizeof(buf), "ERROR Loading \"%s\"!", fn);
+		gui_message(buf, -1);
+		return;
+	}
+	free(loadfilename);
+	loadfilename = strdup(fn);
+	snprintf(buf, sizeof(buf), "Loading \"%s\"...", fn);
+	gui_message(buf, -1);
+}
+
+
+static void check_load(void)
+{
+	switch(sseq_load_poll())
+	{
+	  case SSEQ_LOAD_DONE:
+		song_loaded(loadfilename, 0);
+		free(songfilename);
+		songfilename = loadfilename;
+		loadfilename = NULL;
+		break;
+	  case SSEQ_LOAD_FAILED:
+		song_loaded(loadfilename, -1);
+		free(loadfilename);
+		loadfilename = NULL;
+		break;
+	  default:
+		break;
+	}
+}
+
+
 static int save_song(const char *fn)
 {
 	char buf[128];
@@ -456,7 +665,7 @@ static void ask_savename(const char *orig)
 static void block_free(void)
 {
 	int i;
-	for(i = 0; i < SSEQ_TRACKS; ++i)
+	for(i = 0; i < SSEQ_MAXTRACKS; ++i)
 	{
 		free(block[i]);
 		block[i] = NULL;
@@ -558,7 +767,7 @@ static void block_delete(void)
 static void block_paste(int x, int y)
 {
 	int i, w = 0;
-	for(i = 0; i < SSEQ_TRACKS; ++i, y = (y + 1) % SSEQ_TRACKS)
+	for(i = 0; (i < SSEQ_MAXTRACKS) && (y < SSEQ_MAXTRACKS); ++i, ++y)
 	{
 		int j;
 		if(!block[i])
@@ -657,11 +866,7 @@ static void handle_key_ask_filename(SDL_Event *ev)
 			}
 			break;
 		  case DM_ASK_LOADNAME:
-			if(load_song(ed_buffer) >= 0)
-			{
-				free(songfilename);
-				songfilename = strdup(ed_buffer);
-			}
+			start_load(ed_buffer);
 		  default:
 			break;
 		}
@@ -737,16 +942,10 @@ static void handle_move_keys(SDL_Event *ev)
 		break;
 	  }
 	  case SDLK_UP:
-		--edtrack;
-		if(edtrack < 0)
-			edtrack = SSEQ_TRACKS - 1;
-		update_edit = 1;
+		set_edtrack(edtrack - 1);
 		break;
 	  case SDLK_DOWN:
-		++edtrack;
-		if(edtrack >= SSEQ_TRACKS)
-			edtrack = 0;
-		update_edit = 1;
+		set_edtrack(edtrack + 1);
 		break;
 	  default:
 		break;
@@ -856,10 +1055,7 @@ static void handle_key_main(SDL_Event *ev)
 	  {
 		int trk = ev->key.keysym.sym - SDLK_F1;
 		if(edtrack != trk)
-		{
-			edtrack = trk;
-			update_edit = 1;
-		}
+			set_edtrack(trk);
 		handle_note(edtrack, '9');
 		break;
 	  }
@@ -1039,15 +1235,43 @@ static void handle_key(SDL_Event *ev)
 	Graphics
 -------------------------------------------------------------------*/
 
-static void update_main(SDL_Surface *screen, int dt)
+/*
+ * Calculate the DSP load since the last update, as the time spent in
+ * the audio callback vs the duration of the audio it generated.
+ */
+static void update_dspload(SM_stats *st)
 {
-	unsigned pos;
+	Uint64 cbtime = st->stages[SM_STAGE_CALLBACK].total;
+	if(st->audiotime == last_audiotime)
+		return;	/* No callbacks since last time */
+	dspload = (cbtime - last_cbtime) * 100 /
+			(st->audiotime - last_audiotime);
+	last_cbtime = cbtime;
+	last_audiotime = st->audiotime;
+}
+
 
-	/* Oscilloscopes */
-	gui_oscilloscope(osc_left, dbuffer, plotpos,
-			240, 8, 192, 128, screen);
-	gui_oscilloscope(osc_right, dbuffer, plotpos,
-			440, 8, 192, 128, screen);
+static void update_main(SDL_Surface *screen, int dt)
+{
+	unsigned pos, col;
+	int behind;
+	SM_stats st;
+
+	/* Oscilloscopes, from the column of the frame being output */
+	col = sm_capture_position(osc_grab);
+	behind = (int)(col * osc_colframes - (plotpos - dbuffer));
+	if(behind > 0)
+		col -= (behind + osc_colframes - 1) / osc_colframes;
+	sm_capture_snapshot(osc_grab, osc_env, col, OSC_WIDTH);
+	gui_oscilloscope(osc_env[0].min, osc_env[0].max, OSC_STRIDE,
+			240, 8, OSC_WIDTH, 128, screen);
+	gui_oscilloscope(osc_env[0].min + 1, osc_env[0].max + 1, OSC_STRIDE,
+			440, 8, OSC_WIDTH, 128, screen);
+
+	/* DSP load, xruns and streaming underruns */
+	sm_get_stats(&st);
+	update_dspload(&st);
+	gui_dspload(dspload, st.xruns, st.underruns);
 
 	/* Update song info and editor */
 	pos = playpos;
@@ -1065,7 +1289,7 @@ static void update_main(SDL_Surface *screen, int dt)
 				sseq_loop(scrollpos, scrollpos + 32);
 		}
 		update_edit = 1;
-		for(i = 0; i < SSEQ_TRACKS; ++i)
+		for(i = 0; i < sseq_get_tracks(); ++i)
 		{
 			int n = sseq_get_note(playpos, i);
 			if((n >= '0') && (n <= '9') && playing &&
@@ -1076,12 +1300,13 @@ static void update_main(SDL_Surface *screen, int dt)
 
 	if(update_edit)
 	{
-		gui_songedit(scrollpos, last_playpos, edtrack, editing);
+		gui_songedit(scrollpos, last_playpos, edtrack, trackscroll,
+				editing);
 		if(valid_selection())
 			gui_songselect(sel_start_x - scrollpos,
-					sel_start_y,
+					sel_start_y - trackscroll,
 					sel_end_x - scrollpos,
-					sel_end_y);
+					sel_end_y - trackscroll);
 		else
 			gui_songselect(-1, -1, -1, -1);
 		update_edit = 0;
@@ -1116,10 +1341,16 @@ int main(int argc, char *argv[])
 
 	if(dbuffer < 0)
 		dbuffer = abuffer * 3;
-	osc_left = calloc(dbuffer, sizeof(Sint32));
-	osc_right = calloc(dbuffer, sizeof(Sint32));
-	playposbuf = calloc(dbuffer, sizeof(short));
-	if(!osc_left || !osc_right || !playposbuf)
+	osc_colframes = dbuffer / OSC_WIDTH;
+	if(osc_colframes < 1)
+		osc_colframes = 1;
+	else if(osc_colframes > 8)
+		osc_colframes = 8;
+	osc_grab = sm_capture_new(sizeof(DT_envelope), OSC_WIDTH +
+			(dbuffer + 4 * SM_MAXFRAGMENT) / osc_colframes + 1);
+	pos_grab = sm_capture_new(sizeof(short),
+			dbuffer + 4 * SM_MAXFRAGMENT);
+	if(!osc_grab || !pos_grab)
 	{
 		fprintf(stderr, "Couldn't allocate delay buffers!\n");
 		SDL_Quit();
@@ -1143,15 +1374,26 @@ int main(int argc, char *argv[])
 	}
 	switch_page(GUI_PAGE_MAIN);
 
-	if(sm_open(abuffer) < 0)
+	/*
+	 * From here on, messages from the engine go through the log
+	 * queue, as they may come from the audio, I/O and loader
+	 * threads. Whatever is left is printed on exit.
+	 */
+	atexit(log_close);
+	sm_log_queue(1);
+
+	if(sm_open(arate, abuffer) < 0)
 	{
+		log_messages(0);
 		fprintf(stderr, "Couldn't start mixer!\n");
 		SDL_Quit();
 		return -1;
 	}
+	if(avoices && (sm_set_voices(avoices) < 0))
+		fprintf(stderr, "Couldn't set up %d voices!\n", avoices);
 
 	sseq_open();
-	sm_set_audio_cb(audio_process);
+	audio_setup();
 
 	/* Try to load song if specified */
 	res = -1;
@@ -1162,6 +1404,7 @@ int main(int argc, char *argv[])
 		{
 			sm_close();
 			SDL_Quit();
+			log_messages(0);
 			fprintf(stderr, "Giving up! (Use the -n option"
 					" to create a new song by name.)\n");
 			return -1;
@@ -1180,6 +1423,7 @@ int main(int argc, char *argv[])
 		{
 			sm_close();
 			SDL_Quit();
+			log_messages(0);
 			fprintf(stderr, "Couldn't load default song!\n");
 			return -1;
 		}
@@ -1232,15 +1476,18 @@ int main(int argc, char *argv[])
 
 		/*
 		 * Update the calculated current play position.
-		 *	We know that the mixer generates 44100 samples/s.
-		 *	Thus, plotpos should advance 44100 samples/s too.
-		 *	osc_process() will resync plotpos every time it
-		 *	runs, so it doesn't drift off over time.
+		 *	We know the rate at which the mixer generates
+		 *	samples, and plotpos should advance at that rate.
+		 *	We resync plotpos every time new audio has been
+		 *	captured, so it doesn't drift off over time.
 		 */
-		plotpos += 44100 * dt / 1000;
+		if(sm_capture_position(pos_grab) != grabpos)
+			plotpos = grabpos = sm_capture_position(pos_grab);
+		else
+			plotpos += sm_get_rate() * dt / 1000;
 
 		/* Figure out current playback song position */
-		playpos = playposbuf[plotpos % dbuffer];
+		playpos = captured_position(plotpos - dbuffer);
 
 		/* Update the screen */
 		switch(page)
@@ -1258,20 +1505,29 @@ int main(int argc, char *argv[])
 
 		last_playpos = playpos;
 
+		/* Messages from the engine */
+		log_messages(1);
+
 		/* Refresh dirty areas of the screen */
 		gui_refresh();
 
+		/* Handle replies from the audio context */
+		sm_poll();
+		check_load();
+
 		/* Try to look less like a CPU hog */
 		SDL_Delay(10);
 	}
 
-	sm_close();
+	if(print_stats)
+		sm_print_stats(stdout);
 	sseq_close();
+	sm_close();
 	gui_close();
 	SDL_Quit();
-	free(osc_left);
-	free(osc_right);
-	free(playposbuf);
+	sm_capture_free(osc_grab);
+	sm_capture_free(pos_grab);
 	free(songfilename);
+	free(loadfilename);
 	return 0;
 }
@@ -11,40 +11,231 @@
 
 #define	MAXACTIVITY	400
 
-static int dirtyrects = 0;
+/*
+ * Dirty tile map, with TILE_SIZE x TILE_SIZE pixels per tile. Rows
+ * dirtytop through dirtybottom - 1 may contain dirty tiles.
+ */
+#define	TILE_SIZE	8
+static Uint8 *dirtytiles = NULL;
+static int tiles_x = 0;
+static int tiles_y = 0;
+static int dirtytop = 0;
+static int dirtybottom = 0;
+
+/* Rects for SDL_UpdateRects(), and the rects ending at each tile column */
 static SDL_Rect dirtytab[MAXRECTS];
+static int *runtab = NULL;
 
 static SDL_Surface *screen = NULL;
 static SDL_Surface *font = NULL;
 
+/*
+ * The font, expanded into the pixel format of the screen, as one block
+ * of FONT_CW x FONT_CH pixels per character code. Codes below 32 are
+ * the bullets, or copies of the DEL glyph, like codes above 127.
+ */
+#define	GLYPHS		128
+static Uint8 *glyphs = NULL;
+static int glyphbpp = 0;	/* Bytes per pixel of 'glyphs' */
+static Uint32 hlcolors[8];	/* Highlight colors, by code; 0 is black */
+
+/* Highlight boxes remembered by gui_text(), for drawing on top */
+#define	GUI_TEXT_HIGHLIGHTS	32
+
 static char *message_text = NULL;
-static int activity[SSEQ_TRACKS];
+static int activity[SSEQ_MAXTRACKS];
+static int firsttrack = 0;	/* First track shown in the editor */
+static GUI_pages curpage = GUI_PAGE_MAIN;
+
+/* Message Log page, as a ring of text rows */
+#define	LOG_X		12
+#define	LOG_Y		52
+#define	LOG_COLS	38
+#define	LOG_ROWS	26
+static char logrows[LOG_ROWS][LOG_COLS + 1];
+static int logfirst = 0;	/* Oldest row */
 
 
 void gui_dirty(SDL_Rect *r)
 {
-	if(dirtyrects < 0)
+	int x1, y1, x2, y2, y;
+	if(!dirtytiles)
 		return;
-	if((dirtyrects >= MAXRECTS) || !r)
-		dirtyrects = -1;
+	if(r)
+	{
+		x1 = r->x < 0 ? 0 : r->x;
+		y1 = r->y < 0 ? 0 : r->y;
+		x2 = r->x + r->w > screen->w ? screen->w : r->x + r->w;
+		y2 = r->y + r->h > screen->h ? screen->h : r->y + r->h;
+		if((x2 <= x1) || (y2 <= y1))
+			return;
+	}
 	else
 	{
-		dirtytab[dirtyrects] = *r;
-		++dirtyrects;
+		x1 = y1 = 0;
+		x2 = screen->w;
+		y2 = screen->h;
+	}
+	x1 /= TILE_SIZE;
+	y1 /= TILE_SIZE;
+	x2 = (x2 + TILE_SIZE - 1) / TILE_SIZE;
+	y2 = (y2 + TILE_SIZE - 1) / TILE_SIZE;
+	for(y = y1; y < y2; ++y)
+		memset(dirtytiles + y * tiles_x + x1, 1, x2 - x1);
+	if(y1 < dirtytop)
+		dirtytop = y1;
+	if(y2 > dirtybottom)
+		dirtybottom = y2;
+}
+
+
+/* Clip the first 'n' rects of dirtytab to the screen, and update them */
+static void update_rects(int n)
+{
+	int i;
+	for(i = 0; i < n; ++i)
+	{
+		SDL_Rect *r = &dirtytab[i];
+		if(r->x + r->w > screen->w)
+			r->w = screen->w - r->x;
+		if(r->y + r->h > screen->h)
+			r->h = screen->h - r->y;
 	}
+	SDL_UpdateRects(screen, n, dirtytab);
 }
 
 
+/*
+ * Turn the dirty tiles into rects. Each row of tiles is scanned for runs
+ * of dirty tiles, and a run that spans the same columns as a run in the
+ * row above is merged with the rect of that run.
+ */
 void gui_refresh(void)
 {
-	if(dirtyrects < 0)
+	int x, y;
+	int n = 0;
+	int *above = runtab;
+	int *cur = runtab + tiles_x;
+	if(dirtytop >= dirtybottom)
+		return;
+	for(x = 0; x < tiles_x; ++x)
+		above[x] = -1;
+	for(y = dirtytop; y < dirtybottom; ++y)
 	{
-		SDL_UpdateRect(screen, 0, 0, 0, 0);
-		dirtyrects = 0;
+		int *tmp;
+		Uint8 *row = dirtytiles + y * tiles_x;
+		for(x = 0; x < tiles_x; ++x)
+			cur[x] = -1;
+		x = 0;
+		while(x < tiles_x)
+		{
+			int x1, i;
+			if(!row[x])
+			{
+				++x;
+				continue;
+			}
+			x1 = x;
+			while((x < tiles_x) && row[x])
+				row[x++] = 0;
+			i = above[x1];
+			if((i >= 0) && (dirtytab[i].w == (x - x1) * TILE_SIZE))
+				dirtytab[i].h += TILE_SIZE;
+			else
+			{
+				if(n >= MAXRECTS)
+				{
+					/* Full; flush, and start over */
+					update_rects(n);
+					n = 0;
+					for(i = 0; i < tiles_x; ++i)
+						above[i] = cur[i] = -1;
+				}
+				i = n++;
+				dirtytab[i].x = x1 * TILE_SIZE;
+				dirtytab[i].y = y * TILE_SIZE;
+				dirtytab[i].w = (x - x1) * TILE_SIZE;
+				dirtytab[i].h = TILE_SIZE;
+			}
+			cur[x1] = i;
+		}
+		tmp = above;
+		above = cur;
+		cur = tmp;
+	}
+	if(n)
+		update_rects(n);
+	dirtytop = tiles_y;
+	dirtybottom = 0;
+}
+
+
+/* Clip 'r' to 'clip'. Returns 0 if nothing is left. */
+static int clip_rect(SDL_Rect *r, const SDL_Rect *clip)
+{
+	int x1 = r->x > clip->x ? r->x : clip->x;
+	int y1 = r->y > clip->y ? r->y : clip->y;
+	int x2 = r->x + r->w < clip->x + clip->w ?
+			r->x + r->w : clip->x + clip->w;
+	int y2 = r->y + r->h < clip->y + clip->h ?
+			r->y + r->h : clip->y + clip->h;
+	if((x2 <= x1) || (y2 <= y1))
+		return 0;
+	r->x = x1;
+	r->y = y1;
+	r->w = x2 - x1;
+	r->h = y2 - y1;
+	return 1;
+}
+
+
+/* Store pixel 'c', 'bpp' bytes per pixel, at 'p' */
+static void store_pixel(Uint8 *p, int bpp, Uint32 c)
+{
+	switch(bpp)
+	{
+	  case 1:
+		*p = c;
+		break;
+	  case 2:
+		*(Uint16 *)p = c;
+		break;
+	  case 3:
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+		p[0] = c;
+		p[1] = c >> 8;
+		p[2] = c >> 16;
+#else
+		p[0] = c >> 16;
+		p[1] = c >> 8;
+		p[2] = c;
+#endif
+		break;
+	  case 4:
+		*(Uint32 *)p = c;
+		break;
+	}
+}
+
+
+/* Fill 'n' pixels from 'p' and down, 'bpp' bytes per pixel */
+static void fill_column(Uint8 *p, int pitch, int bpp, int n, Uint32 c)
+{
+	switch(bpp)
+	{
+	  case 2:
+		for(; n > 0; --n, p += pitch)
+			*(Uint16 *)p = c;
+		break;
+	  case 4:
+		for(; n > 0; --n, p += pitch)
+			*(Uint32 *)p = c;
+		break;
+	  default:
+		for(; n > 0; --n, p += pitch)
+			store_pixel(p, bpp, c);
+		break;
 	}
-	else
-		SDL_UpdateRects(screen, dirtyrects, dirtytab);
-	dirtyrects = 0;
 }
 
 
@@ -95,59 +286,63 @@ void gui_bar(int x, int y, int w, int h, Uint32 c, SDL_Surface *dst)
 }
 
 
-void gui_oscilloscope(Sint32 *buf, int bufsize,
-		int start, int x, int y, int w, int h,
-		SDL_Surface *dst)
+void gui_oscilloscope(const float *min, const float *max, int stride,
+		int x, int y, int w, int h, SDL_Surface *dst)
 {
 	int i;
-	Uint32 green, red;
+	int bpp = dst->format->BytesPerPixel;
+	Uint32 black = SDL_MapRGB(dst->format, 0, 0, 0);
+	Uint32 green = SDL_MapRGB(dst->format, 0, 200, 0);
+	Uint32 red = SDL_MapRGB(dst->format, 255, 0, 0);
+	Uint8 *p;
 	SDL_Rect r;
-	int xscale = bufsize / w;
-	if(xscale < 1)
-		xscale = 1;
-	else if(xscale > 8)
-		xscale = 8;
 
 	r.x = x;
 	r.y = y;
 	r.w = w;
 	r.h = h;
-	SDL_FillRect(dst, &r, SDL_MapRGB(dst->format, 0, 0, 0));
 	gui_dirty(&r);
+	if(!clip_rect(&r, &dst->clip_rect) || (r.w != w) || (r.h != h))
+		return;
+	if(SDL_MUSTLOCK(dst) && (SDL_LockSurface(dst) < 0))
+		return;
 
-	green = SDL_MapRGB(dst->format, 0, 200, 0);
-	red = SDL_MapRGB(dst->format, 255, 0, 0);
-	r.w = 1;
-	for(i = 0; i < w; ++i)
+	/*
+	 * Each column is a span from the center line, or from the max
+	 * value if higher, down to the min value, if lower.
+	 */
+	p = (Uint8 *)dst->pixels + y * dst->pitch + x * bpp;
+	for(i = 0; i < w; ++i, p += bpp)
 	{
 		Uint32 c = green;
-		int s = -buf[(start + i * xscale) % bufsize] >> 8;
-		s *= h;
-		s >>= 16;
-		r.x = x + i;
-		if(s < 0)
+		int top = (int)(max[i * stride] * -32768.0f);
+		int bottom = (int)(min[i * stride] * -32768.0f);
+		top *= h;
+		top >>= 16;
+		bottom *= h;
+		bottom >>= 16;
+		if(top > 0)
+			top = 0;
+		else if(top <= -h / 2)
 		{
-			if(s <= -h / 2)
-			{
-				s = -h / 2;
-				c = red;
-			}
-			r.y = y + h / 2 + s;
-			r.h = -s;
+			top = -h / 2;
+			c = red;
 		}
-		else
+		if(bottom < 0)
+			bottom = 0;
+		else if(++bottom >= h / 2)
 		{
-			++s;
-			if(s >= h / 2)
-			{
-				s = h / 2;
-				c = red;
-			}
-			r.y = y + h / 2;
-			r.h = s;
+			bottom = h / 2;
+			c = red;
 		}
-		SDL_FillRect(dst, &r, c);
+		fill_column(p, dst->pitch, bpp, h / 2 + top, black);
+		fill_column(p + (h / 2 + top) * dst->pitch, dst->pitch, bpp,
+				bottom - top, c);
+		fill_column(p + (h / 2 + bottom) * dst->pitch, dst->pitch, bpp,
+				h - h / 2 - bottom, black);
 	}
+	if(SDL_MUSTLOCK(dst))
+		SDL_UnlockSurface(dst);
 
 	r.x = x;
 	r.y = y + h / 2;
@@ -157,7 +352,6 @@ void gui_oscilloscope(Sint32 *buf, int bufsize,
 }
 
 
-
 SDL_Surface *gui_load_image(const char *fn)
 {
 	SDL_Surface *cvt;
@@ -170,99 +364,221 @@ SDL_Surface *gui_load_image(const char *fn)
 }
 
 
-void gui_text(int x, int y, const char *txt, SDL_Surface *dst)
+/*
+ * Expand 'font', which must already be in format 'fmt', into 'glyphs',
+ * adding the bullets, and map the highlight colors for 'fmt'.
+ */
+static int expand_font(SDL_PixelFormat *fmt)
 {
-	int sx = x;
-	int sy = y;
-	const char *stxt = txt;
-	int highlights = 0;
-	SDL_Rect sr;
-	sr.w = FONT_CW;
-	sr.h = FONT_CH;
-	while(*txt)
+	int c, x, y;
+	int bpp = fmt->BytesPerPixel;
+	int gsize = FONT_CW * FONT_CH * bpp;
+	int fcols = font->w / FONT_CW;
+	Uint8 *g = malloc(GLYPHS * gsize);
+	if(!g)
+		return -1;
+	for(c = 0; c < 8; ++c)
+		hlcolors[c] = SDL_MapRGB(fmt, c & 1 ? 255 : 0,
+				c & 2 ? 255 : 0, c & 4 ? 255 : 0);
+	if(SDL_MUSTLOCK(font) && (SDL_LockSurface(font) < 0))
 	{
-		int c = *txt++;
-		switch(c)
+		free(g);
+		return -1;
+	}
+	for(c = 0; c < GLYPHS; ++c)
+	{
+		Uint8 *d = g + c * gsize;
+		if((c >= '\021') && (c <= '\027'))
 		{
-		  case 0:	/* terminator */
-			break;
-		  case '\n':	/* newline */
-			x = sx;
-			y += FONT_CH;
-			break;
-		  case '\t':	/* tab */
-			x -= sx;
-			x += 8 * FONT_CW;
-			x %= 8 * FONT_CW;
-			x += sx;
-			break;
-		  case '\001':	/* red highlight */
-		  case '\002':	/* green highlight */
-		  case '\003':	/* yellow highlight */
-		  case '\004':	/* blue highlight */
-		  case '\005':	/* purple highlight */
-		  case '\006':	/* cyan highlight */
-		  case '\007':	/* white highlight */
-			highlights = 1;
-			if(*txt == '\001')
-				txt += 2;
-			break;
-		  case '\021':	/* red bullet */
-		  case '\022':	/* green bullet */
-		  case '\023':	/* yellow bullet */
-		  case '\024':	/* blue bullet */
-		  case '\025':	/* purple bullet */
-		  case '\026':	/* cyan bullet */
-		  case '\027':	/* white bullet */
-		  {
-			SDL_Rect r;
-			int hlr = c & 1 ? 255 : 0;
-			int hlg = c & 2 ? 255 : 0;
-			int hlb = c & 4 ? 255 : 0;
-			Uint32 hlc = SDL_MapRGB(dst->format, hlr, hlg, hlb);
-			r.x = x;
-			r.y = y;
-			r.w = FONT_CW;
-			r.h = FONT_CH;
-			SDL_FillRect(dst, &r,
-					SDL_MapRGB(dst->format, 0, 0, 0));
-			gui_dirty(&r);
-			r.x = x + 2;
-			r.y = y + 2;
-			r.w = FONT_CW - 6;
-			r.h = FONT_CH - 6;
-			SDL_FillRect(dst, &r, hlc);
-			x += FONT_CW;
-			break;
-		  }
-		  default:	/* printables */
-		  {
-			SDL_Rect dr;
-			if(c < ' ' || c > 127)
-				c = 127;
-			c -= 32;
-			sr.x = (c % (font->w / FONT_CW)) * FONT_CW;
-			sr.y = (c / (font->w / FONT_CW)) * FONT_CH;
-			dr.x = x;
-			dr.y = y;
-			SDL_BlitSurface(font, &sr, dst, &dr);
-			gui_dirty(&dr);
-			x += FONT_CW;
-			break;
-		  }
+			/* Bullet; a square in highlight color c & 7 */
+			for(y = 0; y < FONT_CH; ++y)
+				for(x = 0; x < FONT_CW; ++x)
+				{
+					int in = (x >= 2) && (x < FONT_CW - 4) &&
+							(y >= 2) &&
+							(y < FONT_CH - 4);
+					store_pixel(d + (y * FONT_CW + x) * bpp,
+							bpp, hlcolors[in ?
+							c & 7 : 0]);
+				}
+		}
+		else
+		{
+			int i = (c < ' ' ? 127 : c) - 32;
+			Uint8 *src = (Uint8 *)font->pixels +
+					i / fcols * FONT_CH * font->pitch +
+					i % fcols * FONT_CW * bpp;
+			for(y = 0; y < FONT_CH; ++y)
+				memcpy(d + y * FONT_CW * bpp,
+						src + y * font->pitch,
+						FONT_CW * bpp);
 		}
 	}
-	if(!highlights)
+	if(SDL_MUSTLOCK(font))
+		SDL_UnlockSurface(font);
+	free(glyphs);
+	glyphs = g;
+	glyphbpp = bpp;
+	return 0;
+}
+
+
+/* Draw character or bullet 'c' at (x, y) with SDL_BlitSurface() */
+static void blit_char(int x, int y, int c, SDL_Surface *dst)
+{
+	SDL_Rect sr, dr;
+	dr.x = x;
+	dr.y = y;
+	if((c >= '\021') && (c <= '\027'))
+	{
+		dr.w = FONT_CW;
+		dr.h = FONT_CH;
+		SDL_FillRect(dst, &dr, hlcolors[0]);
+		dr.x = x + 2;
+		dr.y = y + 2;
+		dr.w = FONT_CW - 6;
+		dr.h = FONT_CH - 6;
+		SDL_FillRect(dst, &dr, hlcolors[c & 7]);
 		return;
-	x = sx;
-	y = sy;
-	txt = stxt;
+	}
+	if(c < ' ' || c > 127)
+		c = 127;
+	c -= 32;
+	sr.x = (c % (font->w / FONT_CW)) * FONT_CW;
+	sr.y = (c / (font->w / FONT_CW)) * FONT_CH;
+	sr.w = FONT_CW;
+	sr.h = FONT_CH;
+	SDL_BlitSurface(font, &sr, dst, &dr);
+}
+
+
+/*
+ * Copy glyph 'c' to (x, y) of the locked surface 'dst', clipped to the
+ * clip rect. Unclipped glyphs are copied in fixed size rows.
+ */
+static void put_glyph(int x, int y, int c, SDL_Surface *dst)
+{
+	int row;
+	int bpp = glyphbpp;
+	const Uint8 *g;
+	Uint8 *d;
+	SDL_Rect r;
+	if((c < 0) || (c >= GLYPHS) || ((c < ' ') &&
+			((c < '\021') || (c > '\027'))))
+		c = 127;
+	g = glyphs + c * FONT_CW * FONT_CH * bpp;
+	r.x = x;
+	r.y = y;
+	r.w = FONT_CW;
+	r.h = FONT_CH;
+	if(!clip_rect(&r, &dst->clip_rect))
+		return;
+	g += ((r.y - y) * FONT_CW + r.x - x) * bpp;
+	d = (Uint8 *)dst->pixels + r.y * dst->pitch + r.x * bpp;
+	if(r.w != FONT_CW)
+	{
+		for(row = 0; row < r.h; ++row)
+			memcpy(d + row * dst->pitch,
+					g + row * FONT_CW * bpp, r.w * bpp);
+		return;
+	}
+	switch(bpp)
+	{
+	  case 2:
+		for(row = 0; row < r.h; ++row)
+			memcpy(d + row * dst->pitch,
+					g + row * FONT_CW * 2, FONT_CW * 2);
+		break;
+	  case 3:
+		for(row = 0; row < r.h; ++row)
+			memcpy(d + row * dst->pitch,
+					g + row * FONT_CW * 3, FONT_CW * 3);
+		break;
+	  case 4:
+		for(row = 0; row < r.h; ++row)
+			memcpy(d + row * dst->pitch,
+					g + row * FONT_CW * 4, FONT_CW * 4);
+		break;
+	  default:
+		for(row = 0; row < r.h; ++row)
+			memcpy(d + row * dst->pitch,
+					g + row * FONT_CW * bpp, FONT_CW * bpp);
+		break;
+	}
+}
+
+
+/*
+ * Draw the 'n' characters and bullets from 's' in a row, starting at
+ * (x, y). Does not add any dirtyrects.
+ */
+static void draw_chars(int x, int y, const char *s, int n, SDL_Surface *dst)
+{
+	int i;
+	if(!glyphs || (dst != screen))
+	{
+		for(i = 0; i < n; ++i)
+			blit_char(x + i * FONT_CW, y, s[i], dst);
+		return;
+	}
+	if(SDL_MUSTLOCK(dst) && (SDL_LockSurface(dst) < 0))
+		return;
+	for(i = 0; i < n; ++i)
+		put_glyph(x + i * FONT_CW, y, s[i], dst);
+	if(SDL_MUSTLOCK(dst))
+		SDL_UnlockSurface(dst);
+}
+
+
+/* Add the area from (x1, y1) to (x2, y2), clipped to 'dst', as dirty */
+static void dirty_area(int x1, int y1, int x2, int y2, SDL_Surface *dst)
+{
+	SDL_Rect r;
+	r.x = x1;
+	r.y = y1;
+	r.w = x2 - x1;
+	r.h = y2 - y1;
+	if((x2 > x1) && (y2 > y1) && clip_rect(&r, &dst->clip_rect))
+		gui_dirty(&r);
+}
+
+
+void gui_text(int x, int y, const char *txt, SDL_Surface *dst)
+{
+	int sx = x;
+	int x1 = 0x7fff, y1 = 0x7fff, x2 = -0x8000, y2 = -0x8000;
+	int i, nhl = 0;
+	struct
+	{
+		int	x, y, w, c;
+	} hl[GUI_TEXT_HIGHLIGHTS];
 	while(*txt)
 	{
-		int c = *txt++;
-		switch(c)
+		int c;
+
+		/* Draw runs of characters and bullets in one go */
+		const char *run = txt;
+		while(*txt && (*txt != '\n') && (*txt != '\t') &&
+				((*txt < '\001') || (*txt > '\007')))
+			++txt;
+		if(txt > run)
+		{
+			draw_chars(x, y, run, txt - run, dst);
+			if(x < x1)
+				x1 = x;
+			if(y < y1)
+				y1 = y;
+			x += (txt - run) * FONT_CW;
+			if(x > x2)
+				x2 = x;
+			if(y + FONT_CH > y2)
+				y2 = y + FONT_CH;
+		}
+
+		switch((c = *txt++))
 		{
 		  case 0:	/* terminator */
+			--txt;
 			break;
 		  case '\n':	/* newline */
 			x = sx;
@@ -274,34 +590,36 @@ void gui_text(int x, int y, const char *txt, SDL_Surface *dst)
 			x %= 8 * FONT_CW;
 			x += sx;
 			break;
-		  case '\001':	/* red highlight */
-		  case '\002':	/* green highlight */
-		  case '\003':	/* yellow highlight */
-		  case '\004':	/* blue highlight */
-		  case '\005':	/* purple highlight */
-		  case '\006':	/* cyan highlight */
-		  case '\007':	/* white highlight */
-		  {
-			int hlr = c & 1 ? 255 : 0;
-			int hlg = c & 2 ? 255 : 0;
-			int hlb = c & 4 ? 255 : 0;
-			Uint32 hlc = SDL_MapRGB(screen->format, hlr, hlg, hlb);
-			int hlw = 1;
+		  default:	/* red...white highlight */
+			if(nhl == GUI_TEXT_HIGHLIGHTS)
+			{
+				/* Out of space! Draw the ones we have. */
+				for(i = 0; i < nhl; ++i)
+					gui_box(hl[i].x - 2, hl[i].y - 2,
+							FONT_CW * hl[i].w + 2,
+							FONT_CH + 2,
+							hlcolors[hl[i].c], dst);
+				nhl = 0;
+			}
+			hl[nhl].x = x;
+			hl[nhl].y = y;
+			hl[nhl].c = c;
+			hl[nhl].w = 1;
 			if(*txt == '\001')
 			{
-				hlw = txt[1];
+				hl[nhl].w = txt[1];
 				txt += 2;
 			}
-			gui_box(x - 2, y - 2,
-					FONT_CW * hlw + 2, FONT_CH + 2,
-					hlc, dst);
-			break;
-		  }
-		  default:	/* printables */
-			x += FONT_CW;
+			++nhl;
 			break;
 		}
 	}
+	dirty_area(x1, y1, x2, y2, dst);
+
+	/* Highlight boxes go on top of the text */
+	for(i = 0; i < nhl; ++i)
+		gui_box(hl[i].x - 2, hl[i].y - 2, FONT_CW * hl[i].w + 2,
+				FONT_CH + 2, hlcolors[hl[i].c], dst);
 }
 
 
@@ -321,66 +639,343 @@ void gui_songpos(int v)
 }
 
 
-void gui_songedit(int pos, int ppos, int track, int editing)
+/*
+ * DSP load, xrun count and streaming underrun count, over the bottom
+ * of the oscilloscopes. Underruns are only shown once there are any.
+ */
+void gui_dspload(int load, int xruns, int underruns)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "DSP%4d%%", load);
+	gui_text(240 + 4, 8 + 128 - FONT_CH - 4, buf, screen);
+	snprintf(buf, sizeof(buf), "XRUN%4d", xruns);
+	gui_text(440 + 4, 8 + 128 - FONT_CH - 4, buf, screen);
+	if(!underruns)
+		return;
+	snprintf(buf, sizeof(buf), "UNDR%4d", underruns);
+	gui_text(440 + 4, 8 + 128 - 2 * FONT_CH - 4, buf, screen);
+}
+
+
+/* Name of track 't' */
+static void track_name(char *buf, size_t size, int t)
+{
+	static const char *names[] = { "Kick", "Clap", "Bell", "HiHat" };
+	if(t < 4)
+		snprintf(buf, size, "%s", names[t]);
+	else if(t < 100)
+		snprintf(buf, size, "Trk%.2d", t);
+	else
+		snprintf(buf, size, "Tr%.3d", t);
+}
+
+
+/*
+ * Song editor shadow grid
+ *
+ *	The editor is a grid of SE_COLS x SE_ROWS character cells, with
+ *	the time bars in the first and last rows, and a list of filled
+ *	rectangles (highlight boxes and the selection box) drawn on top.
+ *	We keep what is on the screen, and what we want there, and only
+ *	repaint the cells that differ, or that are touched by a rectangle
+ *	that has changed.
+ */
+#define	SE_X		12
+#define	SE_Y		146
+#define	SE_COLS		38
+#define	SE_ROWS		(GUI_TRACKS + 2)
+#define	SE_NOTES	6	/* First note column */
+
+/* Fill slots, in drawing order */
+#define	SE_TRACKCURS	0	/* Track cursor box */
+#define	SE_BARMARKS	4	/* Lower time bar markers; 4 boxes */
+#define	SE_UPPERCURS	20	/* Play cursor, upper time bar */
+#define	SE_LOWERCURS	24	/* Play cursor, lower time bar */
+#define	SE_EDITCURS	28	/* Edit cursor box */
+#define	SE_SELECTION	32	/* Selection box */
+#define	SE_FILLS	36
+
+typedef struct
+{
+	SDL_Rect	r;	/* w == 0 means unused */
+	Uint32		color;
+} SE_fill;
+
+static char se_shown[SE_ROWS][SE_COLS];
+static char se_want[SE_ROWS][SE_COLS];
+static Uint8 se_repaint[SE_ROWS][SE_COLS];
+static SE_fill se_shownfills[SE_FILLS];
+static SE_fill se_wantfills[SE_FILLS];
+static int se_valid = 0;	/* 0 forces a full repaint */
+static int se_pos = -1;		/* Song position shown */
+
+
+/* Screen position of the character in cell (col, row) */
+static void se_cellpos(int col, int row, int *x, int *y)
+{
+	*x = SE_X + FONT_CW * col;
+	if(row == 0)
+		*y = SE_Y;
+	else if(row < SE_ROWS - 1)
+		*y = SE_Y + FONT_CH * row + 3;
+	else
+		*y = SE_Y + FONT_CH * row + 6;
+}
+
+
+/*
+ * Area owned by cell (col, row). This is the character, plus any
+ * margins and gaps towards the edges of the editor and the time bars,
+ * so that the cells together tile the whole editor area.
+ */
+static void se_cellrect(int col, int row, SDL_Rect *r)
+{
+	int x, y;
+	se_cellpos(col, row, &x, &y);
+	r->x = x;
+	r->y = y;
+	r->w = FONT_CW;
+	r->h = FONT_CH;
+	if(col == 0)
+	{
+		r->x -= 2;
+		r->w += 2;
+	}
+	if(col == SE_COLS - 1)
+		r->w += 2;
+	if(row == 0)
+	{
+		r->y -= 2;
+		r->h += 2;
+	}
+	else if((row == 1) || (row == SE_ROWS - 1))
+	{
+		r->y -= 3;
+		r->h += 3;
+	}
+	if(row == SE_ROWS - 1)
+		r->h += 1;
+}
+
+
+/* Set up a filled rectangle in 'slot', clipped to 'clip' if specified */
+static void se_fill(int slot, int x, int y, int w, int h, Uint32 c,
+		const SDL_Rect *clip)
+{
+	SE_fill *f = &se_wantfills[slot];
+	f->r.x = x;
+	f->r.y = y;
+	f->r.w = w;
+	f->r.h = h;
+	f->color = c;
+	if(clip && !clip_rect(&f->r, clip))
+		f->r.w = 0;
+}
+
+
+/*
+ * Set up a gui_box() style highlight box in slots 'slot'..'slot' + 3,
+ * around 'w' cells from cell (col, row), or remove it if 'hl' is 0.
+ */
+static void se_box(int slot, int col, int row, int w, int hl)
+{
+	int i, x, y;
+	Uint32 c = hlcolors[hl];
+	if(!hl || (row < 0) || (row >= SE_ROWS))
+	{
+		for(i = 0; i < 4; ++i)
+			se_wantfills[slot + i].r.w = 0;
+		return;
+	}
+	se_cellpos(col, row, &x, &y);
+	x -= 2;
+	y -= 2;
+	w = FONT_CW * w + 2;
+	se_fill(slot, x, y, w, 1, c, NULL);
+	se_fill(slot + 1, x, y + FONT_CH + 1, w, 1, c, NULL);
+	se_fill(slot + 2, x, y + 1, 1, FONT_CH, c, NULL);
+	se_fill(slot + 3, x + w - 1, y + 1, 1, FONT_CH, c, NULL);
+}
+
+
+/* Mark all cells touched by 'r' for repainting */
+static void se_touch(const SDL_Rect *r)
+{
+	int col, row;
+	if(!r->w)
+		return;
+	for(row = 0; row < SE_ROWS; ++row)
+		for(col = 0; col < SE_COLS; ++col)
+		{
+			SDL_Rect cr;
+			se_cellrect(col, row, &cr);
+			if(clip_rect(&cr, r))
+				se_repaint[row][col] = 1;
+		}
+}
+
+
+/* Draw all fills, clipped to the current clip rect of the screen */
+static void se_draw_fills(void)
+{
+	int i;
+	for(i = 0; i < SE_FILLS; ++i)
+	{
+		SDL_Rect r = se_wantfills[i].r;
+		if(r.w)
+			SDL_FillRect(screen, &r, se_wantfills[i].color);
+	}
+}
+
+
+/* Bring the editor on the screen up to date with se_want/se_wantfills */
+static void se_update(void)
+{
+	int col, row, i;
+	SDL_Rect r;
+	Uint32 black = hlcolors[0];
+
+	if(!se_valid)
+	{
+		/* Full repaint */
+		r.x = SE_X - 2;
+		r.y = SE_Y - 2;
+		r.w = FONT_CW * SE_COLS + 4;
+		r.h = FONT_CH * SE_ROWS + 4 + 5;
+		SDL_FillRect(screen, &r, black);
+		gui_dirty(&r);
+		for(row = 0; row < SE_ROWS; ++row)
+			for(col = 0; col < SE_COLS; )
+			{
+				/* Runs of non-empty cells */
+				int x, y;
+				int first = col;
+				while((col < SE_COLS) && se_want[row][col])
+					++col;
+				if(col == first)
+				{
+					++col;
+					continue;
+				}
+				se_cellpos(first, row, &x, &y);
+				draw_chars(x, y, se_want[row] + first,
+						col - first, screen);
+			}
+		se_draw_fills();
+		memcpy(se_shown, se_want, sizeof(se_shown));
+		memcpy(se_shownfills, se_wantfills, sizeof(se_shownfills));
+		se_valid = 1;
+		return;
+	}
+
+	/* Find cells with changed characters, or touched by changed fills */
+	memset(se_repaint, 0, sizeof(se_repaint));
+	for(row = 0; row < SE_ROWS; ++row)
+		for(col = 0; col < SE_COLS; ++col)
+			if(se_shown[row][col] != se_want[row][col])
+				se_repaint[row][col] = 1;
+	for(i = 0; i < SE_FILLS; ++i)
+	{
+		SE_fill *sf = &se_shownfills[i];
+		SE_fill *wf = &se_wantfills[i];
+		if(!sf->r.w && !wf->r.w)
+			continue;
+		if((sf->r.x == wf->r.x) && (sf->r.y == wf->r.y) &&
+				(sf->r.w == wf->r.w) &&
+				(sf->r.h == wf->r.h) &&
+				(sf->color == wf->color))
+			continue;
+		se_touch(&sf->r);
+		se_touch(&wf->r);
+		*sf = *wf;
+	}
+
+	/* Repaint them, clipped, with everything that overlaps */
+	for(row = 0; row < SE_ROWS; ++row)
+		for(col = 0; col < SE_COLS; ++col)
+		{
+			int x, y;
+			if(!se_repaint[row][col])
+				continue;
+			se_cellrect(col, row, &r);
+			SDL_SetClipRect(screen, &r);
+			SDL_FillRect(screen, &r, black);
+			se_cellpos(col, row, &x, &y);
+			if(se_want[row][col])
+				draw_chars(x, y, se_want[row] + col, 1,
+						screen);
+			se_draw_fills();
+			SDL_SetClipRect(screen, NULL);
+			gui_dirty(&r);
+			se_shown[row][col] = se_want[row][col];
+		}
+}
+
+
+/* Forget what is on the screen, and start over with an empty editor */
+static void se_reset(void)
+{
+	memset(se_want, 0, sizeof(se_want));
+	memset(se_wantfills, 0, sizeof(se_wantfills));
+	se_valid = 0;
+	se_pos = -1;
+}
+
+
+/*
+ * Draw the song editor, showing GUI_TRACKS tracks from track 'first',
+ * with the cursor on 'track'. Only changed cells are repainted, unless
+ * 'pos' has moved to another page.
+ */
+void gui_songedit(int pos, int ppos, int track, int first, int editing)
 {
 	int t, n;
 	char buf[128];
-	SDL_Rect r;
-	const int y0 = 146;
+	int pcol = SE_NOTES + (ppos & 0x1f);
 
-	/* Clear */
-	r.x = 12 - 2;
-	r.y = y0 - 2;
-	r.w = FONT_CW * 38 + 4;
-	r.h = FONT_CH * (SSEQ_TRACKS + 2) + 4 + 5;
-	SDL_FillRect(screen, &r, SDL_MapRGB(screen->format, 0, 0, 0));
-	gui_dirty(&r);
+	firsttrack = first;
+	if(pos != se_pos)
+	{
+		se_valid = 0;
+		se_pos = pos;
+	}
 
 	/* Upper time bar */
-	snprintf(buf, sizeof(buf), "\027...\022...\022...\022..."
-			"\027...\022...\022...\022...");
-	gui_text(12 + 6 * FONT_CW, y0, buf, screen);
+	memcpy(se_want[0] + SE_NOTES, "\027...\022...\022...\022..."
+			"\027...\022...\022...\022...", 32);
 
 	/* Track names + cursor */
-	gui_text(12, y0 + FONT_CH + 3, "Kick\nClap\nBell\nHiHat\n"
-			"Trk04\nTrk05\nTrk06\nTrk07\n"
-			"Trk08\nTrk09\nTrk10\nTrk11\n"
-			"Trk12\nTrk13\nTrk14\nTrk15",
-			screen);
-	gui_text(12, y0 + FONT_CH * (1 + track) + 3,
-			"\003\001\005", screen);
+	for(t = 0; t < GUI_TRACKS; ++t)
+	{
+		memset(se_want[1 + t], 0, SE_NOTES);
+		track_name(buf, sizeof(buf), first + t);
+		memcpy(se_want[1 + t], buf, strlen(buf));
+	}
+	se_box(SE_TRACKCURS, 0, 1 + track - first, 5, 3);
 
 	/* Lower time bar */
-	snprintf(buf, sizeof(buf), "\007%.4d\022...\007%.4d\022..."
-			"\007%.4d\022...\007%.4d\022...",
-			pos, pos + 8, pos + 16, pos + 24);
-	gui_text(12 + 6 * FONT_CW,
-			y0 + FONT_CH * (SSEQ_TRACKS + 1) + 6, buf, screen);
+	for(n = 0; n < 4; ++n)
+	{
+		snprintf(buf, sizeof(buf), "%.4d\022...", pos + n * 8);
+		memcpy(se_want[SE_ROWS - 1] + SE_NOTES + n * 8, buf, 8);
+		se_box(SE_BARMARKS + n * 4, SE_NOTES + n * 8, SE_ROWS - 1,
+				1, 7);
+	}
 
 	/* Notes */
-	buf[1] = 0;
-	for(t = 0; t < SSEQ_TRACKS; ++t)
+	for(t = 0; t < GUI_TRACKS; ++t)
 		for(n = 0; n < 32; ++n)
 		{
-			int note = sseq_get_note(pos + n, t);
-			if(note < 0)
-				continue;
-			else
-				buf[0] = note;
-			gui_text(12 + FONT_CW * (6 + n),
-					y0 + FONT_CH * (1 + t) + 3,
-					buf, screen);
+			int note = sseq_get_note(pos + n, first + t);
+			se_want[1 + t][SE_NOTES + n] = note < 0 ? 0 : note;
 		}
 
 	/* Cursors */
-	gui_text(12 + FONT_CW * (6 + (ppos & 0x1f)), y0, "\003", screen);
-	gui_text(12 + FONT_CW * (6 + (ppos & 0x1f)),
-			y0 + FONT_CH * (SSEQ_TRACKS + 1) + 6,
-			"\003", screen);
-	if(editing)
-		gui_text(12 + FONT_CW * (6 + (ppos & 0x1f)),
-				y0 + FONT_CH * (1 + track) + 3,
-				"\007", screen);
+	se_box(SE_UPPERCURS, pcol, 0, 1, 3);
+	se_box(SE_LOWERCURS, pcol, SE_ROWS - 1, 1, 3);
+	se_box(SE_EDITCURS, pcol, 1 + track - first, 1, editing ? 7 : 0);
+
+	se_update();
 }
 
 
@@ -393,19 +988,24 @@ void gui_draw_activity(int dt)
 	r.x = x0 + 1;
 	r.y = y0 + 1;
 	r.w = FONT_CW - 3;
-	r.h = FONT_CH * SSEQ_TRACKS - 3;
+	r.h = FONT_CH * GUI_TRACKS - 3;
 	gui_dirty(&r);
 
-	for(t = 0; t < SSEQ_TRACKS; ++t)
+	for(t = 0; t < SSEQ_MAXTRACKS; ++t)
+	{
+		activity[t] -= dt;
+		if(activity[t] < 0)
+			activity[t] = 0;
+	}
+
+	for(t = firsttrack; (t < firsttrack + GUI_TRACKS) &&
+			(t < SSEQ_MAXTRACKS); ++t)
 	{
 		Uint32 c;
 		r.x = x0 + 1;
-		r.y = y0 + t * FONT_CH + 1;
+		r.y = y0 + (t - firsttrack) * FONT_CH + 1;
 		r.w = FONT_CW - 3;
 		r.h = FONT_CH - 3;
-		activity[t] -= dt;
-		if(activity[t] < 0)
-			activity[t] = 0;
 		c = activity[t] * 255 / MAXACTIVITY;
 		c = c * c * c / (255 * 255);
 		if(sseq_muted(t))
@@ -419,7 +1019,8 @@ void gui_draw_activity(int dt)
 
 void gui_activity(int trk)
 {
-	activity[trk] = MAXACTIVITY;
+	if(trk >= 0 && trk < SSEQ_MAXTRACKS)
+		activity[trk] = MAXACTIVITY;
 }
 
 
@@ -463,9 +1064,9 @@ static void gui_select_range(int from, int to)
 void gui_songselect(int x1, int y1, int x2, int y2)
 {
 	int i;
-	const int x0 = 12 + FONT_CW * 6;
-	const int y0 = 146 + FONT_CH + 3;
-	SDL_Rect r;
+	const int x0 = SE_X + FONT_CW * SE_NOTES;
+	const int y0 = SE_Y + FONT_CH + 3;
+	SDL_Rect clip;
 	Uint32 c = SDL_MapRGB(screen->format, 255, 128, 255);
 
 	/* Sort coordinates */
@@ -486,40 +1087,28 @@ void gui_songselect(int x1, int y1, int x2, int y2)
 	gui_select_range(x1, x2);
 
 	if(x1 == x2)
-		return;		/* No selection! */
-
-	/* Draw selection box */
-	r.x = x0 - 2;
-	r.y = y0 - 2;
-	r.w = FONT_CW * 32 + 4;
-	r.h = FONT_CH * SSEQ_TRACKS + 4;
-	SDL_SetClipRect(screen, &r);
-
-	r.x = x0 + x1 * FONT_CW - 2;
-	r.y = y0 + y1 * FONT_CH - 2;
-	r.w = (x2 - x1) * FONT_CW + 4;
-	r.h = 2;
-	SDL_FillRect(screen, &r, c);
-
-	r.x = x0 + x1 * FONT_CW - 2;
-	r.y = y0 + y2 * FONT_CH;
-	r.w = (x2 - x1) * FONT_CW + 4;
-	r.h = 2;
-	SDL_FillRect(screen, &r, c);
-
-	r.x = x0 + x1 * FONT_CW - 2;
-	r.y = y0 + y1 * FONT_CH;
-	r.w = 2;
-	r.h = (y2 - y1) * FONT_CW;
-	SDL_FillRect(screen, &r, c);
-
-	r.x = x0 + x2 * FONT_CW;
-	r.y = y0 + y1 * FONT_CH;
-	r.w = 2;
-	r.h = (y2 - y1) * FONT_CW;
-	SDL_FillRect(screen, &r, c);
+	{
+		/* No selection! */
+		for(i = 0; i < 4; ++i)
+			se_wantfills[SE_SELECTION + i].r.w = 0;
+		se_update();
+		return;
+	}
 
-	SDL_SetClipRect(screen, NULL);
+	/* Selection box, clipped to the note area */
+	clip.x = x0 - 2;
+	clip.y = y0 - 2;
+	clip.w = FONT_CW * 32 + 4;
+	clip.h = FONT_CH * GUI_TRACKS + 4;
+	se_fill(SE_SELECTION, x0 + x1 * FONT_CW - 2, y0 + y1 * FONT_CH - 2,
+			(x2 - x1) * FONT_CW + 4, 2, c, &clip);
+	se_fill(SE_SELECTION + 1, x0 + x1 * FONT_CW - 2, y0 + y2 * FONT_CH,
+			(x2 - x1) * FONT_CW + 4, 2, c, &clip);
+	se_fill(SE_SELECTION + 2, x0 + x1 * FONT_CW - 2, y0 + y1 * FONT_CH,
+			2, (y2 - y1) * FONT_CW, c, &clip);
+	se_fill(SE_SELECTION + 3, x0 + x2 * FONT_CW, y0 + y1 * FONT_CH,
+			2, (y2 - y1) * FONT_CW, c, &clip);
+	se_update();
 }
 
 
@@ -596,7 +1185,8 @@ static void draw_help(GUI_pages page)
 				"\027PgUp/PgDn\n"
 				"    Prev/next bar.\n\n"
 				"\027Up/Down Arrows\n"
-				"    Prev/next track.\n\n"
+				"    Prev/next track. Going past the\n"
+				"    last track adds a new one.\n\n"
 				"\027+/-\n"
 				"    Tempo up/down 1 BPM.\n\n"
 				"\027L\n"
@@ -651,6 +1241,69 @@ static void draw_help(GUI_pages page)
 }
 
 
+static void draw_log_rows(void)
+{
+	int i;
+	SDL_Rect r;
+	r.x = LOG_X;
+	r.y = LOG_Y;
+	r.w = LOG_COLS * FONT_CW;
+	r.h = LOG_ROWS * FONT_CH;
+	SDL_FillRect(screen, &r, SDL_MapRGB(screen->format, 0, 0, 0));
+	gui_dirty(&r);
+	for(i = 0; i < LOG_ROWS; ++i)
+		gui_text(LOG_X, LOG_Y + i * FONT_CH,
+				logrows[(logfirst + i) % LOG_ROWS], screen);
+}
+
+
+static void log_row(const char *text, int len)
+{
+	char *row = logrows[logfirst];
+	logfirst = (logfirst + 1) % LOG_ROWS;
+	memcpy(row, text, len);
+	row[len] = 0;
+}
+
+
+/*
+ * Messages start with a bullet in the color of the level, and wrap
+ * at spaces where possible, with the following rows indented.
+ */
+void gui_log(SM_loglevels level, const char *text)
+{
+	static const char bullets[] = { '\022', '\023', '\021' };
+	char row[LOG_COLS + 1];
+	int len = 2;
+	row[0] = bullets[level];
+	row[1] = ' ';
+	while(1)
+	{
+		int brk = LOG_COLS;
+		while(*text && (len < LOG_COLS))
+		{
+			int c = *text++;
+			row[len++] = (c < ' ') ? '?' : c;
+		}
+		if(!*text)
+		{
+			log_row(row, len);
+			break;
+		}
+		while((brk > LOG_COLS / 2) && (row[brk - 1] != ' '))
+			--brk;
+		if(brk <= LOG_COLS / 2)
+			brk = LOG_COLS;
+		log_row(row, brk);
+		memmove(row + 2, row + brk, LOG_COLS - brk);
+		row[0] = row[1] = ' ';
+		len = 2 + LOG_COLS - brk;
+	}
+	if(curpage == GUI_PAGE_LOG)
+		draw_log_rows();
+}
+
+
 static void draw_log(void)
 {
 	Uint32 fwc = SDL_MapRGB(screen->format, 128, 64, 0);
@@ -664,7 +1317,7 @@ static void draw_log(void)
 	gui_bar(232 + 6, 6, screen->w - 238 - 6, 36, fwc, screen);
 	gui_text(232 + 18, 17, "Message Log", screen);
 	gui_bar(6, 46, screen->w - 12, screen->h - 46 - 6, fwc, screen);
-	gui_text(12, 52, "(Not implemented.)", screen);
+	draw_log_rows();
 }
 
 
@@ -692,9 +1345,10 @@ static void draw_main(void)
 	gui_status(0, 0, 0);
 
 	/* Song editor */
-	gui_bar(6, 142, 640 - 12, FONT_CH * (SSEQ_TRACKS + 2) + 12,
+	gui_bar(6, 142, 640 - 12, FONT_CH * (GUI_TRACKS + 2) + 12,
 			fwc, screen);
-	gui_songedit(0, 0, 0, 0);
+	se_reset();
+	gui_songedit(0, 0, 0, 0, 0);
 
 	/* Message bar */
 	gui_bar(6, screen->h - FONT_CH - 12 - 6,
@@ -705,6 +1359,7 @@ static void draw_main(void)
 
 void gui_draw_screen(GUI_pages page)
 {
+	curpage = page;
 	switch(page)
 	{
 	  case GUI_PAGE_MAIN:
@@ -725,13 +1380,38 @@ void gui_draw_screen(GUI_pages page)
 
 int gui_open(SDL_Surface *scrn)
 {
+	/*
+	 * Convert the font to the format of 'scrn' rather than the display,
+	 * so that any surface works, with or without a video mode.
+	 */
+	SDL_Surface *img = SDL_LoadBMP("font.bmp");
 	screen = scrn;
-	font = gui_load_image("font.bmp");
+	font = img ? SDL_ConvertSurface(img, screen->format, SDL_SWSURFACE) :
+			NULL;
+	SDL_FreeSurface(img);
 	if(!font)
 	{
 		fprintf(stderr, "Couldn't load font!\n");
 		return -1;
 	}
+	if(expand_font(screen->format) < 0)
+	{
+		fprintf(stderr, "Couldn't expand font!\n");
+		gui_close();
+		return -1;
+	}
+	tiles_x = (screen->w + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (screen->h + TILE_SIZE - 1) / TILE_SIZE;
+	dirtytiles = calloc(tiles_x * tiles_y, 1);
+	runtab = malloc(2 * tiles_x * sizeof(int));
+	if(!dirtytiles || !runtab)
+	{
+		fprintf(stderr, "Couldn't allocate dirty tile map!\n");
+		gui_close();
+		return -1;
+	}
+	dirtytop = tiles_y;
+	dirtybottom = 0;
 	SDL_EnableKeyRepeat(250, 25);
 	memset(activity, 0, sizeof(activity));
 	return 0;
@@ -742,4 +1422,10 @@ void gui_close(void)
 {
 	SDL_FreeSurface(font);
 	font = NULL;
+	free(glyphs);
+	glyphs = NULL;
+	free(dirtytiles);
+	dirtytiles = NULL;
+	free(runtab);
+	runtab = NULL;
 }
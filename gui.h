@@ -8,11 +8,15 @@
 #define	GUI_H
 
 #include "SDL.h"
+#include "smlog.h"
 
 #define MAXRECTS	1024
 #define	FONT_CW		16
 #define	FONT_CH		16
 
+/* Number of tracks shown in the song editor */
+#define	GUI_TRACKS	16
+
 typedef enum
 {
 	GUI_PAGE_MAIN = 0,
@@ -47,10 +51,13 @@ void gui_bar(int x, int y, int w, int h, Uint32 c, SDL_Surface *dst);
 /* Render text */
 void gui_text(int x, int y, const char *txt, SDL_Surface *dst);
 
-/* Render an oscilloscope */
-void gui_oscilloscope(Sint32 *buf, int bufsize,
-		int start, int x, int y, int w, int h,
-		SDL_Surface *dst);
+/*
+ * Render an oscilloscope from min/max envelopes; one column per pair of
+ * 'min' and 'max' values, with 'stride' floats between the columns.
+ * The scope must be entirely inside the clip rect of 'dst'.
+ */
+void gui_oscilloscope(const float *min, const float *max, int stride,
+		int x, int y, int w, int h, SDL_Surface *dst);
 
 /*
  * High level GUI stuff
@@ -60,13 +67,17 @@ void gui_close(void);
 
 void gui_tempo(int v);
 void gui_songpos(int v);
-void gui_songedit(int pos, int ppos, int track, int editing);
+void gui_dspload(int load, int xruns, int underruns);
+void gui_songedit(int pos, int ppos, int track, int first, int editing);
 void gui_songselect(int x1, int y1, int x2, int y2);
 void gui_status(int playing, int editing, int looping);
 void gui_message(const char *message, int curspos);
 void gui_draw_activity(int dt);
 void gui_activity(int trk);
 
+/* Add a message to the Message Log page, wrapping it as needed */
+void gui_log(SM_loglevels level, const char *text);
+
 void gui_draw_screen(GUI_pages page);
 
 #endif	/* GUI_H */
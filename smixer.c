@@ -7,396 +7,3405 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+# include <windows.h>
+# include <malloc.h>
+#else
+# include <time.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+#endif
 #include "smixer.h"
+#include "smkernel.h"
+#include "smring.h"
+#include "smlog.h"
 #include "SDL_audio.h"
+#include "SDL_thread.h"
+
+/*
+ * Waveform data in the sample cache, which may be shared by any number
+ * of sounds, in any number of banks and mixers. Removed from the cache
+ * and freed when the last reference goes.
+ */
+typedef struct SM_wave SM_wave;
+struct SM_wave
+{
+	SM_wave		*next;		/* Next in the cache */
+	char		*path;		/* Canonical path of the file */
+	time_t		mtime;		/* Modification time of the file */
+	int		refcount;	/* Protected by the cache lock */
+	void		*map;		/* Mapped cache file, or NULL */
+	size_t		mapsize;
+	Uint8		*data;		/* With SM_GUARD samples at both ends */
+	Uint32		length;		/* Length in samples */
+	int		rate;		/* Sample rate */
+};
+
+/* Alignment of waveform data, for the SIMD kernels */
+#define	SM_WAVE_ALIGN	32
+
+
+/*
+ * Header of a sample cache file. The waveform follows right after,
+ * in native byte order, with SM_GUARD samples of silence at both
+ * ends, just like the mixer keeps it in memory. The header size is a
+ * multiple of SM_WAVE_ALIGN, so the mapped waveform is aligned.
+ */
+#define	SM_CACHE_MAGIC		"DT42SMPL"
+#define	SM_CACHE_VERSION	1
+#define	SM_CACHE_BYTEORDER	0x01020304
+typedef struct
+{
+	char	magic[8];	/* SM_CACHE_MAGIC */
+	Uint32	version;	/* SM_CACHE_VERSION */
+	Uint32	byteorder;	/* SM_CACHE_BYTEORDER, as written */
+	Uint32	rate;		/* Sample rate */
+	Uint32	length;		/* Length in samples, without guards */
+	Uint32	guard;		/* Guard samples at each end */
+	Uint32	checksum;	/* Adler-32 of waveform, with guards */
+	Sint64	srcmtime;	/* Modification time of the WAV file */
+	Sint64	srcsize;	/* Size of the WAV file */
+	Uint8	reserved[16];
+} SM_cachehdr;
+
+
+/*
+ * A waveform streamed from disk. Only the head is resident, in the
+ * data of the sound; the rest is read ahead by the I/O context as it
+ * plays. Streams are referenced by their sounds, and by pending start
+ * requests, and freed by whoever drops the last reference.
+ */
+typedef struct
+{
+	char		*path;		/* Canonical path of the WAV file */
+	long		offset;		/* File offset of the waveform */
+	Uint32		length;		/* Length in samples */
+	Uint32		headlength;	/* Samples in the resident head */
+	volatile int	refcount;
+} SM_stream;
+
 
 /* One sound */
 typedef struct
 {
-	Uint8	*data;		/* Waveform or synth definition */
+	SM_wave	*wave;		/* Waveform, or NULL for synth */
+	SM_stream *stream;	/* Streamed waveform, or NULL */
+	Uint8	*data;		/* Waveform data or synth definition */
 	Uint32	length;		/* Length in samples (0 for synth) */
+	int	rate;		/* Sample rate of waveform */
 	float	pitch;		/* Pitch (60.0 <==> middle C) */
 	float	decay;		/* Base decay speed */
 	float	fm;		/* Synth FM depth */
 } SM_sound;
 
 
+/* A set of sounds, indexed by slot */
+struct SM_bank
+{
+	SM_sound	*sounds;
+	int		nsounds;
+};
+
+
 /* One playback voice */
 typedef struct
 {
 	int	sound;		/* Index of playing sound, or -1 */
-	int	position;	/* Play position (sample count) */
+	float	pitch;		/* Pitch offset (semitones) */
 	int	lvol;		/* 8:24 fixed point */
 	int	rvol;
-	int	decay;		/* (16):16 fixed point */
+	int	decay;		/* Decay per frame; 8:24 fixed point */
+
+	/* Sample playback state */
+	Uint64	position;	/* Play position (32:32 fixed point) */
+	Uint64	step;		/* Position increment per frame */
+	const Sint16 *filter;	/* Resampling filter, or NULL */
+
+	/* Synth oscillator state */
+	Uint32	phase;		/* Carrier phase (0:32 fixed point) */
+	Uint32	dphase;		/* Phase increment per sample */
+	unsigned fade;		/* Fraction of fade step due (0:16) */
+	float	fm;		/* FM depth in phase units per unit mod. */
+
+	int	stream;		/* Stream slot, or -1 */
+
+	/* Events queued for this block, as a chain; -1 if none */
+	int	firstev, lastev;
+
+	/*
+	 * Voice pool state. Voices in use are linked in the order they
+	 * were started, all of them, and per group if they have one.
+	 */
+	int	free;		/* Index in the free list, or -1 if in use */
+	int	group;		/* Voice group, or -1 */
+	int	gprev, gnext;	/* Voices of the group, oldest first */
+	int	aprev, anext;	/* All voices in use, oldest first */
 } SM_voice;
 
 
-static SM_sound sounds[SM_SOUNDS];
-static SM_voice voices[SM_VOICES];
+/* A voice group, such as the voices of one sequencer track */
+typedef struct
+{
+	int	first, last;	/* Voices, oldest first, or -1 */
+	int	count;		/* Voices in the group */
+	int	limit;		/* Polyphony limit, or 0 for none */
+} SM_group;
+
+
+/*
+ * The voices of a mixer, with the per voice arrays of the mixer. Only
+ * used for passing new voices to the audio context, and the old ones
+ * back.
+ */
+typedef struct
+{
+	SM_voice	*voices;
+	int		*active;
+	int		*freelist;
+	int		count;
+} SM_pool;
+
+
+/* Voice event types */
+typedef enum
+{
+	SM_EV_PLAY = 0,
+	SM_EV_DECAY,
+	SM_EV_PITCH
+} SM_event_types;
+
+
+/* A voice event, timestamped within the current block */
+typedef struct
+{
+	Uint16	frame;		/* Offset into the block */
+	Uint8	type;		/* SM_event_types */
+	Uint16	voice;
+	int	sound;
+	float	lvol;		/* Or decay/pitch, for SM_EV_DECAY/PITCH */
+	float	rvol;
+	int	next;		/* Next event for the same voice, or -1 */
+} SM_event;
+
+
+/*
+ * Sine table for the synth oscillators. One full cycle, plus a
+ * guard point for the linear interpolation. With 2048 points,
+ * interpolation error is around -120 dB.
+ */
+#define	SM_SINE_BITS	11
+#define	SM_SINE_SIZE	(1 << SM_SINE_BITS)
+static float sinetab[SM_SINE_SIZE + 1];
+
+
+/*
+ * Sample rate that the decay and fade speeds are specified at. At
+ * other output rates, they're scaled to give the same envelopes.
+ */
+#define	SM_REFRATE	44100
+
+/* One sample, in 32:32 fixed point */
+#define	SM_ONE		((Uint64)1 << 32)
+
+/*
+ * Resampling filters. Filter 'i' cuts off at SM_RS_CUTOFF of the
+ * source Nyquist frequency, divided by 2^(i / 2), for playing samples
+ * at increasing steps without aliasing. Steps above the range of the
+ * last filter will alias somewhat.
+ */
+#define	SM_RS_FILTERS	6
+#define	SM_RS_CUTOFF	0.9
+#define	SM_RS_BETA	7.0	/* Kaiser window shape */
+#define	SM_RS_SIZE	((SMK_RS_PHASES + 1) * SMK_RS_TAPS)
+static Sint16 rsfilters[SM_RS_FILTERS][SM_RS_SIZE];
+
+/*
+ * Silence before and after the waveforms, so that the resampling
+ * filters can run off the ends without checks.
+ */
+#define	SM_GUARD	SMK_RS_TAPS
+
+
+/* Size of the command and reply queues */
+#define	SM_COMMANDS	1024
+
+/* Maximum number of voice events per block */
+#define	SM_EVENTS	1024
+
+/*
+ * When a voice must be stolen from the whole pool, the quietest of
+ * this many of the oldest voices is taken.
+ */
+#define	SM_STEAL_SCAN	8
+
+/*
+ * Sampled sounds longer than SM_STREAM_MIN samples are streamed from
+ * disk, with only the first SM_STREAM_HEAD samples resident. The head
+ * covers the time it takes the I/O context to start reading.
+ */
+#define	SM_STREAM_MIN		(1 << 19)
+#define	SM_STREAM_HEAD		(1 << 15)
+
+/* Number of voices per mixer that can play streamed sounds at once */
+#define	SM_STREAMS		8
+
+/* Samples per read ahead chunk, and chunks per stream slot */
+#define	SM_STREAM_CHUNK		1024
+#define	SM_STREAM_CHUNKS	32
+
+/* Size of the source window that streamed voices are mixed from */
+#define	SM_STREAM_WINDOW	4096
+
+/* Size of the stream request queue */
+#define	SM_STREAM_REQUESTS	64
+
+/* I/O thread poll period (ms), for when it isn't woken up */
+#define	SM_STREAM_POLL		10
+
+/* A chunk of streamed waveform, read ahead by the I/O context */
+typedef struct
+{
+	unsigned	gen;		/* Generation of the slot it's for */
+	Uint32		start;		/* Position of the first sample */
+	Uint32		length;		/* Samples in 'data' */
+	Sint16		data[SM_STREAM_CHUNK];
+} SM_chunk;
+
+/* Request to (re)start a stream slot, or to stop it if 'stream' is NULL */
+typedef struct
+{
+	int		slot;
+	unsigned	gen;
+	SM_stream	*stream;	/* Holds a reference, if not NULL */
+} SM_streamreq;
+
+/*
+ * A stream slot, feeding one streaming voice. Each (re)start bumps the
+ * generation, so chunks read for an earlier start are recognized and
+ * dropped.
+ */
+typedef struct
+{
+	/* Audio context */
+	int		voice;		/* Voice using the slot, or -1 */
+	unsigned	gen;
+	SM_ring		*chunks;	/* I/O -> audio context */
+
+	/* I/O context */
+	unsigned	iogen;
+	FILE		*file;		/* Open while there's more to read */
+	Uint32		iopos;		/* Next sample to read */
+	Uint32		iolength;
+	SM_chunk	chunk;		/* Chunk being read */
+} SM_streamslot;
+
+/* A master chain stage */
+typedef struct
+{
+	sm_master_cb	cb;
+	void		*userdata;
+} SM_masterstage;
+
+/*
+ * Voices with both volumes below this level are retired, as their
+ * peak output would be less than one LSB of the 16 bit output.
+ */
+#define	SM_SILENT	(1 << 9)
+
+/* A mixer instance */
+struct SM_mixer
+{
+	/* Current sound bank. Only to be changed in the audio context! */
+	SM_bank		*bank;
+	SM_voice	*voices;
+	int		nvoices;
+
+	/* Indices of the voices that are currently playing */
+	int		*active;
+	int		nactive;
+
+	/* Free voices, as a stack, and the voices in use */
+	int		*freelist;
+	int		nfree;
+	int		oldest, newest;	/* Or -1 if none */
+	SM_group	groups[SM_GROUPS];
+
+	int		rate;		/* Output sample rate */
+	int		device;		/* 1 if driven by the SDL audio device */
+
+	/*
+	 * Internal mixing buffer; 0 dB level is at 24 bits peak. Always
+	 * holds one full block of SM_MAXFRAGMENT frames, of which the
+	 * first 'mixpos' have been output.
+	 */
+	Sint32		*mixbuf;
+	int		mixpos;
+
+	/*
+	 * Master bus selected by the application, and the one of the
+	 * block in 'mixbuf'. On the float bus, the block is converted
+	 * into 'busbuf', and output from there. 'mixbuf' is then free
+	 * for use as scratch space by the output conversion.
+	 */
+	SM_buses	bus;
+	SM_buses	blockbus;
+	float		*busbuf;
+
+	/* TPDF dither generators for 16 bit output from the float bus */
+	Uint32		dither[SMK_DITHER_LANES];
+
+	/* Resampled waveform of the voice being mixed */
+	Sint16		rsbuf[SM_MAXFRAGMENT];
+
+	/* Source window of the streamed voice being mixed */
+	Sint16		stbuf[SM_STREAM_WINDOW];
+
+	/*
+	 * Stream slots, and requests to the I/O context. Offline mixers
+	 * do the I/O in the audio context, before each block, while
+	 * device mixers have an I/O thread.
+	 */
+	SM_streamslot	streams[SM_STREAMS];
+	SM_ring		*streamreqs;
+	Uint32		underruns;	/* Streamed data missing when mixed */
+	SDL_Thread	*iothread;
+	SDL_sem		*iowake;
+	volatile int	ioquit;
+
+	/* Voice events for the next block, in timestamp order */
+	SM_event	events[SM_EVENTS];
+	int		nevents;
+
+	/* Current control interval duration */
+	int		interval;
+
+	/* Time of the next control tick, relative to the block start */
+	int		next_tick;
+
+	/* Time of the control tick being processed; for new events */
+	int		now;
+
+	sm_mixer_control_cb	control_callback;
+	void			*control_userdata;
+	sm_mixer_audio_cb	audio_callback;
+	void			*audio_userdata;
+	sm_mixer_float_cb	float_callback;
+	void			*float_userdata;
+
+	/*
+	 * Master chain of the audio context, and the copy that the
+	 * application edits, and sends new copies of.
+	 */
+	SM_masterstage	*master;
+	int		nmaster;
+	SM_masterstage	*appmaster;
+	int		nappmaster;
+
+	/* Application -> audio context commands, and replies back */
+	SM_ring		*commands;
+	SM_ring		*replies;
+
+	/*
+	 * Performance statistics. Written by the audio context only,
+	 * and guarded by a sequence counter, which is odd while an
+	 * update is in progress, so readers can retry instead of
+	 * locking.
+	 */
+	SM_stats	stats;
+	volatile unsigned stats_seq;
+
+	/* Start time of the last SDL audio callback */
+	Uint64		last_callback;
+};
+
+
+/* The mixer driven by the SDL audio device, if any */
+static SM_mixer *device_mixer = NULL;
 static SDL_AudioSpec audiospec;
 
-/* Internal mixing buffer; 0 dB level is at 24 bits peak. */
-static Sint32 *mixbuf = NULL;
+/* The mixer used by the sm_*() calls that take no mixer argument */
+static SM_mixer *defmixer = NULL;
 
-/* Current control interval duration */
-static int interval = 0;
+/* The sample cache */
+static SM_wave *cache = NULL;
+static volatile int cache_lock = 0;
 
-/* Sample frames left until the next control tick */
-static int next_tick = 0;
+/* Tables shared by all mixers; set up once */
+static volatile int tables_ready = 0;
+static volatile int tables_lock = 0;
 
-static sm_control_cb control_callback = NULL;
-static sm_audio_cb audio_callback = NULL;
+
+int sm_mixer_get_rate(SM_mixer *m)
+{
+	return m->rate;
+}
 
 
-int sm_get_interval(void)
+int sm_mixer_get_interval(SM_mixer *m)
 {
-	return interval;
+	return m->interval;
 }
 
-int sm_get_next_tick(void)
+int sm_mixer_get_next_tick(SM_mixer *m)
 {
-	return next_tick;
+	return m->next_tick - m->now;
 }
 
 
-/* Start playing 'sound' on 'voice' at L/R volumes 'lvol'/'rvol' */
-void sm_play(unsigned voice, unsigned sound, float lvol, float rvol)
+/* Look up sin(2 * PI * phase / 2^32), with linear interpolation */
+static inline float sm_sin(Uint32 phase)
 {
-	if(voice >= SM_VOICES || sound >= SM_SOUNDS)
-		return;
-	voices[voice].sound = sound;
-	voices[voice].position = 0;
-	lvol *= lvol * lvol;
-	rvol *= rvol * rvol;
-	voices[voice].lvol = (int)(lvol * 16777216.0);
-	voices[voice].rvol = (int)(rvol * 16777216.0);
-	if(!sounds[sound].length)
-	{
-		float decay = sounds[sound].decay;
-		decay *= decay;
-		decay *= 0.00001f;
-		voices[voice].decay = (int)(decay * 16777216.0);
-	}
+	unsigned i = phase >> (32 - SM_SINE_BITS);
+	float f = (phase << SM_SINE_BITS) * (1.0f / 4294967296.0f);
+	return sinetab[i] + (sinetab[i + 1] - sinetab[i]) * f;
 }
 
 
-void sm_decay(unsigned voice, float decay)
+/* Convert to 8:24 fixed point, clamped to what the kernels handle */
+static inline int sm_volume(float vol)
 {
-	int sound = voices[voice].sound;
-	if(sound < 0)
-		return;
-	if(!sounds[sound].length)
-		decay += sounds[sound].decay;
+	if(vol <= 0.0f)
+		return 0;
+	else if(vol >= 1.0f)
+		return 0xffffff;
+	return (int)(vol * 16777216.0);
+}
+
+
+/*
+ * Convert a decay speed to a per frame decay factor, as used by the
+ * voices. The curve is defined at SM_REFRATE, with 16 fractional bits,
+ * as songs were made with that, and then scaled to give the same decay
+ * time at the current output rate.
+ */
+static int sm_decay_factor(SM_mixer *m, float decay)
+{
+	double k;
 	decay *= decay;
 	decay *= 0.00001f;
-	voices[voice].decay = (int)(decay * 16777216.0);
+	k = 1.0 - (int)(decay * 16777216.0) * (1.0 / 65536.0);
+	if(k <= 0.0)
+		return 0x1000000;
+	k = pow(k, (double)SM_REFRATE / m->rate);
+	return (int)((1.0 - k) * 16777216.0 + 0.5);
 }
 
 
-/* Mix all voices into a 32 bit (8:24) stereo buffer */
-static void sm_mixer(Sint32 *buf, int frames)
+/* Pick a resampling filter that will not alias at 'step' */
+static const Sint16 *sm_filter(Uint64 step)
 {
-	int vi, s;
-	/* Clear the buffer */
-	memset(buf, 0, frames * sizeof(Sint32) * 2);
-
-	/* For each voice... */
-	for(vi = 0; vi < SM_VOICES; ++vi)
+	int i = 0;
+	double s = step * (1.0 / SM_ONE);
+	while((s > 1.0) && (i < SM_RS_FILTERS - 1))
 	{
-		SM_voice *v = &voices[vi];
-		SM_sound *sound;
-		if(v->sound < 0)
-			continue;
-		sound = &sounds[v->sound];
-		if(sound->length)
-		{
-			/* Sampled waveform */
-			Sint16 *d = (Sint16 *)sound->data;;
-			for(s = 0; s < frames; ++s)
-			{
-				int v1715;
-				if(v->position >= sound->length)
-				{
-					v->sound = -1;
-					break;
-				}
-				v1715 = v->lvol >> 9;
-				buf[s * 2] += d[v->position] * v1715 >> 7;
-				v1715 = v->rvol >> 9;
-				buf[s * 2 + 1] += d[v->position] * v1715 >> 7;
-				v->lvol -= (v->lvol >> 8) * v->decay >> 8;
-				v->rvol -= (v->rvol >> 8) * v->decay >> 8;
-				++v->position;
-			}
-		}
-		else
-		{
-			/* Synth voice */
-			double f = SM_C0 * pow(2.0f, sound->pitch / 12.0);
-			double ff = M_PI * 2.0f * f / 44100.0f;
-			double fm = sound->fm * 44100.0f / f;
-			for(s = 0; s < frames; ++s)
-			{
-				int v1715;
-                                float mod = sin(v->position * ff) * fm;
-				int w = sin((v->position + mod) * ff) * 32767.0f;
-				v1715 = v->lvol >> 9;
-				buf[s * 2] += w * v1715 >> 7;
-				v1715 = v->rvol >> 9;
-				buf[s * 2 + 1] += w * v1715 >> 7;
-				v->lvol -= (v->lvol >> 8) * v->decay >> 8;
-				v->rvol -= (v->rvol >> 8) * v->decay >> 8;
-				++v->position;
-			}
-			v->lvol -= 16;
-			if(v->lvol < 0)
-				v->lvol = 0;
-			v->rvol -= 16;
-			if(v->rvol < 0)
-				v->rvol = 0;
-		}
+		s *= M_SQRT1_2;
+		++i;
 	}
+	return rsfilters[i];
 }
 
 
-/* Convert from 8:24 (32 bit) to 16 bit (stereo) */
-static void sm_convert(Sint32 *input, Sint16 *output, int frames)
+/*--------------------------------------------------------
+	Streaming
+--------------------------------------------------------*/
+
+static void flip_endian(Uint8 *data, int length)
 {
-	int i = 0;
-	frames *= 2;	/* Stereo! */
-	while(i < frames)
+	int i;
+	for(i = 0; i < length; i += 2)
 	{
-		output[i] = input[i] >> 8;
-		++i;
-		output[i] = input[i] >> 8;
-		++i;
+		int x = data[i];
+		data[i] = data[i + 1];
+		data[i + 1] = x;
 	}
 }
 
 
-static void sm_callback(void *ud, Uint8 *stream, int len)
+/* Drop a reference to 'st', and free it if it was the last one */
+static void sm_stream_unref(SM_stream *st)
 {
-	/* 2 channels, 2 bytes/sample = 4 bytes/frame */
-        len /= 4;
-	while(len)
-	{
-		/* Audio processing */
-		int frames = next_tick;
-		if(frames > SM_MAXFRAGMENT)
-			frames = SM_MAXFRAGMENT;
-		if(frames > len)
-			frames = len;
-		sm_mixer(mixbuf, frames);
-		if(audio_callback)
-			audio_callback(mixbuf, frames);
-		sm_convert(mixbuf, (Sint16 *)stream, frames);
-		stream += frames * sizeof(Sint16) * 2;
-		len -= frames;
+	if(SM_ATOMIC_ADD(st->refcount, -1))
+		return;
+	free(st->path);
+	free(st);
+}
 
-		/* Control processing */
-		next_tick -= frames;
-		if(!next_tick)
-		{
-			if(control_callback)
-			{
-				interval = next_tick = control_callback();
-				if(!next_tick)
-				{
-					control_callback = NULL;
-					interval = next_tick = 10000;
-				}
-			}
-			else
-				interval = next_tick = 10000;
-		}
-	}
+
+/* Wake the I/O thread of 'm', if it has one */
+static void sm_stream_wake(SM_mixer *m)
+{
+	if(m->iowake)
+		SDL_SemPost(m->iowake);
 }
 
 
-int sm_open(int buffer)
+/*
+ * Release the stream slot of voice 'v', if it has one. The stop
+ * request only serves to close the file early, so it doesn't matter
+ * if the queue is full.
+ */
+static void sm_stream_stop(SM_mixer *m, SM_voice *v)
 {
-	SDL_AudioSpec as;
-	int i;
+	SM_streamslot *ss;
+	SM_streamreq req;
+	if(v->stream < 0)
+		return;
+	ss = &m->streams[v->stream];
+	ss->voice = -1;
+	req.slot = v->stream;
+	req.gen = ++ss->gen;
+	req.stream = NULL;
+	sm_ring_write(m->streamreqs, &req, 1);
+	v->stream = -1;
+	sm_stream_wake(m);
+}
 
-	memset(sounds, 0, sizeof(sounds));
-	memset(voices, 0, sizeof(voices));
-	for(i = 0; i < SM_VOICES; ++i)
-		voices[i].sound = -1;
 
-	mixbuf = malloc(SM_MAXFRAGMENT * sizeof(Sint32) * 2);
-	if(!mixbuf)
+/*
+ * (Re)start streaming 'st' for voice 'v', reusing its slot if it has
+ * one. Returns -1 if there's no free slot, or no room for the request.
+ */
+static int sm_stream_start(SM_mixer *m, SM_voice *v, SM_stream *st)
+{
+	SM_streamreq req;
+	int i = v->stream;
+	if(i < 0)
+		for(i = 0; (i < SM_STREAMS) && (m->streams[i].voice >= 0); ++i)
+			;
+	if(i >= SM_STREAMS)
+		return -1;
+	req.slot = i;
+	req.gen = m->streams[i].gen + 1;
+	req.stream = st;
+	SM_ATOMIC_ADD(st->refcount, 1);
+	if(!sm_ring_write(m->streamreqs, &req, 1))
 	{
-		fprintf(stderr, "Couldn't allocate mixing buffer!\n");
+		/* The sound still holds a reference, so this never frees */
+		SM_ATOMIC_ADD(st->refcount, -1);
+		sm_stream_stop(m, v);
 		return -1;
 	}
+	m->streams[i].gen = req.gen;
+	m->streams[i].voice = v - m->voices;
+	v->stream = i;
+	sm_stream_wake(m);
+	return 0;
+}
 
-	if(SDL_InitSubSystem(SDL_INIT_AUDIO) < 0)
-	{
-		fprintf(stderr, "Couldn't init SDL audio: %s\n",
-				SDL_GetError());
-		return -2;
-	}
 
-	as.freq = 44100;
-	as.format = AUDIO_S16SYS;
-	as.channels = 2;
-	as.samples = buffer;
-	as.callback = sm_callback;
-	if(SDL_OpenAudio(&as, &audiospec) < 0)
+/*
+ * Fill the source window with 'count' samples of the streamed sound of
+ * voice 'v', starting at sample 'base', which may be before the start.
+ * Takes what it can from the head, and then from the read ahead chunks.
+ * Returns 1 if any data was missing, and replaced with silence.
+ */
+static int sm_stream_window(SM_mixer *m, SM_voice *v, Sint64 base,
+		int count)
+{
+	SM_sound *sound = &m->bank->sounds[v->sound];
+	SM_streamslot *ss = &m->streams[v->stream];
+	Sint16 *head = (Sint16 *)sound->data + SM_GUARD;
+	Sint16 *buf = m->stbuf;
+	Sint64 end = base + count;
+	Sint64 pos = base;
+	Sint64 hend = sound->stream->headlength;
+	SM_chunk *c;
+	unsigned i;
+
+	/* Head, including the guard before it */
+	if(hend > end)
+		hend = end;
+	if(pos < hend)
 	{
-		fprintf(stderr, "Couldn't open SDL audio: %s\n",
-				SDL_GetError());
-		return -3;
+		memcpy(buf, head + pos, (hend - pos) * sizeof(Sint16));
+		buf += hend - pos;
+		pos = hend;
 	}
 
-	if(audiospec.format != AUDIO_S16SYS)
+	/* Read ahead chunks, which are in order, after any stale ones */
+	for(i = 0; (pos < end) && (pos < sound->length) &&
+			(c = sm_ring_peek(ss->chunks, i)); ++i)
 	{
-		fprintf(stderr, "Wrong audio format!");
-		return -4;
+		Sint64 cend = (Sint64)c->start + c->length;
+		int n;
+		if((c->gen != ss->gen) || (cend <= pos))
+			continue;
+		if(c->start > pos)
+			break;
+		n = (cend < end ? cend : end) - pos;
+		memcpy(buf, c->data + (pos - c->start), n * sizeof(Sint16));
+		buf += n;
+		pos += n;
 	}
 
-	SDL_PauseAudio(0);
-	return 0;
+	/* Past the end, or missing */
+	memset(buf, 0, (end - pos) * sizeof(Sint16));
+	return (pos < end) && (pos < sound->length);
 }
 
 
-void sm_close(void)
+/*
+ * Mix 'frames' frames of streamed voice 'v' into 'buf', the way
+ * sm_voice_mix() does it for resident waveforms, but a window at a
+ * time. The voice state is not updated.
+ */
+static void sm_stream_mix(SM_mixer *m, SM_voice *v, Sint32 *buf,
+		int frames, int dl, int dr)
 {
-	int i;
-	SDL_CloseAudio();
-	for(i = 0; i < SM_SOUNDS; ++i)
-		sm_unload(i);
-	memset(voices, 0, sizeof(voices));
-	free(mixbuf);
+	Uint64 span = (Uint64)(SM_STREAM_WINDOW - 2 * SM_GUARD) << 32;
+	Uint64 pos = v->position;
+	int lvol = v->lvol;
+	int rvol = v->rvol;
+	int missing = 0;
+	while(frames)
+	{
+		Uint64 frac = pos & (SM_ONE - 1);
+		Sint16 *d = m->stbuf + SM_GUARD;
+		Uint64 fit = (span - frac) / v->step;
+		int n = fit < (Uint64)frames ? (int)fit : frames;
+		int count;
+		if(n < 1)
+			n = 1;
+		count = ((frac + v->step * (n - 1)) >> 32) + 2 * SM_GUARD;
+		if(count > SM_STREAM_WINDOW)
+			count = SM_STREAM_WINDOW;
+		missing |= sm_stream_window(m, v,
+				(Sint64)(pos >> 32) - SM_GUARD, count);
+		if(v->filter)
+		{
+			smk_resample(m->rsbuf, d, n, frac, v->step, v->filter);
+			smk_mix_mono(buf, m->rsbuf, n, lvol, rvol, dl, dr);
+		}
+		else
+			smk_mix_mono(buf, d, n, lvol, rvol, dl, dr);
+		buf += n * 2;
+		lvol += dl * n;
+		rvol += dr * n;
+		pos += v->step * n;
+		frames -= n;
+	}
+	if(missing)
+		++m->underruns;
 }
 
 
-static void flip_endian(Uint8 *data, int length)
+/* Drop chunks that voice 'v' is done with, so they can be refilled */
+static void sm_stream_consume(SM_mixer *m, SM_voice *v)
 {
-	int i;
-	for(i = 0; i < length; i += 2)
+	SM_streamslot *ss = &m->streams[v->stream];
+	Sint64 keep = (Sint64)(v->position >> 32) - SM_GUARD;
+	SM_chunk *c;
+	int n = 0;
+	while((c = sm_ring_peek(ss->chunks, 0)) && ((c->gen != ss->gen) ||
+			((Sint64)c->start + c->length <= keep)))
 	{
-		int x = data[i];
-		data[i] = data[i + 1];
-		data[i + 1] = x;
+		sm_ring_skip(ss->chunks, 1);
+		++n;
 	}
+	if(n)
+		sm_stream_wake(m);
 }
 
 
-void sm_unload(int sound)
+/* Handle a start or stop request for a slot (I/O context) */
+static void sm_stream_restart(SM_streamslot *ss, SM_streamreq *req)
 {
-	SDL_LockAudio();
-	if(sounds[sound].data)
+	SM_stream *st = req->stream;
+	if(ss->file)
+		fclose(ss->file);
+	ss->file = NULL;
+	ss->iogen = req->gen;
+	if(!st)
+		return;
+	ss->iopos = st->headlength;
+	ss->iolength = st->length;
+	if(ss->iopos < ss->iolength)
 	{
-		if(sounds[sound].length)
-			SDL_FreeWAV(sounds[sound].data);
-		else
-			free(sounds[sound].data);
+		if(!(ss->file = fopen(st->path, "rb")))
+			sm_log(SM_LOG_ERROR, "Could not open \"%s\" for "
+					"streaming: %s", st->path,
+					strerror(errno));
+		else if(fseek(ss->file, st->offset + (long)ss->iopos *
+				(long)sizeof(Sint16), SEEK_SET) < 0)
+		{
+			fclose(ss->file);
+			ss->file = NULL;
+		}
 	}
-	memset(&sounds[sound], 0, sizeof(SM_sound));
-	SDL_UnlockAudio();
+	sm_stream_unref(st);
 }
 
 
-int sm_load(int sound, const char *file)
+/* Read ahead for a slot until its ring is full (I/O context) */
+static void sm_stream_read(SM_streamslot *ss)
 {
-	int failed = 0;
-	SDL_AudioSpec spec;
-	sm_unload(sound);
-	SDL_LockAudio();
-	if(SDL_LoadWAV(file, &spec, &sounds[sound].data,
-			&sounds[sound].length) == NULL)
-	{
-		SDL_UnlockAudio();
-		return -1;
-	}
-	if(spec.freq != 44100)
-		fprintf(stderr, "WARNING: File '%s' is not 44.1 kHz."
-				" Might sound weird...\n", file);
-	if(spec.channels != 1)
-	{
-		fprintf(stderr, "Only mono sounds are supported!\n");
-		failed = 1;
-	}
-	switch(spec.format)
-	{
-	  case AUDIO_S16LSB:
-	  case AUDIO_S16MSB:
-		if(spec.format != AUDIO_S16SYS)
-			flip_endian(sounds[sound].data, sounds[sound].length);
-		break;
-	  default:
-		fprintf(stderr, "Unsupported sample format!\n");
-		failed = 1;
-		break;
-	}
-	if(failed)
+	SM_chunk *c = &ss->chunk;
+	while(ss->file && sm_ring_space(ss->chunks))
 	{
-		SDL_FreeWAV(sounds[sound].data);
-		sounds[sound].data = NULL;
-		sounds[sound].length = 0;
-		SDL_UnlockAudio();
-		return -2;
+		Uint32 n = ss->iolength - ss->iopos;
+		if(n > SM_STREAM_CHUNK)
+			n = SM_STREAM_CHUNK;
+		n = fread(c->data, sizeof(Sint16), n, ss->file);
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+		flip_endian((Uint8 *)c->data, n * sizeof(Sint16));
+#endif
+		if(n)
+		{
+			c->gen = ss->iogen;
+			c->start = ss->iopos;
+			c->length = n;
+			sm_ring_write(ss->chunks, c, 1);
+			ss->iopos += n;
+		}
+		if(!n || (ss->iopos >= ss->iolength))
+		{
+			fclose(ss->file);
+			ss->file = NULL;
+		}
 	}
-	sounds[sound].length /= 2;
-	SDL_UnlockAudio();
-	return 0;
 }
 
 
-int sm_load_synth(int sound, const char *def)
+/* Handle stream requests, and read ahead for all slots (I/O context) */
+static void sm_stream_refill(SM_mixer *m)
 {
-	int res = 0;
-	sm_unload(sound);
-	SDL_LockAudio();
-	sounds[sound].data = (Uint8 *)strdup(def);
-	if(strncmp(def, "fm2 ", 4) == 0)
+	SM_streamreq req;
+	int i;
+	while(sm_ring_read(m->streamreqs, &req, 1))
+		sm_stream_restart(&m->streams[req.slot], &req);
+	for(i = 0; i < SM_STREAMS; ++i)
+		sm_stream_read(&m->streams[i]);
+}
+
+
+static int sm_stream_thread(void *data)
+{
+	SM_mixer *m = (SM_mixer *)data;
+	while(!SM_LOAD_ACQUIRE(m->ioquit))
+	{
+		sm_stream_refill(m);
+		SDL_SemWaitTimeout(m->iowake, SM_STREAM_POLL);
+	}
+	return 0;
+}
+
+
+/*--------------------------------------------------------
+	Voice allocation
+--------------------------------------------------------*/
+
+/* Unlink voice 'vi', which is in use, from its group and the age list */
+static void sm_voice_unlink(SM_mixer *m, int vi)
+{
+	SM_voice *v = &m->voices[vi];
+	if(v->group >= 0)
+	{
+		SM_group *g = &m->groups[v->group];
+		if(v->gprev >= 0)
+			m->voices[v->gprev].gnext = v->gnext;
+		else
+			g->first = v->gnext;
+		if(v->gnext >= 0)
+			m->voices[v->gnext].gprev = v->gprev;
+		else
+			g->last = v->gprev;
+		--g->count;
+		v->group = -1;
+	}
+	if(v->aprev >= 0)
+		m->voices[v->aprev].anext = v->anext;
+	else
+		m->oldest = v->anext;
+	if(v->anext >= 0)
+		m->voices[v->anext].aprev = v->aprev;
+	else
+		m->newest = v->aprev;
+	v->gprev = v->gnext = v->aprev = v->anext = -1;
+}
+
+
+/*
+ * Take voice 'vi' off the free list, or out of whatever group it's in,
+ * and link it in as the newest voice, in 'group' if that's not -1.
+ */
+static void sm_voice_claim(SM_mixer *m, int vi, int group)
+{
+	SM_voice *v = &m->voices[vi];
+	if(v->free >= 0)
+	{
+		int last = m->freelist[--m->nfree];
+		m->freelist[v->free] = last;
+		m->voices[last].free = v->free;
+		v->free = -1;
+	}
+	else
+		sm_voice_unlink(m, vi);
+	if(group >= 0)
+	{
+		SM_group *g = &m->groups[group];
+		v->group = group;
+		v->gprev = g->last;
+		if(g->last >= 0)
+			m->voices[g->last].gnext = vi;
+		else
+			g->first = vi;
+		g->last = vi;
+		++g->count;
+	}
+	v->aprev = m->newest;
+	if(m->newest >= 0)
+		m->voices[m->newest].anext = vi;
+	else
+		m->oldest = vi;
+	m->newest = vi;
+}
+
+
+/* Put voice 'vi' back on the free list, when it has been retired */
+static void sm_voice_release(SM_mixer *m, int vi)
+{
+	SM_voice *v = &m->voices[vi];
+	if(v->free >= 0)
+		return;
+	sm_voice_unlink(m, vi);
+	v->free = m->nfree;
+	m->freelist[m->nfree++] = vi;
+}
+
+
+/* Pick a voice to steal, when all voices are in use */
+static int sm_voice_steal(SM_mixer *m)
+{
+	int vi, n;
+	int best = m->oldest;
+	int bestvol = 0x7fffffff;
+	for(vi = m->oldest, n = 0; (vi >= 0) && (n < SM_STEAL_SCAN);
+			vi = m->voices[vi].anext, ++n)
+	{
+		SM_voice *v = &m->voices[vi];
+		int vol = v->lvol > v->rvol ? v->lvol : v->rvol;
+		if(vol < bestvol)
+		{
+			best = vi;
+			bestvol = vol;
+		}
+	}
+	return best;
+}
+
+
+/* Put all voices on the free list, and empty all groups */
+static void sm_voices_reset(SM_mixer *m)
+{
+	int i;
+	for(i = 0; i < m->nvoices; ++i)
+	{
+		SM_voice *v = &m->voices[i];
+		memset(v, 0, sizeof(SM_voice));
+		v->sound = -1;
+		v->stream = -1;
+		v->firstev = v->lastev = -1;
+		v->group = -1;
+		v->gprev = v->gnext = v->aprev = v->anext = -1;
+
+		/* Hand out the lowest voices first */
+		v->free = m->nvoices - 1 - i;
+		m->freelist[v->free] = i;
+	}
+	m->nfree = m->nvoices;
+	m->nactive = 0;
+	m->nevents = 0;
+	m->oldest = m->newest = -1;
+	for(i = 0; i < SM_GROUPS; ++i)
+	{
+		m->groups[i].first = m->groups[i].last = -1;
+		m->groups[i].count = 0;
+	}
+}
+
+
+static void sm_pool_free(SM_pool *p)
+{
+	if(!p)
+		return;
+	free(p->voices);
+	free(p->active);
+	free(p->freelist);
+	free(p);
+}
+
+
+static SM_pool *sm_pool_new(int count)
+{
+	SM_pool *p = calloc(1, sizeof(SM_pool));
+	if(!p)
+		return NULL;
+	p->voices = calloc(count, sizeof(SM_voice));
+	p->active = calloc(count, sizeof(int));
+	p->freelist = calloc(count, sizeof(int));
+	p->count = count;
+	if(!p->voices || !p->active || !p->freelist)
+	{
+		sm_pool_free(p);
+		return NULL;
+	}
+	return p;
+}
+
+
+/* Exchange the voices of 'm' with those of 'p', and reset them */
+static void sm_pool_swap(SM_mixer *m, SM_pool *p)
+{
+	int i;
+	SM_pool tmp;
+	for(i = 0; i < m->nvoices; ++i)
+		sm_stream_stop(m, &m->voices[i]);
+	tmp.voices = m->voices;
+	tmp.active = m->active;
+	tmp.freelist = m->freelist;
+	tmp.count = m->nvoices;
+	m->voices = p->voices;
+	m->active = p->active;
+	m->freelist = p->freelist;
+	m->nvoices = p->count;
+	*p = tmp;
+	sm_voices_reset(m);
+}
+
+
+/* Reply handler: Free voices passed back from the audio context */
+static void cmd_free_pool(SM_command *cmd)
+{
+	sm_pool_free((SM_pool *)cmd->p);
+}
+
+
+/* Install new voices (audio context) */
+static void cmd_set_voices(SM_command *cmd)
+{
+	SM_mixer *m = (SM_mixer *)cmd->target;
+	sm_pool_swap(m, (SM_pool *)cmd->p);
+	cmd->cb = cmd_free_pool;
+	sm_mixer_reply(m, cmd);
+}
+
+
+int sm_mixer_set_voices(SM_mixer *m, int voices)
+{
+	SM_command cmd;
+	SM_pool *p;
+	if(!m || (voices < 1) || (voices > SM_MAXVOICES))
+		return -1;
+	if(!(p = sm_pool_new(voices)))
+		return -3;
+	cmd.cb = cmd_set_voices;
+	cmd.target = m;
+	cmd.p = p;
+	sm_mixer_send(m, &cmd);
+	return 0;
+}
+
+
+int sm_mixer_get_voices(SM_mixer *m)
+{
+	return m->nvoices;
+}
+
+
+void sm_mixer_set_polyphony(SM_mixer *m, unsigned group, int voices)
+{
+	if(group >= SM_GROUPS)
+		return;
+	m->groups[group].limit = voices > 0 ? voices : 0;
+}
+
+
+/*--------------------------------------------------------
+	Mixing
+--------------------------------------------------------*/
+
+/* Set up the voice pitch, or sample step, from sound and voice pitch */
+static void sm_voice_pitch(SM_mixer *m, SM_voice *v)
+{
+	SM_sound *sound = &m->bank->sounds[v->sound];
+	if(sound->length)
+	{
+		double f = pow(2.0, v->pitch / 12.0);
+		v->step = (Uint64)(f * sound->rate / m->rate * SM_ONE +
+				0.5);
+		if(v->step == SM_ONE && !(v->position & (SM_ONE - 1)))
+			v->filter = NULL;
+		else
+			v->filter = sm_filter(v->step);
+	}
+	else
+	{
+		double f = SM_C0 * pow(2.0, (sound->pitch + v->pitch) / 12.0);
+		v->dphase = (Uint32)(f / m->rate * 4294967296.0);
+	}
+}
+
+
+static void sm_apply_play(SM_mixer *m, SM_voice *v, int sound,
+		float lvol, float rvol)
+{
+	if(sound >= m->bank->nsounds)
+	{
+		/* No such slot in this bank; drop the note */
+		sm_stream_stop(m, v);
+		v->sound = -2;
+		return;
+	}
+	v->sound = sound;
+	v->position = 0;
+	v->pitch = 0.0f;
+	lvol *= lvol * lvol;
+	rvol *= rvol * rvol;
+	v->lvol = sm_volume(lvol);
+	v->rvol = sm_volume(rvol);
+	if(!m->bank->sounds[sound].stream)
+		sm_stream_stop(m, v);
+	else if(sm_stream_start(m, v, m->bank->sounds[sound].stream) < 0)
+	{
+		/* Out of stream slots; drop the note */
+		++m->underruns;
+		v->lvol = v->rvol = 0;
+	}
+	if(!m->bank->sounds[sound].length)
+	{
+		v->decay = sm_decay_factor(m, m->bank->sounds[sound].decay);
+		v->phase = 0;
+		v->fade = 0;
+		v->fm = m->bank->sounds[sound].fm * 4294967296.0f;
+	}
+	sm_voice_pitch(m, v);
+}
+
+
+static void sm_apply_decay(SM_mixer *m, SM_voice *v, float decay)
+{
+	if(v->sound < 0)
+		return;
+	if(!m->bank->sounds[v->sound].length)
+		decay += m->bank->sounds[v->sound].decay;
+	v->decay = sm_decay_factor(m, decay);
+}
+
+
+static void sm_apply_pitch(SM_mixer *m, SM_voice *v, float pitch)
+{
+	if(v->sound < 0)
+		return;
+	v->pitch = pitch;
+	sm_voice_pitch(m, v);
+}
+
+
+static void sm_apply(SM_mixer *m, SM_event *ev)
+{
+	SM_voice *v = &m->voices[ev->voice];
+	switch(ev->type)
+	{
+	  case SM_EV_PLAY:
+		sm_apply_play(m, v, ev->sound, ev->lvol, ev->rvol);
+		break;
+	  case SM_EV_DECAY:
+		sm_apply_decay(m, v, ev->lvol);
+		break;
+	  case SM_EV_PITCH:
+		sm_apply_pitch(m, v, ev->lvol);
+		break;
+	}
+}
+
+
+/*
+ * Queue an event at the time of the current control tick. If the
+ * queue is full, the event is applied right away; out of time, but
+ * at least not lost.
+ */
+static void sm_queue(SM_mixer *m, int type, unsigned voice, int sound,
+		float a, float b)
+{
+	SM_voice *v = &m->voices[voice];
+	SM_event *ev;
+	SM_event tmp;
+	if(m->nevents < SM_EVENTS)
+		ev = &m->events[m->nevents++];
+	else
+		ev = &tmp;
+	ev->frame = m->now;
+	ev->type = type;
+	ev->voice = voice;
+	ev->sound = sound;
+	ev->lvol = a;
+	ev->rvol = b;
+	ev->next = -1;
+	if(ev == &tmp)
+	{
+		/* Not seen by sm_mix(), so list the voice here */
+		if((type == SM_EV_PLAY) && (v->sound == -1))
+		{
+			v->sound = -2;
+			m->active[m->nactive++] = voice;
+		}
+		sm_apply(m, ev);
+		return;
+	}
+	if(v->lastev >= 0)
+		m->events[v->lastev].next = ev - m->events;
+	else
+		v->firstev = ev - m->events;
+	v->lastev = ev - m->events;
+}
+
+
+/* Start playing 'sound' on 'voice' at L/R volumes 'lvol'/'rvol' */
+void sm_mixer_play(SM_mixer *m, unsigned voice, unsigned sound,
+		float lvol, float rvol)
+{
+	if(voice >= (unsigned)m->nvoices || sound >= SM_MAXSOUNDS)
+		return;
+	sm_voice_claim(m, voice, -1);
+	sm_queue(m, SM_EV_PLAY, voice, sound, lvol, rvol);
+}
+
+
+void sm_mixer_decay(SM_mixer *m, unsigned voice, float decay)
+{
+	if(voice >= (unsigned)m->nvoices)
+		return;
+	sm_queue(m, SM_EV_DECAY, voice, 0, decay, 0.0f);
+}
+
+
+void sm_mixer_pitch(SM_mixer *m, unsigned voice, float pitch)
+{
+	if(voice >= (unsigned)m->nvoices)
+		return;
+	sm_queue(m, SM_EV_PITCH, voice, 0, pitch, 0.0f);
+}
+
+
+int sm_mixer_start(SM_mixer *m, unsigned group, unsigned sound,
+		float lvol, float rvol)
+{
+	SM_group *g;
+	int vi;
+	if(group >= SM_GROUPS || sound >= SM_MAXSOUNDS)
+		return -1;
+	g = &m->groups[group];
+	if(g->limit && (g->count >= g->limit))
+		vi = g->first;
+	else if(m->nfree)
+		vi = m->freelist[m->nfree - 1];
+	else
+		vi = sm_voice_steal(m);
+	sm_voice_claim(m, vi, group);
+	sm_queue(m, SM_EV_PLAY, vi, sound, lvol, rvol);
+	return vi;
+}
+
+
+void sm_mixer_group_decay(SM_mixer *m, unsigned group, float decay)
+{
+	int vi;
+	if(group >= SM_GROUPS)
+		return;
+	for(vi = m->groups[group].first; vi >= 0; vi = m->voices[vi].gnext)
+		sm_queue(m, SM_EV_DECAY, vi, 0, decay, 0.0f);
+}
+
+
+/* Mix 'frames' frames of voice 'v' into 'buf' */
+static void sm_voice_mix(SM_mixer *m, SM_voice *v, Sint32 *buf, int frames)
+{
+	int s;
+	SM_sound *sound = &m->bank->sounds[v->sound];
+	if(sound->stream && (v->stream < 0))
+	{
+		/* Streamed sound, but no stream slot */
+		v->sound = -1;
+		return;
+	}
+	if(sound->length)
+	{
+		/*
+		 * Sampled waveform: Mix up to the end of the sample,
+		 * ramping linearly to where the exponential decay
+		 * envelope will be at the end of the block. Unless
+		 * we're playing the waveform as is, it's resampled
+		 * into 'rsbuf' first, running on through the filter
+		 * tail into the guard area. Streamed waveforms are
+		 * handled by sm_stream_mix().
+		 */
+		Sint16 *d = (Sint16 *)sound->data + SM_GUARD;
+		Uint64 end = (Uint64)sound->length << 32;
+		int n = 0;
+		if(v->filter)
+			end += (Uint64)(SMK_RS_TAPS / 2) << 32;
+		if(v->position < end)
+			n = (end - v->position + v->step - 1) / v->step;
+		if(n > frames)
+			n = frames;
+		if(n > 0)
+		{
+			float k = 1.0f - v->decay * (1.0f / 16777216.0f);
+			float g = k > 0.0f ? powf(k, n) : 0.0f;
+			int dl = ((int)(v->lvol * g) - v->lvol) / n;
+			int dr = ((int)(v->rvol * g) - v->rvol) / n;
+			if(sound->stream)
+				sm_stream_mix(m, v, buf, n, dl, dr);
+			else if(v->filter)
+			{
+				smk_resample(m->rsbuf, d, n, v->position,
+						v->step, v->filter);
+				smk_mix_mono(buf, m->rsbuf, n,
+						v->lvol, v->rvol, dl, dr);
+			}
+			else
+				smk_mix_mono(buf, d + (v->position >> 32), n,
+						v->lvol, v->rvol, dl, dr);
+			v->lvol += dl * n;
+			v->rvol += dr * n;
+			v->position += v->step * n;
+			if(sound->stream)
+				sm_stream_consume(m, v);
+		}
+		if(v->position >= end)
+			v->sound = -1;
+	}
+	else
+	{
+		/*
+		 * Synth voice: Sine carrier, phase modulated by
+		 * itself. 'fm' is the modulation depth in cycles.
+		 */
+		Uint32 phase = v->phase;
+		int fade;
+		for(s = 0; s < frames; ++s)
+		{
+			int v1715;
+			float mod = sm_sin(phase) * v->fm;
+			int w = sm_sin(phase + (Uint32)(Sint64)mod) *
+					32767.0f;
+			v1715 = v->lvol >> 9;
+			buf[s * 2] += w * v1715 >> 7;
+			v1715 = v->rvol >> 9;
+			buf[s * 2 + 1] += w * v1715 >> 7;
+			v->lvol -= (Sint64)v->lvol * v->decay >> 24;
+			v->rvol -= (Sint64)v->rvol * v->decay >> 24;
+			phase += v->dphase;
+		}
+		v->phase = phase;
+
+		/*
+		 * Linear fade, so the voice ends; 16 per full block at
+		 * SM_REFRATE. The fraction is carried over, so that
+		 * blocks split into short segments by events fade the
+		 * same as whole ones.
+		 */
+		v->fade += frames * (SM_REFRATE * 4096 / m->rate);
+		fade = v->fade >> 16;
+		v->fade &= 0xffff;
+		v->lvol -= fade;
+		if(v->lvol < 0)
+			v->lvol = 0;
+		v->rvol -= fade;
+		if(v->rvol < 0)
+			v->rvol = 0;
+	}
+}
+
+
+/*
+ * Mix all active voices into a 32 bit (8:24) stereo buffer. Voices
+ * with queued events are split where the events land, and otherwise
+ * mixed in one go.
+ */
+static void sm_mix(SM_mixer *m, Sint32 *buf, int frames)
+{
+	int ai, i;
+	/* Clear the buffer */
+	memset(buf, 0, frames * sizeof(Sint32) * 2);
+
+	/* Activate voices that are started during this block */
+	for(i = 0; i < m->nevents; ++i)
+	{
+		SM_voice *v = &m->voices[m->events[i].voice];
+		if((m->events[i].type == SM_EV_PLAY) && (v->sound == -1))
+		{
+			v->sound = -2;	/* Listed, but not playing yet */
+			m->active[m->nactive++] = m->events[i].voice;
+		}
+	}
+
+	/* For each playing voice... */
+	for(ai = 0; ai < m->nactive; )
+	{
+		int vi = m->active[ai];
+		SM_voice *v = &m->voices[vi];
+		int pos = 0;
+		for(i = v->firstev; i >= 0; i = m->events[i].next)
+		{
+			SM_event *ev = &m->events[i];
+			if((ev->frame > pos) && (v->sound >= 0))
+				sm_voice_mix(m, v, buf + pos * 2,
+						ev->frame - pos);
+			pos = ev->frame;
+			sm_apply(m, ev);
+		}
+		v->firstev = v->lastev = -1;
+		if((pos < frames) && (v->sound >= 0))
+			sm_voice_mix(m, v, buf + pos * 2, frames - pos);
+
+		/* Retire the voice if it has ended or faded out */
+		if((v->lvol < SM_SILENT) && (v->rvol < SM_SILENT))
+			v->sound = -1;
+		if(v->sound < 0)
+		{
+			sm_stream_stop(m, v);
+			sm_voice_release(m, vi);
+			m->active[ai] = m->active[--m->nactive];
+		}
+		else
+			++ai;
+	}
+
+	/* Drop events for voices that weren't playing */
+	for(i = 0; i < m->nevents; ++i)
+		m->voices[m->events[i].voice].firstev =
+				m->voices[m->events[i].voice].lastev = -1;
+	m->nevents = 0;
+}
+
+
+/*
+ * Pack 'samples' 8:24 samples into 3 byte little endian 24 bit
+ * samples. 'input' and 'output' may be the same buffer.
+ */
+static void sm_pack_s24(const Sint32 *input, Uint8 *output, int samples)
+{
+	int i;
+	for(i = 0; i < samples; ++i)
+	{
+		Sint32 v = input[i];
+		if(v < -0x800000)
+			v = -0x800000;
+		else if(v > 0x7fffff)
+			v = 0x7fffff;
+		output[0] = v & 0xff;
+		output[1] = (v >> 8) & 0xff;
+		output[2] = (v >> 16) & 0xff;
+		output += 3;
+	}
+}
+
+
+/*
+ * Convert 'frames' frames of the current block, from 'mixpos' and on,
+ * from the master bus into 'stream', in the specified format.
+ */
+static void sm_convert(SM_mixer *m, Uint8 *stream, int frames,
+		SM_formats format)
+{
+	Sint32 *in = m->mixbuf + m->mixpos * 2;
+	float *fin = m->busbuf + m->mixpos * 2;
+	int n = frames * 2;	/* Stereo! */
+	switch(format)
+	{
+	  case SM_FORMAT_S16:
+		if(m->blockbus == SM_BUS_FLOAT)
+			smk_float_s16((Sint16 *)stream, fin, n, m->dither);
+		else
+			smk_s32_s16((Sint16 *)stream, in, n);
+		break;
+	  case SM_FORMAT_FLOAT:
+		if(m->blockbus == SM_BUS_FLOAT)
+			memcpy(stream, fin, n * sizeof(float));
+		else
+			smk_s32_float((float *)stream, in, n);
+		break;
+	  case SM_FORMAT_S24:
+		if(m->blockbus == SM_BUS_FLOAT)
+			smk_float_s24(in, fin, n);
+		sm_pack_s24(in, stream, n);
+		break;
+	}
+}
+
+
+/*--------------------------------------------------------
+	Performance statistics
+--------------------------------------------------------*/
+
+Uint64 sm_timestamp(void)
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER t;
+	if(!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+	return (Uint64)(t.QuadPart * (1000000000.0 / freq.QuadPart));
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (Uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return (Uint64)SDL_GetTicks() * 1000000;
+#endif
+}
+
+
+const char *sm_stage_name(SM_stages stage)
+{
+	switch(stage)
+	{
+	  case SM_STAGE_CONTROL:	return "control";
+	  case SM_STAGE_MIXER:		return "mixer";
+	  case SM_STAGE_AUDIO:		return "audio";
+	  case SM_STAGE_CONVERT:	return "convert";
+	  case SM_STAGE_CALLBACK:	return "callback";
+	  default:			return "<unknown>";
+	}
+}
+
+
+static void sm_stats_begin(SM_mixer *m)
+{
+	SM_STORE_RELEASE(m->stats_seq, m->stats_seq + 1);
+	SM_MEMORY_BARRIER();
+}
+
+
+static void sm_stats_end(SM_mixer *m)
+{
+	SM_STORE_RELEASE(m->stats_seq, m->stats_seq + 1);
+}
+
+
+/* Add a measurement of 'ns' to 'stage'. Use within begin/end! */
+static void sm_stats_add(SM_mixer *m, SM_stages stage, Uint64 ns)
+{
+	SM_stagestats *st = &m->stats.stages[stage];
+	Uint64 us = ns / 1000;
+	int bin = 0;
+	if(!st->count || (ns < st->min))
+		st->min = ns;
+	if(ns > st->max)
+		st->max = ns;
+	st->total += ns;
+	++st->count;
+	while(us && (bin < SM_STATS_BINS - 1))
+	{
+		us >>= 1;
+		++bin;
+	}
+	++st->hist[bin];
+}
+
+
+void sm_mixer_get_stats(SM_mixer *m, SM_stats *st)
+{
+	unsigned seq;
+	do
+	{
+		while((seq = SM_LOAD_ACQUIRE(m->stats_seq)) & 1)
+			;
+		*st = m->stats;
+		SM_MEMORY_BARRIER();
+	} while(SM_LOAD_ACQUIRE(m->stats_seq) != seq);
+}
+
+
+void sm_mixer_print_stats(SM_mixer *m, FILE *f)
+{
+	int i, b;
+	SM_stats st;
+	sm_mixer_get_stats(m, &st);
+	fprintf(f, "Stage        Count     Min(us)   Avg(us)   Max(us)\n");
+	for(i = 0; i < SM_STAGES; ++i)
+	{
+		SM_stagestats *ss = &st.stages[i];
+		if(!ss->count)
+			continue;
+		fprintf(f, "%-9s %8u %11.1f %9.1f %9.1f\n",
+				sm_stage_name(i), ss->count,
+				ss->min * 0.001,
+				(double)ss->total / ss->count * 0.001,
+				ss->max * 0.001);
+	}
+	fprintf(f, "\nHistogram  <1us");
+	for(b = 1; b < SM_STATS_BINS; ++b)
+		fprintf(f, " %5d", 1 << (b - 1));
+	fprintf(f, "\n");
+	for(i = 0; i < SM_STAGES; ++i)
+	{
+		SM_stagestats *ss = &st.stages[i];
+		if(!ss->count)
+			continue;
+		fprintf(f, "%-9s", sm_stage_name(i));
+		for(b = 0; b < SM_STATS_BINS; ++b)
+			fprintf(f, " %5u", ss->hist[b]);
+		fprintf(f, "\n");
+	}
+	if(st.audiotime)
+		fprintf(f, "\nDSP load: %.1f%% average, %.1f%% peak;"
+				" %u xruns\n",
+				st.stages[SM_STAGE_CALLBACK].total * 100.0 /
+				st.audiotime, st.peakload * 100.0f,
+				st.xruns);
+	if(st.underruns)
+		fprintf(f, "\nStream underruns: %u\n", st.underruns);
+}
+
+
+/* Lock the audio context of 'm', if it runs in another thread */
+static void sm_lock(SM_mixer *m)
+{
+	if(m->device)
+		SDL_LockAudio();
+}
+
+
+static void sm_unlock(SM_mixer *m)
+{
+	if(m->device)
+		SDL_UnlockAudio();
+}
+
+
+/*
+ * Execute all pending commands (audio context). Each command is run in
+ * place, and stays in the queue until its handler has returned, so the
+ * sender can see that its reply may still be coming.
+ */
+static void sm_run_commands(SM_mixer *m)
+{
+	SM_command *cmd;
+	while((cmd = sm_ring_peek(m->commands, 0)))
+	{
+		cmd->cb(cmd);
+		sm_ring_skip(m->commands, 1);
+	}
+}
+
+
+/*
+ * Check that there is room for one more command, and for a reply to it
+ * and to every command still queued, in case they all send one.
+ */
+static int sm_mixer_room(SM_mixer *m)
+{
+	unsigned queued = m->commands->size - sm_ring_space(m->commands);
+	return queued + sm_ring_avail(m->replies) < m->replies->size;
+}
+
+
+void sm_mixer_send(SM_mixer *m, SM_command *cmd)
+{
+	/* No audio thread? Then we're the audio context. */
+	if(!m->device)
+	{
+		cmd->cb(cmd);
+		return;
+	}
+	while(!sm_mixer_room(m) || !sm_ring_write(m->commands, cmd, 1))
+	{
+		sm_mixer_poll(m);
+		SDL_Delay(1);
+	}
+}
+
+
+int sm_mixer_reply(SM_mixer *m, SM_command *cmd)
+{
+	if(!m->device)
+	{
+		cmd->cb(cmd);
+		return 0;
+	}
+	return sm_ring_write(m->replies, cmd, 1) ? 0 : -1;
+}
+
+
+void sm_mixer_poll(SM_mixer *m)
+{
+	SM_command cmd;
+	if(!m)
+		return;
+	while(sm_ring_read(m->replies, &cmd, 1))
+		cmd.cb(&cmd);
+}
+
+
+void sm_mixer_sync(SM_mixer *m)
+{
+	if(!m)
+		return;
+	sm_lock(m);
+	sm_run_commands(m);
+	sm_unlock(m);
+	sm_mixer_poll(m);
+}
+
+
+/* Run the master chain over the block in 'busbuf' */
+static void sm_run_master(SM_mixer *m)
+{
+	int i, s;
+	for(i = 0; i < SM_MAXFRAGMENT; i += SM_MASTER_CHUNK)
+		for(s = 0; s < m->nmaster; ++s)
+			m->master[s].cb(m->busbuf + i * 2, SM_MASTER_CHUNK,
+					m->master[s].userdata);
+}
+
+
+/*
+ * Run the commands, the control ticks and the mixer for one block
+ * of SM_MAXFRAGMENT frames into 'mixbuf'. Control ticks are run up
+ * front, and any events they queue are timestamped with the offset
+ * of the tick into the block.
+ */
+static void sm_block(SM_mixer *m)
+{
+	Uint64 t0, t1, t2, t3;
+	t0 = sm_timestamp();
+
+	/* Commands from the application */
+	sm_run_commands(m);
+
+	/* Streaming I/O, unless there's an I/O thread */
+	if(!m->iothread)
+		sm_stream_refill(m);
+
+	/* Control processing */
+	while(m->next_tick < SM_MAXFRAGMENT)
+	{
+		m->now = m->next_tick;
+		if(m->control_callback)
+		{
+			m->interval = m->control_callback(
+					m->control_userdata);
+			if(!m->interval)
+			{
+				m->control_callback = NULL;
+				m->interval = 10000;
+			}
+		}
+		else
+			m->interval = 10000;
+		m->next_tick = m->now + m->interval;
+	}
+	m->now = 0;
+	m->next_tick -= SM_MAXFRAGMENT;
+	t1 = sm_timestamp();
+
+	/* Audio processing */
+	sm_mix(m, m->mixbuf, SM_MAXFRAGMENT);
+	t2 = sm_timestamp();
+	if(m->audio_callback)
+		m->audio_callback(m->mixbuf, SM_MAXFRAGMENT,
+				m->audio_userdata);
+	m->blockbus = m->bus;
+	if(m->blockbus == SM_BUS_FLOAT)
+	{
+		smk_s32_float(m->busbuf, m->mixbuf, SM_MAXFRAGMENT * 2);
+		if(m->float_callback)
+			m->float_callback(m->busbuf, SM_MAXFRAGMENT,
+					m->float_userdata);
+		if(m->nmaster)
+			sm_run_master(m);
+	}
+	t3 = sm_timestamp();
+
+	sm_stats_begin(m);
+	sm_stats_add(m, SM_STAGE_CONTROL, t1 - t0);
+	sm_stats_add(m, SM_STAGE_MIXER, t2 - t1);
+	if(m->audio_callback || (m->blockbus == SM_BUS_FLOAT))
+		sm_stats_add(m, SM_STAGE_AUDIO, t3 - t2);
+	m->stats.underruns = m->underruns;
+	sm_stats_end(m);
+}
+
+
+/* Bytes per stereo frame of 'format' */
+static int sm_framesize(SM_formats format)
+{
+	switch(format)
+	{
+	  case SM_FORMAT_S16:
+		return 2 * 2;
+	  case SM_FORMAT_FLOAT:
+		return 2 * 4;
+	  case SM_FORMAT_S24:
+		return 2 * 3;
+	}
+	return 0;
+}
+
+
+/*
+ * Mix and process 'len' sample frames in the specified
+ * format into 'stream'.
+ */
+static void sm_run(SM_mixer *m, Uint8 *stream, int len, SM_formats format)
+{
+	while(len)
+	{
+		int frames;
+		Uint64 t;
+		if(m->mixpos >= SM_MAXFRAGMENT)
+		{
+			sm_block(m);
+			m->mixpos = 0;
+		}
+		t = sm_timestamp();
+		frames = SM_MAXFRAGMENT - m->mixpos;
+		if(frames > len)
+			frames = len;
+		sm_convert(m, stream, frames, format);
+		stream += frames * sm_framesize(format);
+		m->mixpos += frames;
+		len -= frames;
+		t = sm_timestamp() - t;
+		sm_stats_begin(m);
+		sm_stats_add(m, SM_STAGE_CONVERT, t);
+		sm_stats_end(m);
+	}
+}
+
+
+static void sm_callback(void *ud, Uint8 *stream, int len)
+{
+	SM_mixer *m = (SM_mixer *)ud;
+	int frames = len / sm_framesize(SM_FORMAT_S16);
+	Uint64 period = (Uint64)frames * 1000000000 / m->rate;
+	Uint64 t0 = sm_timestamp();
+	Uint64 t;
+	sm_run(m, stream, frames, SM_FORMAT_S16);
+	t = sm_timestamp() - t0;
+
+	/*
+	 * If we took longer than the buffer period, or were called
+	 * more than one period late, the output has most likely
+	 * dropped out.
+	 */
+	sm_stats_begin(m);
+	sm_stats_add(m, SM_STAGE_CALLBACK, t);
+	m->stats.audiotime += period;
+	m->stats.load = (float)t / period;
+	if(m->stats.load > m->stats.peakload)
+		m->stats.peakload = m->stats.load;
+	if((t > period) || (m->last_callback &&
+			(t0 - m->last_callback > 2 * period)))
+		++m->stats.xruns;
+	sm_stats_end(m);
+	m->last_callback = t0;
+}
+
+
+void sm_mixer_render(SM_mixer *m, void *output, int frames,
+		SM_formats format)
+{
+	sm_run(m, (Uint8 *)output, frames, format);
+}
+
+
+/* Zeroth order modified Bessel function of the first kind */
+static double sm_bessel_i0(double x)
+{
+	int k;
+	double sum = 1.0;
+	double term = 1.0;
+	for(k = 1; k < 32; ++k)
+	{
+		term *= x * x / (4.0 * k * k);
+		sum += term;
+	}
+	return sum;
+}
+
+
+/*
+ * Design a Kaiser windowed sinc lowpass filter, cutting off at
+ * 'cutoff' of the source Nyquist frequency. Each phase is normalized
+ * for unity gain at DC.
+ */
+static void sm_make_filter(Sint16 *filter, double cutoff)
+{
+	int p, t;
+	double w = SMK_RS_TAPS / 2;
+	for(p = 0; p <= SMK_RS_PHASES; ++p)
+	{
+		double h[SMK_RS_TAPS];
+		double sum = 0.0;
+		for(t = 0; t < SMK_RS_TAPS; ++t)
+		{
+			double x = t - SMK_RS_TAPS / 2 + 1 -
+					(double)p / SMK_RS_PHASES;
+			double r = x / w;
+			double px = M_PI * cutoff * x;
+			if(r * r >= 1.0)
+				h[t] = 0.0;
+			else
+				h[t] = (px ? sin(px) / px : 1.0) *
+						sm_bessel_i0(SM_RS_BETA *
+						sqrt(1.0 - r * r));
+			sum += h[t];
+		}
+		for(t = 0; t < SMK_RS_TAPS; ++t)
+		{
+			int c = (int)floor(h[t] / sum * 32768.0 + 0.5);
+			if(c > 32767)
+				c = 32767;
+			filter[p * SMK_RS_TAPS + t] = c;
+		}
+	}
+}
+
+
+/*
+ * Set up the tables shared by all mixers, and select the mixing
+ * kernels, the first time a mixer is created.
+ */
+static void sm_init_tables(void)
+{
+	int i;
+	if(SM_LOAD_ACQUIRE(tables_ready))
+		return;
+	while(SM_ATOMIC_EXCHANGE(tables_lock, 1))
+		SDL_Delay(1);
+	if(!tables_ready)
+	{
+		smk_init(SMK_AVX2);
+		for(i = 0; i <= SM_SINE_SIZE; ++i)
+			sinetab[i] = sin(i * 2.0 * M_PI / SM_SINE_SIZE);
+		for(i = 0; i < SM_RS_FILTERS; ++i)
+			sm_make_filter(rsfilters[i],
+					SM_RS_CUTOFF * pow(0.5, i * 0.5));
+		SM_STORE_RELEASE(tables_ready, 1);
+	}
+	SM_STORE_RELEASE(tables_lock, 0);
+}
+
+
+SM_mixer *sm_mixer_new(int rate)
+{
+	int i;
+	SM_mixer *m;
+	SM_pool *pool;
+
+	sm_init_tables();
+
+	m = calloc(1, sizeof(SM_mixer));
+	if(!m)
+	{
+		sm_log(SM_LOG_ERROR, "Couldn't allocate mixer!");
+		return NULL;
+	}
+	m->rate = rate ? rate : SM_DEFAULT_RATE;
+	m->mixpos = SM_MAXFRAGMENT;
+
+	m->bank = sm_bank_new();
+	m->mixbuf = malloc(SM_MAXFRAGMENT * sizeof(Sint32) * 2);
+	m->busbuf = malloc(SM_MAXFRAGMENT * sizeof(float) * 2);
+	pool = sm_pool_new(SM_VOICES);
+	if(!m->bank || !m->mixbuf || !m->busbuf || !pool)
+	{
+		sm_log(SM_LOG_ERROR, "Couldn't allocate mixer buffers!");
+		sm_pool_free(pool);
+		sm_mixer_close(m);
+		return NULL;
+	}
+	sm_pool_swap(m, pool);
+	sm_pool_free(pool);
+
+	/* Any non-zero seeds will do, but renders should be repeatable */
+	for(i = 0; i < SMK_DITHER_LANES; ++i)
+		m->dither[i] = 0x9e3779b9 * (i + 1);
+
+	m->commands = sm_ring_new(sizeof(SM_command), SM_COMMANDS);
+	m->replies = sm_ring_new(sizeof(SM_command), SM_COMMANDS);
+	if(!m->commands || !m->replies)
+	{
+		sm_log(SM_LOG_ERROR, "Couldn't allocate command queues!");
+		sm_mixer_close(m);
+		return NULL;
+	}
+
+	m->streamreqs = sm_ring_new(sizeof(SM_streamreq),
+			SM_STREAM_REQUESTS);
+	for(i = 0; i < SM_STREAMS; ++i)
+	{
+		m->streams[i].voice = -1;
+		m->streams[i].chunks = sm_ring_new(sizeof(SM_chunk),
+				SM_STREAM_CHUNKS);
+		if(!m->streams[i].chunks)
+			break;
+	}
+	if(!m->streamreqs || (i < SM_STREAMS))
+	{
+		sm_log(SM_LOG_ERROR, "Couldn't allocate stream buffers!");
+		sm_mixer_close(m);
+		return NULL;
+	}
+	return m;
+}
+
+
+SM_mixer *sm_mixer_open(int rate, int buffer)
+{
+	SDL_AudioSpec as;
+	SM_mixer *m;
+
+	if(device_mixer)
+	{
+		sm_log(SM_LOG_ERROR, "Audio device already in use!");
+		return NULL;
+	}
+
+	if(!(m = sm_mixer_new(rate)))
+		return NULL;
+
+	if(SDL_InitSubSystem(SDL_INIT_AUDIO) < 0)
+	{
+		sm_log(SM_LOG_ERROR, "Couldn't init SDL audio: %s",
+				SDL_GetError());
+		sm_mixer_close(m);
+		return NULL;
+	}
+
+	as.freq = m->rate;
+	as.format = AUDIO_S16SYS;
+	as.channels = 2;
+	as.samples = buffer;
+	as.callback = sm_callback;
+	as.userdata = m;
+	if(SDL_OpenAudio(&as, &audiospec) < 0)
+	{
+		sm_log(SM_LOG_ERROR, "Couldn't open SDL audio: %s",
+				SDL_GetError());
+		sm_mixer_close(m);
+		return NULL;
+	}
+	m->device = 1;
+	device_mixer = m;
+
+	if(audiospec.format != AUDIO_S16SYS)
+	{
+		sm_log(SM_LOG_ERROR, "Wrong audio format!");
+		sm_mixer_close(m);
+		return NULL;
+	}
+	if(audiospec.freq != as.freq)
+		sm_log(SM_LOG_WARNING, "Requested %d Hz; running at %d Hz.",
+				as.freq, audiospec.freq);
+	m->rate = audiospec.freq;
+
+	m->iowake = SDL_CreateSemaphore(0);
+	if(m->iowake)
+		m->iothread = SDL_CreateThread(sm_stream_thread, m);
+	if(!m->iothread)
+	{
+		sm_log(SM_LOG_ERROR, "Couldn't start streaming I/O thread!");
+		sm_mixer_close(m);
+		return NULL;
+	}
+
+	SDL_PauseAudio(0);
+	return m;
+}
+
+
+void sm_mixer_close(SM_mixer *m)
+{
+	int i;
+	SM_streamreq req;
+	if(!m)
+		return;
+	if(m->device)
+	{
+		SDL_CloseAudio();
+		device_mixer = NULL;
+	}
+	m->device = 0;
+	if(m->iothread)
+	{
+		SM_STORE_RELEASE(m->ioquit, 1);
+		SDL_SemPost(m->iowake);
+		SDL_WaitThread(m->iothread, NULL);
+	}
+	if(m->iowake)
+		SDL_DestroySemaphore(m->iowake);
+	if(m->commands)
+		sm_run_commands(m);
+	if(m->replies)
+		sm_mixer_poll(m);
+	if(m->streamreqs)
+		while(sm_ring_read(m->streamreqs, &req, 1))
+			if(req.stream)
+				sm_stream_unref(req.stream);
+	for(i = 0; i < SM_STREAMS; ++i)
+	{
+		if(m->streams[i].file)
+			fclose(m->streams[i].file);
+		sm_ring_free(m->streams[i].chunks);
+	}
+	sm_bank_free(m->bank);
+	free(m->mixbuf);
+	free(m->busbuf);
+	free(m->master);
+	free(m->appmaster);
+	sm_ring_free(m->commands);
+	sm_ring_free(m->replies);
+	sm_ring_free(m->streamreqs);
+	free(m->voices);
+	free(m->active);
+	free(m->freelist);
+	free(m);
+}
+
+
+/*--------------------------------------------------------
+	Sample cache
+--------------------------------------------------------*/
+
+/*
+ * The lock is only held while looking up, adding or removing entries,
+ * never while loading, so a simple spinlock is enough.
+ */
+static void sm_cache_lock(void)
+{
+	while(SM_ATOMIC_EXCHANGE(cache_lock, 1))
+		SDL_Delay(0);
+}
+
+
+static void sm_cache_unlock(void)
+{
+	SM_STORE_RELEASE(cache_lock, 0);
+}
+
+
+static void *sm_alloc_aligned(size_t size)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, SM_WAVE_ALIGN);
+#else
+	void *p;
+	if(posix_memalign(&p, SM_WAVE_ALIGN, size))
+		return NULL;
+	return p;
+#endif
+}
+
+
+static void sm_free_aligned(void *p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+
+/*
+ * Map file 'fn' read-only into memory. Returns NULL, without any
+ * message, if that fails.
+ */
+static void *sm_map_file(const char *fn, size_t *size)
+{
+#ifdef _WIN32
+	HANDLE f, fm;
+	DWORD sizehi;
+	void *p;
+	f = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(f == INVALID_HANDLE_VALUE)
+		return NULL;
+	*size = GetFileSize(f, &sizehi);
+	if(sizehi || !*size)
+	{
+		CloseHandle(f);
+		return NULL;
+	}
+	fm = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(f);
+	if(!fm)
+		return NULL;
+	p = MapViewOfFile(fm, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(fm);
+	return p;
+#else
+	struct stat st;
+	void *p;
+	int fd = open(fn, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	if((fstat(fd, &st) < 0) || !st.st_size)
+	{
+		close(fd);
+		return NULL;
+	}
+	*size = st.st_size;
+	p = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return p == MAP_FAILED ? NULL : p;
+#endif
+}
+
+
+static void sm_unmap_file(void *p, size_t size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(p);
+#else
+	munmap(p, size);
+#endif
+}
+
+
+static void sm_wave_free(SM_wave *w)
+{
+	if(w->map)
+		sm_unmap_file(w->map, w->mapsize);
+	else
+		sm_free_aligned(w->data);
+	free(w->path);
+	free(w);
+}
+
+
+/* Drop a reference to 'w', and free it if it was the last one */
+static void sm_wave_unref(SM_wave *w)
+{
+	SM_wave **wp;
+	sm_cache_lock();
+	if(--w->refcount)
+	{
+		sm_cache_unlock();
+		return;
+	}
+	for(wp = &cache; *wp; wp = &(*wp)->next)
+		if(*wp == w)
+		{
+			*wp = w->next;
+			break;
+		}
+	sm_cache_unlock();
+	sm_wave_free(w);
+}
+
+
+/*
+ * Copy 'length' bytes of waveform from 'wav' into a new buffer for
+ * 'w', with SM_GUARD samples of silence at both ends. The guard is a
+ * multiple of SM_WAVE_ALIGN bytes, so the waveform itself is aligned.
+ */
+static int sm_wave_pad(SM_wave *w, Uint8 *wav, Uint32 length)
+{
+	int guard = SM_GUARD * sizeof(Sint16);
+	w->data = sm_alloc_aligned(length + 2 * guard);
+	if(!w->data)
+		return -1;
+	memset(w->data, 0, guard);
+	memcpy(w->data + guard, wav, length);
+	memset(w->data + guard + length, 0, guard);
+	w->length = length / 2;
+	return 0;
+}
+
+
+/* Load and convert 'file' into a new, uncached wave */
+static int sm_wave_load(SM_wave **wave, const char *file)
+{
+	int failed = 0;
+	SDL_AudioSpec spec;
+	Uint8 *wav;
+	Uint32 length;
+	SM_wave *w;
+	if(SDL_LoadWAV(file, &spec, &wav, &length) == NULL)
+		return -1;
+	if(spec.channels != 1)
+	{
+		sm_log(SM_LOG_ERROR, "Only mono sounds are supported!");
+		failed = 1;
+	}
+	switch(spec.format)
+	{
+	  case AUDIO_S16LSB:
+	  case AUDIO_S16MSB:
+		if(spec.format != AUDIO_S16SYS)
+			flip_endian(wav, length);
+		break;
+	  default:
+		sm_log(SM_LOG_ERROR, "Unsupported sample format!");
+		failed = 1;
+		break;
+	}
+	if(failed)
+	{
+		SDL_FreeWAV(wav);
+		return -2;
+	}
+	w = calloc(1, sizeof(SM_wave));
+	if(!w || (sm_wave_pad(w, wav, length) < 0))
+	{
+		free(w);
+		SDL_FreeWAV(wav);
+		return -3;
+	}
+	SDL_FreeWAV(wav);
+	w->rate = spec.freq;
+	w->refcount = 1;
+	*wave = w;
+	return 0;
+}
+
+
+/* Name of the cache file of sample file 'file' */
+static char *sm_cache_name(const char *file)
+{
+	char *cfn = malloc(strlen(file) + sizeof(SM_CACHE_SUFFIX));
+	if(!cfn)
+		return NULL;
+	strcpy(cfn, file);
+	strcat(cfn, SM_CACHE_SUFFIX);
+	return cfn;
+}
+
+
+static Uint32 sm_adler32(const Uint8 *data, size_t size)
+{
+	Uint32 a = 1, b = 0;
+	while(size)
+	{
+		/* 5552 bytes is the most we can sum before b can overflow */
+		size_t n = size < 5552 ? size : 5552;
+		size -= n;
+		while(n--)
+		{
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+
+/*
+ * Check that 'h', of a cache file of 'size' bytes, is for the current
+ * version of the source file described by 'src', and can be played as
+ * is. Returns 1 if it's good, 0 if it's stale or from another version
+ * or machine, or -1 if it's corrupt.
+ */
+static int sm_cache_valid(const SM_cachehdr *h, size_t size,
+		const struct stat *src)
+{
+	if((size < sizeof(SM_cachehdr)) ||
+			memcmp(h->magic, SM_CACHE_MAGIC, sizeof(h->magic)))
+		return -1;
+	if((h->version != SM_CACHE_VERSION) ||
+			(h->byteorder != SM_CACHE_BYTEORDER) ||
+			(h->guard != SM_GUARD))
+		return 0;
+	if((h->srcmtime != (Sint64)src->st_mtime) ||
+			(h->srcsize != (Sint64)src->st_size))
+		return 0;
+	if(size != sizeof(SM_cachehdr) + ((size_t)h->length + 2 * SM_GUARD) *
+			sizeof(Sint16))
+		return -1;
+	return 1;
+}
+
+
+/*
+ * Map the cache file of 'file', described by 'src', as a new wave with
+ * one reference. Fails quietly if there's no usable cache file. The
+ * checksum is not checked here, as that would page in the whole file.
+ */
+static int sm_wave_map(SM_wave **wave, const char *file,
+		const struct stat *src)
+{
+	SM_wave *w;
+	void *p;
+	size_t size;
+	char *cfn = sm_cache_name(file);
+	if(!cfn)
+		return -1;
+	p = sm_map_file(cfn, &size);
+	free(cfn);
+	if(!p)
+		return -1;
+	if((sm_cache_valid((SM_cachehdr *)p, size, src) <= 0) ||
+			!(w = calloc(1, sizeof(SM_wave))))
+	{
+		sm_unmap_file(p, size);
+		return -1;
+	}
+	w->map = p;
+	w->mapsize = size;
+	w->data = (Uint8 *)p + sizeof(SM_cachehdr);
+	w->length = ((SM_cachehdr *)p)->length;
+	w->rate = ((SM_cachehdr *)p)->rate;
+	w->refcount = 1;
+	*wave = w;
+	return 0;
+}
+
+
+int sm_cache_build(const char *file)
+{
+	SM_cachehdr h;
+	struct stat st;
+	SM_wave *w;
+	FILE *f;
+	char *cfn, *tmp;
+	size_t bytes;
+	int res = 0;
+	if(stat(file, &st) < 0)
+	{
+		sm_log(SM_LOG_ERROR, "Could not open \"%s\": %s", file,
+				strerror(errno));
+		return -1;
+	}
+	if((res = sm_wave_load(&w, file)) < 0)
+		return res;
+	bytes = ((size_t)w->length + 2 * SM_GUARD) * sizeof(Sint16);
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SM_CACHE_MAGIC, sizeof(h.magic));
+	h.version = SM_CACHE_VERSION;
+	h.byteorder = SM_CACHE_BYTEORDER;
+	h.rate = w->rate;
+	h.length = w->length;
+	h.guard = SM_GUARD;
+	h.checksum = sm_adler32(w->data, bytes);
+	h.srcmtime = st.st_mtime;
+	h.srcsize = st.st_size;
+
+	/* Write to a temporary file, so readers never see a partial one */
+	cfn = sm_cache_name(file);
+	tmp = cfn ? malloc(strlen(cfn) + 5) : NULL;
+	if(!tmp)
+	{
+		free(cfn);
+		sm_wave_free(w);
+		return -3;
+	}
+	sprintf(tmp, "%s.tmp", cfn);
+	if(!(f = fopen(tmp, "wb")))
+	{
+		sm_log(SM_LOG_ERROR, "Could not create \"%s\": %s", tmp,
+				strerror(errno));
+		res = -1;
+	}
+	else
+	{
+		if((fwrite(&h, sizeof(h), 1, f) != 1) ||
+				(fwrite(w->data, bytes, 1, f) != 1))
+			res = -1;
+		if(fclose(f) != 0)
+			res = -1;
+		if(res < 0)
+			sm_log(SM_LOG_ERROR, "Error writing \"%s\": %s", tmp,
+					strerror(errno));
+#ifdef _WIN32
+		if(!res)
+			remove(cfn);
+#endif
+		if(!res && (rename(tmp, cfn) < 0))
+		{
+			sm_log(SM_LOG_ERROR, "Could not rename \"%s\": %s",
+					tmp, strerror(errno));
+			res = -1;
+		}
+		if(res < 0)
+			remove(tmp);
+	}
+	free(tmp);
+	free(cfn);
+	sm_wave_free(w);
+	return res;
+}
+
+
+int sm_cache_check(const char *file, int full)
+{
+	struct stat st;
+	SM_cachehdr *h;
+	size_t size;
+	int res;
+	char *cfn = sm_cache_name(file);
+	if(!cfn)
+		return -1;
+	h = (stat(file, &st) < 0) ? NULL : sm_map_file(cfn, &size);
+	free(cfn);
+	if(!h)
+		return 0;
+	res = sm_cache_valid(h, size, &st);
+	if((res > 0) && full && (sm_adler32((Uint8 *)(h + 1),
+			size - sizeof(SM_cachehdr)) != h->checksum))
+		res = -1;
+	sm_unmap_file(h, size);
+	return res;
+}
+
+
+/* Canonical path of 'file', or NULL if it doesn't exist */
+static char *sm_canonical_path(const char *file)
+{
+#ifdef _WIN32
+	return _fullpath(NULL, file, 0);
+#else
+	return realpath(file, NULL);
+#endif
+}
+
+
+/*
+ * Find the cached wave for 'path' as of 'mtime', and add a reference
+ * to it. The cache must be locked.
+ */
+static SM_wave *sm_cache_find(const char *path, time_t mtime)
+{
+	SM_wave *w;
+	for(w = cache; w; w = w->next)
+		if((w->mtime == mtime) && !strcmp(w->path, path))
+		{
+			++w->refcount;
+			return w;
+		}
+	return NULL;
+}
+
+
+static Uint32 sm_get32le(const Uint8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((Uint32)p[3] << 24);
+}
+
+
+/*
+ * Find the waveform of 16 bit mono PCM WAV file 'f', for streaming.
+ * Returns -1 if it's not such a file.
+ */
+static int sm_wav_info(FILE *f, int *rate, Uint32 *length, long *offset)
+{
+	Uint8 h[16];
+	int fmt = 0;
+	long end;
+	if((fread(h, 12, 1, f) != 1) || memcmp(h, "RIFF", 4) ||
+			memcmp(h + 8, "WAVE", 4))
+		return -1;
+	while(fread(h, 8, 1, f) == 1)
+	{
+		Uint32 size = sm_get32le(h + 4);
+		if(!memcmp(h, "fmt ", 4))
+		{
+			if((size < 16) || (fread(h, 16, 1, f) != 1))
+				return -1;
+			/* PCM, mono, 16 bits */
+			if((h[0] != 1) || h[1] || (h[2] != 1) || h[3] ||
+					(h[14] != 16) || h[15])
+				return -1;
+			*rate = sm_get32le(h + 4);
+			fmt = 1;
+			size -= 16;
+		}
+		else if(!memcmp(h, "data", 4))
+		{
+			if(!fmt || ((*offset = ftell(f)) < 0) ||
+					(fseek(f, 0, SEEK_END) < 0) ||
+					((end = ftell(f)) < 0))
+				return -1;
+			/* Don't trust the size of files still being written */
+			if(size > (Uint32)(end - *offset))
+				size = end - *offset;
+			*length = size / sizeof(Sint16);
+			return 0;
+		}
+		if(fseek(f, size + (size & 1), SEEK_CUR) < 0)
+			return -1;
+	}
+	return -1;
+}
+
+
+/* Check if 'file' should be streamed rather than loaded */
+static int sm_wave_streamed(const char *file)
+{
+	int rate;
+	Uint32 length;
+	long offset;
+	int res;
+	FILE *f = fopen(file, "rb");
+	if(!f)
+		return 0;
+	res = sm_wav_info(f, &rate, &length, &offset);
+	fclose(f);
+	return (res == 0) && (length > SM_STREAM_MIN);
+}
+
+
+int sm_cache_wanted(const char *file)
+{
+	int rate;
+	Uint32 length;
+	long offset;
+	int res;
+	FILE *f = fopen(file, "rb");
+	if(!f)
+		return -1;
+	res = sm_wav_info(f, &rate, &length, &offset);
+	fclose(f);
+	return (res == 0) && (length <= SM_STREAM_MIN);
+}
+
+
+/*
+ * Get a reference to the wave of 'file', from the cache if it has
+ * been loaded, and not modified, since. Otherwise, the cache file is
+ * mapped, or if there is no valid one, the file is loaded. This is
+ * done without holding the lock, so if another thread gets there
+ * first, we drop our copy and use theirs. Returns 1, without a wave,
+ * if the file is long enough that it should be streamed.
+ */
+static int sm_wave_get(SM_wave **wave, const char *file)
+{
+	struct stat st;
+	SM_wave *w, *cw;
+	char *path;
+	int res;
+	if(!(path = sm_canonical_path(file)) || (stat(path, &st) < 0))
+	{
+		free(path);
+		return -1;
+	}
+	sm_cache_lock();
+	w = sm_cache_find(path, st.st_mtime);
+	sm_cache_unlock();
+	if(w)
+	{
+		free(path);
+		*wave = w;
+		return 0;
+	}
+	if(sm_wave_streamed(path))
+	{
+		free(path);
+		return 1;
+	}
+	if((sm_wave_map(&w, path, &st) < 0) &&
+			((res = sm_wave_load(&w, path)) < 0))
+	{
+		free(path);
+		return res;
+	}
+	w->path = path;
+	w->mtime = st.st_mtime;
+	sm_cache_lock();
+	if((cw = sm_cache_find(path, st.st_mtime)))
+	{
+		sm_cache_unlock();
+		sm_wave_free(w);
+		*wave = cw;
+		return 0;
+	}
+	w->next = cache;
+	cache = w;
+	sm_cache_unlock();
+	*wave = w;
+	return 0;
+}
+
+
+/*--------------------------------------------------------
+	Sounds and banks
+--------------------------------------------------------*/
+
+/* Free the data of 'sound', and mark it empty */
+static void sm_sound_free(SM_sound *sound)
+{
+	if(sound->wave)
+		sm_wave_unref(sound->wave);
+	else
+		free(sound->data);
+	if(sound->stream)
+		sm_stream_unref(sound->stream);
+	memset(sound, 0, sizeof(SM_sound));
+}
+
+
+/*
+ * Set up 'sound' for streaming 'file', with the head loaded. Streams
+ * are not cached, as they hold only the head in memory anyway.
+ */
+static int sm_stream_load(SM_sound *sound, const char *file)
+{
+	SM_stream *st;
+	Sint16 *head;
+	FILE *f;
+	int rate;
+	Uint32 length, hl;
+	long offset;
+	if(!(f = fopen(file, "rb")))
+		return -1;
+	if(sm_wav_info(f, &rate, &length, &offset) < 0)
+	{
+		fclose(f);
+		return -2;
+	}
+	hl = length < SM_STREAM_HEAD ? length : SM_STREAM_HEAD;
+	st = calloc(1, sizeof(SM_stream));
+	head = malloc((hl + 2 * SM_GUARD) * sizeof(Sint16));
+	if(!st || !head || !(st->path = sm_canonical_path(file)))
+	{
+		fclose(f);
+		if(st)
+			free(st->path);
+		free(st);
+		free(head);
+		return -3;
+	}
+	memset(head, 0, SM_GUARD * sizeof(Sint16));
+	memset(head + SM_GUARD + hl, 0, SM_GUARD * sizeof(Sint16));
+	if((fseek(f, offset, SEEK_SET) < 0) ||
+			(fread(head + SM_GUARD, sizeof(Sint16), hl, f) != hl))
+	{
+		sm_log(SM_LOG_ERROR, "Could not read \"%s\"!", file);
+		fclose(f);
+		free(st->path);
+		free(st);
+		free(head);
+		return -1;
+	}
+	fclose(f);
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+	flip_endian((Uint8 *)(head + SM_GUARD), hl * sizeof(Sint16));
+#endif
+	st->offset = offset;
+	st->length = length;
+	st->headlength = hl;
+	st->refcount = 1;
+	sound->stream = st;
+	sound->data = (Uint8 *)head;
+	sound->length = length;
+	sound->rate = rate;
+	return 0;
+}
+
+
+static int sm_sound_load(SM_sound *sound, const char *file)
+{
+	int res;
+	SM_wave *w;
+	sm_sound_free(sound);
+	if((res = sm_wave_get(&w, file)) < 0)
+		return res;
+	if(res > 0)
+		return sm_stream_load(sound, file);
+	sound->wave = w;
+	sound->data = w->data;
+	sound->length = w->length;
+	sound->rate = w->rate;
+	return 0;
+}
+
+
+static int sm_sound_load_synth(SM_sound *sound, const char *def)
+{
+	int res = 0;
+	sm_sound_free(sound);
+	sound->data = (Uint8 *)strdup(def);
+	if(!sound->data)
+		return -3;
+	if(strncmp(def, "fm2 ", 4) == 0)
+	{
+		if(sscanf(def, "fm2 %f %f %f",
+				&sound->pitch, &sound->fm, &sound->decay) < 3)
+		{
+			sm_log(SM_LOG_ERROR, "fm2: Too few parameters!");
+			res = -2;
+		}
+	}
+	else
+	{
+		sm_log(SM_LOG_ERROR, "Unknown instrument type!");
+		res = -1;
+	}
+	if(res < 0)
+		sm_sound_free(sound);
+	return res;
+}
+
+
+/*
+ * Stop any voices playing 'sound', or all voices if 'sound' is
+ * negative. They stay listed until the mixer retires them as usual,
+ * so the active list stays consistent, but they no longer refer to
+ * any slot, so the bank can be replaced by a smaller one.
+ */
+static void sm_stop_voices(SM_mixer *m, int sound)
+{
+	int i;
+	for(i = 0; i < m->nactive; ++i)
+	{
+		SM_voice *v = &m->voices[m->active[i]];
+		if((v->sound < 0) || ((sound >= 0) && (v->sound != sound)))
+			continue;
+		sm_stream_stop(m, v);
+		v->sound = -2;
+	}
+}
+
+
+SM_bank *sm_bank_new(void)
+{
+	SM_bank *b = calloc(1, sizeof(SM_bank));
+	if(!b)
+		return NULL;
+	b->sounds = calloc(SM_SOUNDS, sizeof(SM_sound));
+	if(!b->sounds)
+	{
+		free(b);
+		return NULL;
+	}
+	b->nsounds = SM_SOUNDS;
+	return b;
+}
+
+
+void sm_bank_free(SM_bank *b)
+{
+	int i;
+	if(!b)
+		return;
+	for(i = 0; i < b->nsounds; ++i)
+		sm_sound_free(&b->sounds[i]);
+	free(b->sounds);
+	free(b);
+}
+
+
+/* Make sure bank 'b' (not installed) has a slot 'sound' */
+static int sm_bank_grow(SM_bank *b, int sound)
+{
+	SM_sound *ns;
+	if(sound < b->nsounds)
+		return 0;
+	ns = realloc(b->sounds, (sound + 1) * sizeof(SM_sound));
+	if(!ns)
+		return -3;
+	memset(ns + b->nsounds, 0,
+			(sound + 1 - b->nsounds) * sizeof(SM_sound));
+	b->sounds = ns;
+	b->nsounds = sound + 1;
+	return 0;
+}
+
+
+int sm_bank_load(SM_bank *b, int sound, const char *file)
+{
+	if(sound < 0 || sound >= SM_MAXSOUNDS || sm_bank_grow(b, sound) < 0)
+		return -3;
+	return sm_sound_load(&b->sounds[sound], file);
+}
+
+
+int sm_bank_load_synth(SM_bank *b, int sound, const char *def)
+{
+	if(sound < 0 || sound >= SM_MAXSOUNDS || sm_bank_grow(b, sound) < 0)
+		return -3;
+	return sm_sound_load_synth(&b->sounds[sound], def);
+}
+
+
+SM_bank *sm_mixer_swap_bank(SM_mixer *m, SM_bank *b)
+{
+	SM_bank *old = m->bank;
+	sm_stop_voices(m, -1);
+	m->bank = b;
+	return old;
+}
+
+
+/* Reply handler: Free a sound passed back from the audio context */
+static void cmd_free_sound(SM_command *cmd)
+{
+	sm_sound_free((SM_sound *)cmd->p);
+	free(cmd->p);
+}
+
+
+/* Reply handler: Free a slot array passed back from the audio context */
+static void cmd_free_slots(SM_command *cmd)
+{
+	free(cmd->p);
+}
+
+
+/*
+ * Move the sounds of the current bank into the 'i[0]' slots of 'p',
+ * if the bank is smaller than that, and pass the old slots back.
+ */
+static void cmd_grow_bank(SM_command *cmd)
+{
+	SM_mixer *m = (SM_mixer *)cmd->target;
+	SM_bank *b = m->bank;
+	if(cmd->i[0] > b->nsounds)
+	{
+		SM_sound *old = b->sounds;
+		memcpy(cmd->p, old, b->nsounds * sizeof(SM_sound));
+		b->sounds = cmd->p;
+		b->nsounds = cmd->i[0];
+		cmd->p = old;
+	}
+	cmd->cb = cmd_free_slots;
+	sm_mixer_reply(m, cmd);
+}
+
+
+/* Swap sound 'i[0]' with the one pointed to by 'p' (audio context) */
+static void cmd_set_sound(SM_command *cmd)
+{
+	SM_mixer *m = (SM_mixer *)cmd->target;
+	if(cmd->i[0] < m->bank->nsounds)
+	{
+		SM_sound tmp = m->bank->sounds[cmd->i[0]];
+		sm_stop_voices(m, cmd->i[0]);
+		m->bank->sounds[cmd->i[0]] = *(SM_sound *)cmd->p;
+		*(SM_sound *)cmd->p = tmp;
+	}
+	cmd->cb = cmd_free_sound;
+	sm_mixer_reply(m, cmd);
+}
+
+
+/*
+ * Install 'sound' in slot 'slot', freeing the old sound later. Every
+ * bank has at least SM_SOUNDS slots, so for higher slots, we send
+ * along a slot array large enough to grow any bank to hold 'slot'.
+ */
+static int sm_set_sound(SM_mixer *m, int slot, SM_sound *sound)
+{
+	SM_command cmd;
+	cmd.target = m;
+	if(slot >= SM_SOUNDS)
+	{
+		cmd.cb = cmd_grow_bank;
+		cmd.i[0] = slot + 1;
+		cmd.p = calloc(slot + 1, sizeof(SM_sound));
+		if(!cmd.p)
+		{
+			sm_sound_free(sound);
+			free(sound);
+			return -3;
+		}
+		sm_mixer_send(m, &cmd);
+	}
+	cmd.cb = cmd_set_sound;
+	cmd.i[0] = slot;
+	cmd.p = sound;
+	sm_mixer_send(m, &cmd);
+	return 0;
+}
+
+
+void sm_mixer_unload(SM_mixer *m, int sound)
+{
+	SM_sound *s;
+	if(sound < 0 || sound >= SM_MAXSOUNDS || !m)
+		return;
+	s = calloc(1, sizeof(SM_sound));
+	if(!s)
+		return;
+	sm_set_sound(m, sound, s);
+}
+
+
+int sm_mixer_loaded(SM_mixer *m, unsigned sound)
+{
+	if(!m || sound >= (unsigned)m->bank->nsounds ||
+			!m->bank->sounds[sound].data)
+		return 0;
+	return m->bank->sounds[sound].length ? 1 : 2;
+}
+
+
+int sm_mixer_get_sounds(SM_mixer *m)
+{
+	return m->bank->nsounds;
+}
+
+
+int sm_mixer_load(SM_mixer *m, int sound, const char *file)
+{
+	int res;
+	SM_sound *s;
+	if(sound < 0 || sound >= SM_MAXSOUNDS || !m)
+		return -3;
+	s = calloc(1, sizeof(SM_sound));
+	if(!s)
+		return -3;
+	if((res = sm_sound_load(s, file)) < 0)
 	{
-		if(sscanf(def, "fm2 %f %f %f",
-				&sounds[sound].pitch,
-				&sounds[sound].fm,
-				&sounds[sound].decay) < 3)
-		{
-			fprintf(stderr, "fm2: Too few parameters!\n");
-			res = -2;
-		}
+		free(s);
+		return res;
 	}
-	else
+	return sm_set_sound(m, sound, s);
+}
+
+
+int sm_mixer_load_synth(SM_mixer *m, int sound, const char *def)
+{
+	int res;
+	SM_sound *s;
+	if(sound < 0 || sound >= SM_MAXSOUNDS || !m)
+		return -3;
+	s = calloc(1, sizeof(SM_sound));
+	if(!s)
+		return -3;
+	if((res = sm_sound_load_synth(s, def)) < 0)
 	{
-		fprintf(stderr, "Unknown instrument type!\n");
-		res = -1;
+		free(s);
+		return res;
 	}
-	if(res < 0)
+	return sm_set_sound(m, sound, s);
+}
+
+
+void sm_mixer_set_control_cb(SM_mixer *m, sm_mixer_control_cb cb,
+		void *userdata)
+{
+	sm_lock(m);
+	m->control_callback = cb;
+	m->control_userdata = userdata;
+	m->next_tick = m->now;
+	sm_unlock(m);
+}
+
+
+void sm_mixer_set_audio_cb(SM_mixer *m, sm_mixer_audio_cb cb,
+		void *userdata)
+{
+	sm_lock(m);
+	m->audio_callback = cb;
+	m->audio_userdata = userdata;
+	sm_unlock(m);
+}
+
+
+void sm_mixer_set_float_cb(SM_mixer *m, sm_mixer_float_cb cb,
+		void *userdata)
+{
+	sm_lock(m);
+	m->float_callback = cb;
+	m->float_userdata = userdata;
+	sm_unlock(m);
+}
+
+
+void sm_mixer_set_bus(SM_mixer *m, SM_buses bus)
+{
+	sm_lock(m);
+	m->bus = bus;
+	sm_unlock(m);
+}
+
+
+void sm_mixer_force_interval(SM_mixer *m, unsigned interval)
+{
+	if(m->next_tick > m->now + (int)interval)
+		m->next_tick = m->now + interval;
+}
+
+
+/*--------------------------------------------------------
+	Master chain
+--------------------------------------------------------*/
+
+void sm_master_saturate(float *buf, int frames, void *userdata)
+{
+	smk_saturate(buf, frames * 2);
+}
+
+
+/* Reply handler: Free a master chain passed back from the audio context */
+static void cmd_free_master(SM_command *cmd)
+{
+	free(cmd->p);
+}
+
+
+/* Swap in the master chain of 'i[0]' stages at 'p' (audio context) */
+static void cmd_set_master(SM_command *cmd)
+{
+	SM_mixer *m = (SM_mixer *)cmd->target;
+	SM_masterstage *old = m->master;
+	m->master = cmd->p;
+	m->nmaster = cmd->i[0];
+	cmd->p = old;
+	cmd->cb = cmd_free_master;
+	sm_mixer_reply(m, cmd);
+}
+
+
+/* Send a copy of the application side chain to the audio context */
+static int sm_master_update(SM_mixer *m)
+{
+	SM_command cmd;
+	SM_masterstage *ms = NULL;
+	if(m->nappmaster)
 	{
-		free(sounds[sound].data);
-		sounds[sound].data = NULL;
-		sounds[sound].length = 0;
+		ms = malloc(m->nappmaster * sizeof(SM_masterstage));
+		if(!ms)
+			return -1;
+		memcpy(ms, m->appmaster,
+				m->nappmaster * sizeof(SM_masterstage));
 	}
-	SDL_UnlockAudio();
-	return res;
+	cmd.cb = cmd_set_master;
+	cmd.target = m;
+	cmd.i[0] = m->nappmaster;
+	cmd.p = ms;
+	sm_mixer_send(m, &cmd);
+	return 0;
+}
+
+
+int sm_mixer_master_insert(SM_mixer *m, int pos, sm_master_cb stage,
+		void *userdata)
+{
+	SM_masterstage *ms;
+	if(!stage)
+		return -1;
+	ms = realloc(m->appmaster,
+			(m->nappmaster + 1) * sizeof(SM_masterstage));
+	if(!ms)
+		return -1;
+	m->appmaster = ms;
+	if((pos < 0) || (pos > m->nappmaster))
+		pos = m->nappmaster;
+	memmove(ms + pos + 1, ms + pos,
+			(m->nappmaster - pos) * sizeof(SM_masterstage));
+	ms[pos].cb = stage;
+	ms[pos].userdata = userdata;
+	++m->nappmaster;
+	if(sm_master_update(m) < 0)
+	{
+		sm_mixer_master_remove(m, pos);
+		return -1;
+	}
+	return pos;
+}
+
+
+int sm_mixer_master_remove(SM_mixer *m, int pos)
+{
+	SM_masterstage *ms = m->appmaster;
+	if((pos < 0) || (pos >= m->nappmaster))
+		return -1;
+	memmove(ms + pos, ms + pos + 1,
+			(m->nappmaster - pos - 1) * sizeof(SM_masterstage));
+	--m->nappmaster;
+	return sm_master_update(m);
+}
+
+
+int sm_mixer_master_move(SM_mixer *m, int from, int to)
+{
+	SM_masterstage *ms = m->appmaster;
+	SM_masterstage tmp;
+	if((from < 0) || (from >= m->nappmaster) ||
+			(to < 0) || (to >= m->nappmaster))
+		return -1;
+	tmp = ms[from];
+	if(from < to)
+		memmove(ms + from, ms + from + 1,
+				(to - from) * sizeof(SM_masterstage));
+	else
+		memmove(ms + to + 1, ms + to,
+				(from - to) * sizeof(SM_masterstage));
+	ms[to] = tmp;
+	return sm_master_update(m);
+}
+
+
+int sm_mixer_master_stages(SM_mixer *m)
+{
+	return m->nappmaster;
+}
+
+
+/*--------------------------------------------------------
+	Default mixer
+--------------------------------------------------------*/
+
+/* Callbacks installed through the default mixer calls */
+static sm_control_cb default_control_cb = NULL;
+static sm_audio_cb default_audio_cb = NULL;
+static sm_float_cb default_float_cb = NULL;
+
+static unsigned sm_default_control(void *userdata)
+{
+	return default_control_cb();
+}
+
+
+static void sm_default_audio(Sint32 *buf, int frames, void *userdata)
+{
+	default_audio_cb(buf, frames);
+}
+
+
+static void sm_default_float(float *buf, int frames, void *userdata)
+{
+	default_float_cb(buf, frames);
+}
+
+
+int sm_open(int rate, int buffer)
+{
+	if(!(defmixer = sm_mixer_open(rate, buffer)))
+		return -1;
+	return 0;
+}
+
+
+int sm_open_offline(int rate)
+{
+	if(!(defmixer = sm_mixer_new(rate)))
+		return -1;
+	return 0;
+}
+
+
+void sm_close(void)
+{
+	sm_mixer_close(defmixer);
+	defmixer = NULL;
+}
+
+
+SM_mixer *sm_default(void)
+{
+	return defmixer;
+}
+
+
+int sm_get_rate(void)
+{
+	return sm_mixer_get_rate(defmixer);
+}
+
+
+int sm_load(int sound, const char *file)
+{
+	return sm_mixer_load(defmixer, sound, file);
+}
+
+
+int sm_load_synth(int sound, const char *def)
+{
+	return sm_mixer_load_synth(defmixer, sound, def);
+}
+
+
+void sm_unload(int sound)
+{
+	sm_mixer_unload(defmixer, sound);
+}
+
+
+int sm_loaded(unsigned sound)
+{
+	return sm_mixer_loaded(defmixer, sound);
+}
+
+
+int sm_get_sounds(void)
+{
+	return sm_mixer_get_sounds(defmixer);
 }
 
 
+/*
+ * These uninstall the mixer callback before changing the callback it
+ * forwards to, so the audio context never sees a half done change.
+ */
 void sm_set_control_cb(sm_control_cb cb)
 {
-	SDL_LockAudio();
-	control_callback = cb;
-	next_tick = 0;
-	SDL_UnlockAudio();
+	sm_mixer_set_control_cb(defmixer, NULL, NULL);
+	default_control_cb = cb;
+	if(cb)
+		sm_mixer_set_control_cb(defmixer, sm_default_control, NULL);
 }
 
 
 void sm_set_audio_cb(sm_audio_cb cb)
 {
-	SDL_LockAudio();
-	audio_callback = cb;
-	SDL_UnlockAudio();
+	sm_mixer_set_audio_cb(defmixer, NULL, NULL);
+	default_audio_cb = cb;
+	if(cb)
+		sm_mixer_set_audio_cb(defmixer, sm_default_audio, NULL);
+}
+
+
+void sm_set_float_cb(sm_float_cb cb)
+{
+	sm_mixer_set_float_cb(defmixer, NULL, NULL);
+	default_float_cb = cb;
+	if(cb)
+		sm_mixer_set_float_cb(defmixer, sm_default_float, NULL);
+}
+
+
+void sm_set_bus(SM_buses bus)
+{
+	sm_mixer_set_bus(defmixer, bus);
+}
+
+
+int sm_master_insert(int pos, sm_master_cb stage, void *userdata)
+{
+	return sm_mixer_master_insert(defmixer, pos, stage, userdata);
+}
+
+
+int sm_master_remove(int pos)
+{
+	return sm_mixer_master_remove(defmixer, pos);
+}
+
+
+int sm_master_move(int from, int to)
+{
+	return sm_mixer_master_move(defmixer, from, to);
+}
+
+
+int sm_master_stages(void)
+{
+	return sm_mixer_master_stages(defmixer);
+}
+
+
+void sm_send(SM_command *cmd)
+{
+	sm_mixer_send(defmixer, cmd);
+}
+
+
+int sm_reply(SM_command *cmd)
+{
+	return sm_mixer_reply(defmixer, cmd);
+}
+
+
+void sm_poll(void)
+{
+	sm_mixer_poll(defmixer);
+}
+
+
+void sm_sync(void)
+{
+	sm_mixer_sync(defmixer);
+}
+
+
+void sm_get_stats(SM_stats *st)
+{
+	sm_mixer_get_stats(defmixer, st);
+}
+
+
+void sm_print_stats(FILE *f)
+{
+	sm_mixer_print_stats(defmixer, f);
+}
+
+
+void sm_render(void *output, int frames, SM_formats format)
+{
+	sm_mixer_render(defmixer, output, frames, format);
+}
+
+
+void sm_play(unsigned voice, unsigned sound, float lvol, float rvol)
+{
+	sm_mixer_play(defmixer, voice, sound, lvol, rvol);
+}
+
+
+void sm_decay(unsigned voice, float decay)
+{
+	sm_mixer_decay(defmixer, voice, decay);
+}
+
+
+void sm_pitch(unsigned voice, float pitch)
+{
+	sm_mixer_pitch(defmixer, voice, pitch);
+}
+
+
+int sm_start(unsigned group, unsigned sound, float lvol, float rvol)
+{
+	return sm_mixer_start(defmixer, group, sound, lvol, rvol);
+}
+
+
+void sm_group_decay(unsigned group, float decay)
+{
+	sm_mixer_group_decay(defmixer, group, decay);
+}
+
+
+void sm_set_polyphony(unsigned group, int voices)
+{
+	sm_mixer_set_polyphony(defmixer, group, voices);
+}
+
+
+int sm_get_voices(void)
+{
+	return sm_mixer_get_voices(defmixer);
 }
 
 
 void sm_force_interval(unsigned interval)
 {
-	if(next_tick > interval)
-		next_tick = interval;
+	sm_mixer_force_interval(defmixer, interval);
+}
+
+
+int sm_get_interval(void)
+{
+	return sm_mixer_get_interval(defmixer);
+}
+
+
+int sm_get_next_tick(void)
+{
+	return sm_mixer_get_next_tick(defmixer);
+}
+
+
+SM_bank *sm_swap_bank(SM_bank *b)
+{
+	return sm_mixer_swap_bank(defmixer, b);
+}
+
+
+int sm_set_voices(int voices)
+{
+	return sm_mixer_set_voices(defmixer, voices);
 }
@@ -7,35 +7,81 @@
 #ifndef	SMIXER_H
 #define	SMIXER_H
 
+#include <stdio.h>
 #include "SDL.h"
 
 /*
  * Maximum number of sample frames that will ever be
  * processed in one go. Audio processing callbacks
  * rely on never getting a 'frames' argument greater
- * than this value.
+ * than this value. (The mixer always runs in blocks of
+ * exactly this size.)
  */
 #define	SM_MAXFRAGMENT	256
 
-/* Number of slots for loaded waveforms */
+/*
+ * Number of sound slots a bank starts out with, and the most it can
+ * grow to. Banks grow as sounds are loaded into higher slots.
+ */
 #define	SM_SOUNDS	16
+#define	SM_MAXSOUNDS	1024
 
-/* Number of playback voices */
-#define	SM_VOICES	16
+/* Default number of playback voices, and the most a mixer can have */
+#define	SM_VOICES	64
+#define	SM_MAXVOICES	1024
+
+/* Number of voice groups, for polyphony limits */
+#define	SM_GROUPS	256
 
 #define	SM_C0		16.3515978312874
 
+/* Output sample rate used when none is specified */
+#define	SM_DEFAULT_RATE	44100
+
 
 /*--------------------------------------------------------
 	Application Interface
 --------------------------------------------------------*/
 
-int sm_open(int buffer);
+/*
+ * The sm_*() calls below operate on the default mixer, which is
+ * opened with sm_open() or sm_open_offline(). Each has an
+ * sm_mixer_*() counterpart that operates on the mixer passed as
+ * the first argument. (See Mixer Instances.)
+ */
+
+/*
+ * Open the mixer at 'rate' Hz, or SM_DEFAULT_RATE if 'rate' is 0. If
+ * the audio device can't do that rate, the mixer runs at whatever rate
+ * the device reports instead.
+ */
+int sm_open(int rate, int buffer);
+int sm_open_offline(int rate);
 void sm_close(void);
+
+/* Actual output sample rate */
+int sm_get_rate(void);
+
+/*
+ * Load a sound into slot 'sound' of the current bank, growing the
+ * bank if needed. The file is loaded without locking the audio
+ * context, and the new sound is installed via the command queue,
+ * stopping any voices playing the old one. WAV files of more than
+ * about 12 s (at 44.1 kHz) are streamed from disk, with only the first
+ * part kept in memory. Only a few voices can play streamed sounds at
+ * once; notes beyond that are dropped, and counted as underruns in the
+ * statistics.
+ */
 int sm_load(int sound, const char *file);
 int sm_load_synth(int sound, const char *def);
 void sm_unload(int sound);
 
+/* Returns 1 if 'sound' holds a waveform, 2 for a synth, or 0 if empty */
+int sm_loaded(unsigned sound);
+
+/* Number of sound slots in the current bank */
+int sm_get_sounds(void);
+
 /*
  * IMPORTANT! IMPORTANT! IMPORTANT! IMPORTANT! IMPORTANT!
  *
@@ -52,6 +98,9 @@ void sm_unload(int sound);
  * once as soon as possible, and then the callback's return
  * value determines how many audio samples to process before
  * the callback is called again.
+ *    The ticks that land within a mixer block are all run
+ * before the block is mixed, and voice events from each
+ * tick take effect at the exact sample frame of that tick.
  *    If the callback returns 0, it is uninstalled and never
  * called again.
  *    Use sm_set_control_cb(NULL) to remove any installed
@@ -74,19 +123,292 @@ void sm_set_control_cb(sm_control_cb cb);
 typedef void (*sm_audio_cb)(Sint32 *buf, int frames);
 void sm_set_audio_cb(sm_audio_cb cb);
 
+/*
+ * The master bus, after the voice mixer and the audio processing
+ * callback, is either the 8:24 fixed point format of the mixer, or
+ * 32 bit float, where 0 dB is at +/-1.0. The float bus is converted
+ * to 16 bit output with TPDF dither, and to 24 bit and float output
+ * without loss. The audio device always runs in 16 bit; 24 bit and
+ * float output are only available for offline rendering.
+ *    Changing the bus takes effect at the start of the next block.
+ */
+typedef enum
+{
+	SM_BUS_FIXED = 0,	/* 8:24 fixed point; the default */
+	SM_BUS_FLOAT		/* 32 bit float */
+} SM_buses;
+void sm_set_bus(SM_buses bus);
+
+/*
+ * Install a float bus processing callback. This runs after the audio
+ * processing callback, on the master bus converted to float, and only
+ * while the float bus is selected. Like the audio processing
+ * callback, it gets interleaved stereo, 'frames' frames at a time.
+ *    Use sm_set_float_cb(NULL) to remove any installed callback
+ * instantly.
+ */
+typedef void (*sm_float_cb)(float *buf, int frames);
+void sm_set_float_cb(sm_float_cb cb);
+
+/*
+ * The master chain is a list of float bus processing stages, run in
+ * order after the float processing callback, while the float bus is
+ * selected. So that the audio stays in the cache from one stage to
+ * the next, the chain is run over SM_MASTER_CHUNK frames at a time,
+ * and a stage is called several times per block.
+ *    The chain is edited by the application thread, and the audio
+ * context picks up the new chain at the start of the next block,
+ * without locking.
+ */
+#define	SM_MASTER_CHUNK	64
+typedef void (*sm_master_cb)(float *buf, int frames, void *userdata);
+
+/*
+ * Insert a stage before position 'pos', or last if 'pos' is negative
+ * or past the end. Returns the position of the stage, or a negative
+ * value on failure.
+ */
+int sm_master_insert(int pos, sm_master_cb stage, void *userdata);
+
+/* Remove the stage at 'pos' */
+int sm_master_remove(int pos);
+
+/* Move the stage at position 'from' to position 'to' */
+int sm_master_move(int from, int to);
+
+/* Number of stages in the chain */
+int sm_master_stages(void);
+
+/* Stage: Soft saturation, and clipping to +/-1.0 */
+void sm_master_saturate(float *buf, int frames, void *userdata);
+
+
+/*--------------------------------------------------------
+	Command Interface
+--------------------------------------------------------*/
+
+/*
+ * Commands are used to pass data and requests to the audio
+ * context without locking. A command sent with sm_send()
+ * has its handler called in the audio context, at the start
+ * of the next mixer fragment. Commands are executed in the
+ * order they were sent.
+ *    The other way around, a command handler can pass data
+ * back (typically memory to be freed) with sm_reply(). The
+ * handlers of such replies are called from sm_poll(). A
+ * command handler may send at most one reply.
+ *    sm_send(), sm_poll() and sm_sync() are to be called from
+ * one application thread only. sm_reply() is to be called
+ * from the audio context only.
+ */
+typedef struct SM_command SM_command;
+typedef void (*sm_command_cb)(SM_command *cmd);
+struct SM_command
+{
+	sm_command_cb	cb;	/* Handler */
+	void		*target;	/* Object for the handler to act on */
+	int		i[3];	/* Integer arguments */
+	float		f;	/* Float argument */
+	void		*p;	/* Pointer argument */
+};
+
+/*
+ * Send a command to the audio context. If the queue is full,
+ * or the reply queue might not have room for the replies to
+ * all queued commands, this runs any pending replies, and
+ * waits until the audio context has made room.
+ */
+void sm_send(SM_command *cmd);
+
+/*
+ * Send a reply to the application thread. sm_send() keeps room
+ * for one reply per queued command, so this only fails, and
+ * returns -1, if a handler sends more than one reply.
+ */
+int sm_reply(SM_command *cmd);
+
+/* Run the handlers of any pending replies */
+void sm_poll(void);
+
+/*
+ * Execute all pending commands right away, with the audio
+ * context locked, and then run any pending replies.
+ */
+void sm_sync(void);
+
+
+/*--------------------------------------------------------
+	Performance Statistics
+--------------------------------------------------------*/
+
+/* Stages of audio processing that are timed */
+typedef enum
+{
+	SM_STAGE_CONTROL = 0,	/* Commands and control callback */
+	SM_STAGE_MIXER,		/* Voice mixer */
+	SM_STAGE_AUDIO,		/* Audio processing callback */
+	SM_STAGE_CONVERT,	/* Output format conversion */
+	SM_STAGE_CALLBACK,	/* Complete SDL audio callback */
+	SM_STAGES
+} SM_stages;
+
+/*
+ * Histogram bins. Bin 0 counts times below 1 us, and bin N
+ * counts times in [2^(N-1), 2^N) us. The last bin counts
+ * everything above that.
+ */
+#define	SM_STATS_BINS	16
+
+typedef struct
+{
+	Uint32	count;			/* Number of measurements */
+	Uint32	min, max;		/* ns */
+	Uint64	total;			/* ns */
+	Uint32	hist[SM_STATS_BINS];
+} SM_stagestats;
+
+typedef struct
+{
+	SM_stagestats	stages[SM_STAGES];
+	Uint64		audiotime;	/* ns of audio from SDL callbacks */
+	float		load;		/* Last callback; 1.0 is 100% */
+	float		peakload;	/* Highest 'load' seen */
+	Uint32		xruns;		/* Late or overlong callbacks */
+	Uint32		underruns;	/* Streaming data not in time */
+} SM_stats;
+
+/*
+ * Get a consistent snapshot of the statistics. This never
+ * blocks the audio context.
+ */
+void sm_get_stats(SM_stats *st);
+
+/* Print the statistics in human readable form */
+void sm_print_stats(FILE *f);
+
+/* Monotonic high resolution time in ns */
+Uint64 sm_timestamp(void);
+
+/* Name of 'stage', for messages */
+const char *sm_stage_name(SM_stages stage);
+
+
+/*--------------------------------------------------------
+	Sound Banks
+--------------------------------------------------------*/
+
+/*
+ * A sound bank holds a sound for each of its slots; at
+ * least SM_SOUNDS, and more as sounds are loaded into higher
+ * slots, up to SM_MAXSOUNDS. Notes on slots beyond the end
+ * of the bank are dropped. Banks do not touch the mixer until
+ * installed, so they can be built in any thread, without
+ * locking.
+ *    Sample files go through a process wide cache, keyed by
+ * canonical path and modification time. Loading a file that
+ * is already in use by any bank or mixer just references the
+ * converted data, without reading the file again.
+ */
+typedef struct SM_bank SM_bank;
+
+SM_bank *sm_bank_new(void);
+void sm_bank_free(SM_bank *b);
+int sm_bank_load(SM_bank *b, int sound, const char *file);
+int sm_bank_load_synth(SM_bank *b, int sound, const char *def);
+
+/*
+ * Sample cache files. The cache file of "foo.wav" is "foo.wav.dt42s",
+ * which holds the waveform converted and padded just like the mixer
+ * keeps it in memory. When loading a sample that has an up to date
+ * cache file, the mixer maps that read-only and plays straight from
+ * the mapping, instead of loading the WAV file. The pages are read
+ * in as needed, and are shared between processes.
+ */
+#define	SM_CACHE_SUFFIX	".dt42s"
+
+/* Build or rebuild the cache file of sample file 'file' */
+int sm_cache_build(const char *file);
+
+/*
+ * Check the cache file of 'file'. Returns 1 if it's up to date, 0 if
+ * it's missing or stale, or -1 if it's corrupt. With 'full' set, the
+ * checksum is checked too, which reads the whole file.
+ */
+int sm_cache_check(const char *file, int full);
+
+/*
+ * Check if 'file' should have a cache file; that is, if it's a 16 bit
+ * mono WAV file that is short enough to be loaded rather than
+ * streamed. Returns 1 if so, 0 if not, or -1 if it can't be opened.
+ */
+int sm_cache_wanted(const char *file);
+
+
+/*--------------------------------------------------------
+	Offline Rendering Interface
+	(Only valid after sm_open_offline()!)
+--------------------------------------------------------*/
+
+/* Output sample formats for sm_render() */
+typedef enum
+{
+	SM_FORMAT_S16 = 0,	/* 16 bit signed, native endian */
+	SM_FORMAT_FLOAT,	/* 32 bit float, native endian */
+	SM_FORMAT_S24		/* 24 bit signed, 3 bytes, little endian */
+} SM_formats;
+
+/*
+ * Run the mixer, control and audio callbacks for 'frames'
+ * sample frames, and write the result as interleaved stereo
+ * in the specified format to 'output'.
+ */
+void sm_render(void *output, int frames, SM_formats format);
+
 
 /*--------------------------------------------------------
 	Real Time Control Interface
 	(Use only from inside a control callback,
 	or with the SDL audio thread locked!)
+
+	sm_play(), sm_decay() and sm_pitch() are queued, and take effect
+	at the time of the control tick being processed, or
+	at the start of the next block if called from outside
+	a control callback.
 --------------------------------------------------------*/
 
 /* Start playing 'sound' on 'voice' at L/R volumes 'lvol'/'rvol' */
 void sm_play(unsigned voice, unsigned sound, float lvol, float rvol);
 
+/*
+ * Start playing 'sound' on a voice from the pool, as part of voice
+ * group 'group', and return the voice, or -1 if the arguments are out
+ * of range. If the group is at its polyphony limit, its oldest voice
+ * is reused. Otherwise a free voice is taken, or if there is none,
+ * the quietest of the oldest few voices is stolen.
+ */
+int sm_start(unsigned group, unsigned sound, float lvol, float rvol);
+
+/* Set the decay speed of all voices in 'group' */
+void sm_group_decay(unsigned group, float decay);
+
+/*
+ * Limit 'group' to 'voices' voices at a time, or no limit if 0. All
+ * groups start out unlimited.
+ */
+void sm_set_polyphony(unsigned group, int voices);
+
+/* Number of voices in the pool */
+int sm_get_voices(void);
+
 /* Set voice decay speed */
 void sm_decay(unsigned voice, float decay);
 
+/*
+ * Transpose the note playing on 'voice' by 'pitch' semitones. Sampled
+ * sounds are resampled as needed. sm_play() resets the pitch to 0.
+ */
+void sm_pitch(unsigned voice, float pitch);
+
 /* If the pending interval > interval, cut it short. */
 void sm_force_interval(unsigned interval);
 
@@ -96,4 +418,93 @@ int sm_get_interval(void);
 /* Get number of frames left to next control callback */
 int sm_get_next_tick(void);
 
+/*
+ * Install bank 'b', stopping all voices. Returns the previous
+ * bank, which must be freed outside of the audio context; for
+ * example by passing it back with sm_reply().
+ */
+SM_bank *sm_swap_bank(SM_bank *b);
+
+/*
+ * Replace the voice pool with one of 'voices' voices, stopping all
+ * voices. Returns -1 if 'voices' is out of range, or -3 if out of
+ * memory. Mixing cost depends on the voices actually playing, not on
+ * the size of the pool.
+ */
+int sm_set_voices(int voices);
+
+
+/*--------------------------------------------------------
+	Mixer Instances
+--------------------------------------------------------*/
+
+/*
+ * Any number of mixers can exist at the same time, each with its own
+ * voices, sound bank, callbacks, command queues and statistics. Only
+ * one of them can drive the audio device. Other mixers are rendered
+ * with sm_mixer_render(), and can be used from any thread, as long as
+ * each mixer is only used by one thread at a time.
+ */
+typedef struct SM_mixer SM_mixer;
+
+/* Create an offline mixer, like sm_open_offline() */
+SM_mixer *sm_mixer_new(int rate);
+
+/*
+ * Create a mixer that drives the audio device, like sm_open(). Fails
+ * if the device is already in use by another mixer.
+ */
+SM_mixer *sm_mixer_open(int rate, int buffer);
+
+void sm_mixer_close(SM_mixer *m);
+
+/* The default mixer, or NULL if it's not open */
+SM_mixer *sm_default(void);
+
+/* Callbacks, with the 'userdata' passed when installing them */
+typedef unsigned (*sm_mixer_control_cb)(void *userdata);
+typedef void (*sm_mixer_audio_cb)(Sint32 *buf, int frames, void *userdata);
+typedef void (*sm_mixer_float_cb)(float *buf, int frames, void *userdata);
+
+int sm_mixer_get_rate(SM_mixer *m);
+int sm_mixer_load(SM_mixer *m, int sound, const char *file);
+int sm_mixer_load_synth(SM_mixer *m, int sound, const char *def);
+void sm_mixer_unload(SM_mixer *m, int sound);
+int sm_mixer_loaded(SM_mixer *m, unsigned sound);
+int sm_mixer_get_sounds(SM_mixer *m);
+void sm_mixer_set_control_cb(SM_mixer *m, sm_mixer_control_cb cb,
+		void *userdata);
+void sm_mixer_set_audio_cb(SM_mixer *m, sm_mixer_audio_cb cb,
+		void *userdata);
+void sm_mixer_set_float_cb(SM_mixer *m, sm_mixer_float_cb cb,
+		void *userdata);
+void sm_mixer_set_bus(SM_mixer *m, SM_buses bus);
+int sm_mixer_master_insert(SM_mixer *m, int pos, sm_master_cb stage,
+		void *userdata);
+int sm_mixer_master_remove(SM_mixer *m, int pos);
+int sm_mixer_master_move(SM_mixer *m, int from, int to);
+int sm_mixer_master_stages(SM_mixer *m);
+void sm_mixer_send(SM_mixer *m, SM_command *cmd);
+int sm_mixer_reply(SM_mixer *m, SM_command *cmd);
+void sm_mixer_poll(SM_mixer *m);
+void sm_mixer_sync(SM_mixer *m);
+void sm_mixer_get_stats(SM_mixer *m, SM_stats *st);
+void sm_mixer_print_stats(SM_mixer *m, FILE *f);
+void sm_mixer_render(SM_mixer *m, void *output, int frames,
+		SM_formats format);
+void sm_mixer_play(SM_mixer *m, unsigned voice, unsigned sound,
+		float lvol, float rvol);
+void sm_mixer_decay(SM_mixer *m, unsigned voice, float decay);
+void sm_mixer_pitch(SM_mixer *m, unsigned voice, float pitch);
+int sm_mixer_start(SM_mixer *m, unsigned group, unsigned sound,
+		float lvol, float rvol);
+void sm_mixer_group_decay(SM_mixer *m, unsigned group, float decay);
+void sm_mixer_set_polyphony(SM_mixer *m, unsigned group, int voices);
+int sm_mixer_get_voices(SM_mixer *m);
+int sm_mixer_set_voices(SM_mixer *m, int voices);
+void sm_mixer_force_interval(SM_mixer *m, unsigned interval);
+int sm_mixer_get_interval(SM_mixer *m);
+int sm_mixer_get_next_tick(SM_mixer *m);
+SM_bank *sm_mixer_swap_bank(SM_mixer *m, SM_bank *b);
+
 #endif	/* SMIXER_H */
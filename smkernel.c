@@ -0,0 +1,936 @@
+/*
+ * smkernel.c - Block mixing kernels for the SDL mixer
+ *
+ * Copyright 2016 David Olofson
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "smkernel.h"
+
+#if defined(__GNUC__) && (__GNUC__ >= 5) && \
+		(defined(__x86_64__) || defined(__i386__))
+# define	SMK_X86
+# include <immintrin.h>
+#endif
+
+
+/*--------------------------------------------------------
+	Scalar reference kernels
+--------------------------------------------------------*/
+
+static void mix_mono_scalar(Sint32 *buf, const Sint16 *src, int frames,
+		int lvol, int rvol, int dlvol, int drvol)
+{
+	int i;
+	for(i = 0; i < frames; ++i)
+	{
+		buf[i * 2] += src[i] * (lvol >> 9) >> 7;
+		buf[i * 2 + 1] += src[i] * (rvol >> 9) >> 7;
+		lvol += dlvol;
+		rvol += drvol;
+	}
+}
+
+
+/*
+ * Interpolate between the outputs 'a' and 'b' of two adjacent filter
+ * phases, using 16 bits of the fractional position 'f', and scale the
+ * result back to 16 bits.
+ */
+static inline Sint16 resample_out(int a, int b, Uint32 f)
+{
+	int x = (f >> (16 - SMK_RS_PHASEBITS)) & 0xffff;
+	Sint64 v = a + (((Sint64)b - a) * x >> 16);
+	v = (v + (1 << 14)) >> 15;
+	if(v < -32768)
+		return -32768;
+	else if(v > 32767)
+		return 32767;
+	return v;
+}
+
+
+/* First source sample under the filter at position 'pos' */
+static inline const Sint16 *resample_src(const Sint16 *src, Uint64 pos)
+{
+	return src + (pos >> 32) - SMK_RS_TAPS / 2 + 1;
+}
+
+
+/* First filter row (phase) for position 'pos' */
+static inline const Sint16 *resample_row(const Sint16 *filter, Uint64 pos)
+{
+	return filter + ((Uint32)pos >> (32 - SMK_RS_PHASEBITS)) *
+			SMK_RS_TAPS;
+}
+
+static void resample_scalar(Sint16 *out, const Sint16 *src, int frames,
+		Uint64 pos, Uint64 step, const Sint16 *filter)
+{
+	int i, t;
+	for(i = 0; i < frames; ++i, pos += step)
+	{
+		const Sint16 *s = resample_src(src, pos);
+		const Sint16 *c0 = resample_row(filter, pos);
+		const Sint16 *c1 = c0 + SMK_RS_TAPS;
+		int a = 0;
+		int b = 0;
+		for(t = 0; t < SMK_RS_TAPS; ++t)
+		{
+			a += s[t] * c0[t];
+			b += s[t] * c1[t];
+		}
+		out[i] = resample_out(a, b, (Uint32)pos);
+	}
+}
+
+
+static void s32_float_scalar(float *out, const Sint32 *in, int n)
+{
+	int i;
+	for(i = 0; i < n; ++i)
+		out[i] = in[i] * (1.0f / 8388608.0f);
+}
+
+
+static void s32_s16_scalar(Sint16 *out, const Sint32 *in, int n)
+{
+	int i;
+	for(i = 0; i < n; ++i)
+	{
+		int v = in[i] >> 8;
+		if(v < -32768)
+			v = -32768;
+		else if(v > 32767)
+			v = 32767;
+		out[i] = v;
+	}
+}
+
+
+static inline Uint32 dither_next(Uint32 *state)
+{
+	Uint32 x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+
+/*
+ * The difference of two 16 bit uniform random numbers, from the upper
+ * and lower halves of a 32 bit one, gives a triangular distribution.
+ * We convert with an offset of 32768.5 and truncation, which rounds,
+ * and is what the SIMD kernels do. The clamping is written to behave
+ * exactly like minps/maxps.
+ */
+static void float_s16_scalar(Sint16 *out, const float *in, int n,
+		Uint32 *dither)
+{
+	int i;
+	for(i = 0; i < n; ++i)
+	{
+		Uint32 r = dither_next(&dither[i % SMK_DITHER_LANES]);
+		float d = (float)((int)(r >> 16) - (int)(r & 0xffff)) *
+				(1.0f / 65536.0f);
+		float v = in[i] * 32768.0f;
+		v += d;
+		v += 32768.5f;
+		v = v < 65535.0f ? v : 65535.0f;
+		v = v > 0.0f ? v : 0.0f;
+		out[i] = (int)v - 32768;
+	}
+}
+
+
+static void float_s24_scalar(Sint32 *out, const float *in, int n)
+{
+	int i;
+	for(i = 0; i < n; ++i)
+	{
+		float v = in[i] * 8388608.0f;
+		v = v < 8388607.0f ? v : 8388607.0f;
+		v = v > -8388608.0f ? v : -8388608.0f;
+		out[i] = lrintf(v);
+	}
+}
+
+
+static void saturate_scalar(float *buf, int n)
+{
+	int i;
+	for(i = 0; i < n; ++i)
+	{
+		float s = buf[i];
+		s = 1.5f * s - 0.5f * s * s * s;
+		s = s < 1.0f ? s : 1.0f;
+		buf[i] = s > -1.0f ? s : -1.0f;
+	}
+}
+
+
+#ifdef SMK_X86
+/*--------------------------------------------------------
+	SSE2 kernels
+--------------------------------------------------------*/
+
+/*
+ * SSE2 has no 32 bit multiply, so we use pmaddwd with the sample in
+ * both halves of each 32 bit lane, and the 15 bit volume in the low
+ * half only, which gives us the exact 32 bit product.
+ */
+__attribute__((target("sse2")))
+static void mix_mono_sse2(Sint32 *buf, const Sint16 *src, int frames,
+		int lvol, int rvol, int dlvol, int drvol)
+{
+	int i;
+	__m128i r01 = _mm_setr_epi32(lvol, rvol,
+			lvol + dlvol, rvol + drvol);
+	__m128i r23 = _mm_add_epi32(r01, _mm_setr_epi32(2 * dlvol,
+			2 * drvol, 2 * dlvol, 2 * drvol));
+	__m128i step = _mm_setr_epi32(4 * dlvol, 4 * drvol,
+			4 * dlvol, 4 * drvol);
+	for(i = 0; i + 4 <= frames; i += 4)
+	{
+		__m128i *d = (__m128i *)(buf + i * 2);
+		__m128i s = _mm_loadl_epi64((const __m128i *)(src + i));
+		__m128i ss = _mm_unpacklo_epi16(s, s);
+		__m128i s01 = _mm_unpacklo_epi32(ss, ss);
+		__m128i s23 = _mm_unpackhi_epi32(ss, ss);
+		__m128i p01 = _mm_madd_epi16(s01, _mm_srli_epi32(r01, 9));
+		__m128i p23 = _mm_madd_epi16(s23, _mm_srli_epi32(r23, 9));
+		_mm_storeu_si128(d, _mm_add_epi32(_mm_loadu_si128(d),
+				_mm_srai_epi32(p01, 7)));
+		_mm_storeu_si128(d + 1, _mm_add_epi32(_mm_loadu_si128(d + 1),
+				_mm_srai_epi32(p23, 7)));
+		r01 = _mm_add_epi32(r01, step);
+		r23 = _mm_add_epi32(r23, step);
+	}
+	if(i < frames)
+		mix_mono_scalar(buf + i * 2, src + i, frames - i,
+				lvol + i * dlvol, rvol + i * drvol,
+				dlvol, drvol);
+}
+
+
+/*
+ * The dot products of the two filter phases are done eight taps at a
+ * time with pmaddwd. The sums are formed in a different order than in
+ * the scalar code, but as 32 bit integer addition, so the results are
+ * still exact.
+ */
+__attribute__((target("sse2")))
+static void resample_sse2(Sint16 *out, const Sint16 *src, int frames,
+		Uint64 pos, Uint64 step, const Sint16 *filter)
+{
+	int i;
+	for(i = 0; i < frames; ++i, pos += step)
+	{
+		const __m128i *sp = (const __m128i *)resample_src(src, pos);
+		const __m128i *cp = (const __m128i *)resample_row(filter, pos);
+		__m128i s0 = _mm_loadu_si128(sp);
+		__m128i s1 = _mm_loadu_si128(sp + 1);
+		__m128i a = _mm_add_epi32(
+				_mm_madd_epi16(s0, _mm_loadu_si128(cp)),
+				_mm_madd_epi16(s1, _mm_loadu_si128(cp + 1)));
+		__m128i b = _mm_add_epi32(
+				_mm_madd_epi16(s0, _mm_loadu_si128(cp + 2)),
+				_mm_madd_epi16(s1, _mm_loadu_si128(cp + 3)));
+		/* [a0 + a2, b0 + b2, a1 + a3, b1 + b3] ==> [a, b, ...] */
+		__m128i ab = _mm_add_epi32(_mm_unpacklo_epi32(a, b),
+				_mm_unpackhi_epi32(a, b));
+		ab = _mm_add_epi32(ab, _mm_srli_si128(ab, 8));
+		out[i] = resample_out(_mm_cvtsi128_si32(ab),
+				_mm_cvtsi128_si32(_mm_srli_si128(ab, 4)),
+				(Uint32)pos);
+	}
+}
+
+
+__attribute__((target("sse2")))
+static void s32_float_sse2(float *out, const Sint32 *in, int n)
+{
+	int i;
+	const __m128 k = _mm_set1_ps(1.0f / 8388608.0f);
+	for(i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(
+				_mm_loadu_si128((const __m128i *)(in + i))),
+				k));
+	if(i < n)
+		s32_float_scalar(out + i, in + i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void s32_s16_sse2(Sint16 *out, const Sint32 *in, int n)
+{
+	int i;
+	for(i = 0; i + 8 <= n; i += 8)
+	{
+		const __m128i *s = (const __m128i *)(in + i);
+		__m128i a = _mm_srai_epi32(_mm_loadu_si128(s), 8);
+		__m128i b = _mm_srai_epi32(_mm_loadu_si128(s + 1), 8);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+	}
+	if(i < n)
+		s32_s16_scalar(out + i, in + i, n - i);
+}
+
+
+/* Four steps of float_s16_scalar(), with the generators in 'state' */
+__attribute__((target("sse2")))
+static inline __m128i float_s16_sse2_4(const float *in, __m128i *state)
+{
+	__m128i x = *state;
+	__m128i d;
+	__m128 v;
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	*state = x;
+	d = _mm_sub_epi32(_mm_srli_epi32(x, 16),
+			_mm_and_si128(x, _mm_set1_epi32(0xffff)));
+	v = _mm_mul_ps(_mm_loadu_ps(in), _mm_set1_ps(32768.0f));
+	v = _mm_add_ps(v, _mm_mul_ps(_mm_cvtepi32_ps(d),
+			_mm_set1_ps(1.0f / 65536.0f)));
+	v = _mm_add_ps(v, _mm_set1_ps(32768.5f));
+	v = _mm_min_ps(v, _mm_set1_ps(65535.0f));
+	v = _mm_max_ps(v, _mm_setzero_ps());
+	return _mm_sub_epi32(_mm_cvttps_epi32(v), _mm_set1_epi32(32768));
+}
+
+
+__attribute__((target("sse2")))
+static void float_s16_sse2(Sint16 *out, const float *in, int n,
+		Uint32 *dither)
+{
+	int i;
+	__m128i *ds = (__m128i *)dither;
+	__m128i s0 = _mm_loadu_si128(ds);
+	__m128i s1 = _mm_loadu_si128(ds + 1);
+	for(i = 0; i + 8 <= n; i += 8)
+	{
+		__m128i a = float_s16_sse2_4(in + i, &s0);
+		__m128i b = float_s16_sse2_4(in + i + 4, &s1);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+	}
+	_mm_storeu_si128(ds, s0);
+	_mm_storeu_si128(ds + 1, s1);
+	if(i < n)
+		float_s16_scalar(out + i, in + i, n - i, dither);
+}
+
+
+__attribute__((target("sse2")))
+static void float_s24_sse2(Sint32 *out, const float *in, int n)
+{
+	int i;
+	for(i = 0; i + 4 <= n; i += 4)
+	{
+		__m128 v = _mm_mul_ps(_mm_loadu_ps(in + i),
+				_mm_set1_ps(8388608.0f));
+		v = _mm_min_ps(v, _mm_set1_ps(8388607.0f));
+		v = _mm_max_ps(v, _mm_set1_ps(-8388608.0f));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_cvtps_epi32(v));
+	}
+	if(i < n)
+		float_s24_scalar(out + i, in + i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void saturate_sse2(float *buf, int n)
+{
+	int i;
+	for(i = 0; i + 4 <= n; i += 4)
+	{
+		__m128 s = _mm_loadu_ps(buf + i);
+		__m128 c = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(
+				_mm_set1_ps(0.5f), s), s), s);
+		s = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(1.5f), s), c);
+		s = _mm_min_ps(s, _mm_set1_ps(1.0f));
+		_mm_storeu_ps(buf + i, _mm_max_ps(s, _mm_set1_ps(-1.0f)));
+	}
+	if(i < n)
+		saturate_scalar(buf + i, n - i);
+}
+
+
+/*--------------------------------------------------------
+	AVX2 kernels
+--------------------------------------------------------*/
+
+__attribute__((target("avx2")))
+static void mix_mono_avx2(Sint32 *buf, const Sint16 *src, int frames,
+		int lvol, int rvol, int dlvol, int drvol)
+{
+	int i;
+	const __m256i lo = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+	const __m256i hi = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+	__m256i dv = _mm256_setr_epi32(0, 0, dlvol, drvol,
+			2 * dlvol, 2 * drvol, 3 * dlvol, 3 * drvol);
+	__m256i r0 = _mm256_add_epi32(_mm256_setr_epi32(lvol, rvol,
+			lvol, rvol, lvol, rvol, lvol, rvol), dv);
+	__m256i r1 = _mm256_add_epi32(r0, _mm256_setr_epi32(
+			4 * dlvol, 4 * drvol, 4 * dlvol, 4 * drvol,
+			4 * dlvol, 4 * drvol, 4 * dlvol, 4 * drvol));
+	__m256i step = _mm256_setr_epi32(
+			8 * dlvol, 8 * drvol, 8 * dlvol, 8 * drvol,
+			8 * dlvol, 8 * drvol, 8 * dlvol, 8 * drvol);
+	for(i = 0; i + 8 <= frames; i += 8)
+	{
+		__m256i *d = (__m256i *)(buf + i * 2);
+		__m256i s = _mm256_cvtepi16_epi32(
+				_mm_loadu_si128((const __m128i *)(src + i)));
+		__m256i p0 = _mm256_mullo_epi32(
+				_mm256_permutevar8x32_epi32(s, lo),
+				_mm256_srli_epi32(r0, 9));
+		__m256i p1 = _mm256_mullo_epi32(
+				_mm256_permutevar8x32_epi32(s, hi),
+				_mm256_srli_epi32(r1, 9));
+		_mm256_storeu_si256(d, _mm256_add_epi32(
+				_mm256_loadu_si256(d),
+				_mm256_srai_epi32(p0, 7)));
+		_mm256_storeu_si256(d + 1, _mm256_add_epi32(
+				_mm256_loadu_si256(d + 1),
+				_mm256_srai_epi32(p1, 7)));
+		r0 = _mm256_add_epi32(r0, step);
+		r1 = _mm256_add_epi32(r1, step);
+	}
+	if(i < frames)
+		mix_mono_scalar(buf + i * 2, src + i, frames - i,
+				lvol + i * dlvol, rvol + i * drvol,
+				dlvol, drvol);
+}
+
+
+/* As resample_sse2(), but with all 16 taps in one register */
+__attribute__((target("avx2")))
+static void resample_avx2(Sint16 *out, const Sint16 *src, int frames,
+		Uint64 pos, Uint64 step, const Sint16 *filter)
+{
+	int i;
+	for(i = 0; i < frames; ++i, pos += step)
+	{
+		const __m256i *sp = (const __m256i *)resample_src(src, pos);
+		const __m256i *cp = (const __m256i *)resample_row(filter, pos);
+		__m256i sv = _mm256_loadu_si256(sp);
+		__m256i a = _mm256_madd_epi16(sv, _mm256_loadu_si256(cp));
+		__m256i b = _mm256_madd_epi16(sv, _mm256_loadu_si256(cp + 1));
+		__m256i ab2 = _mm256_add_epi32(_mm256_unpacklo_epi32(a, b),
+				_mm256_unpackhi_epi32(a, b));
+		__m128i ab = _mm_add_epi32(_mm256_castsi256_si128(ab2),
+				_mm256_extracti128_si256(ab2, 1));
+		ab = _mm_add_epi32(ab, _mm_srli_si128(ab, 8));
+		out[i] = resample_out(_mm_cvtsi128_si32(ab),
+				_mm_cvtsi128_si32(_mm_srli_si128(ab, 4)),
+				(Uint32)pos);
+	}
+}
+
+
+__attribute__((target("avx2")))
+static void s32_float_avx2(float *out, const Sint32 *in, int n)
+{
+	int i;
+	const __m256 k = _mm256_set1_ps(1.0f / 8388608.0f);
+	for(i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(
+				_mm256_loadu_si256((const __m256i *)(in + i))),
+				k));
+	if(i < n)
+		s32_float_scalar(out + i, in + i, n - i);
+}
+
+
+/* packssdw works within 128 bit lanes, so the result is reordered */
+__attribute__((target("avx2")))
+static void s32_s16_avx2(Sint16 *out, const Sint32 *in, int n)
+{
+	int i;
+	for(i = 0; i + 16 <= n; i += 16)
+	{
+		const __m256i *s = (const __m256i *)(in + i);
+		__m256i a = _mm256_srai_epi32(_mm256_loadu_si256(s), 8);
+		__m256i b = _mm256_srai_epi32(_mm256_loadu_si256(s + 1), 8);
+		_mm256_storeu_si256((__m256i *)(out + i),
+				_mm256_permute4x64_epi64(
+				_mm256_packs_epi32(a, b), 0xd8));
+	}
+	if(i < n)
+		s32_s16_scalar(out + i, in + i, n - i);
+}
+
+
+/* As float_s16_sse2(), but with all the generators in one register */
+__attribute__((target("avx2")))
+static void float_s16_avx2(Sint16 *out, const float *in, int n,
+		Uint32 *dither)
+{
+	int i;
+	__m256i x = _mm256_loadu_si256((const __m256i *)dither);
+	for(i = 0; i + 8 <= n; i += 8)
+	{
+		__m256i d, q;
+		__m256 v;
+		x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+		x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+		d = _mm256_sub_epi32(_mm256_srli_epi32(x, 16),
+				_mm256_and_si256(x, _mm256_set1_epi32(0xffff)));
+		v = _mm256_mul_ps(_mm256_loadu_ps(in + i),
+				_mm256_set1_ps(32768.0f));
+		v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_cvtepi32_ps(d),
+				_mm256_set1_ps(1.0f / 65536.0f)));
+		v = _mm256_add_ps(v, _mm256_set1_ps(32768.5f));
+		v = _mm256_min_ps(v, _mm256_set1_ps(65535.0f));
+		v = _mm256_max_ps(v, _mm256_setzero_ps());
+		q = _mm256_sub_epi32(_mm256_cvttps_epi32(v),
+				_mm256_set1_epi32(32768));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(
+				_mm256_castsi256_si128(q),
+				_mm256_extracti128_si256(q, 1)));
+	}
+	_mm256_storeu_si256((__m256i *)dither, x);
+	if(i < n)
+		float_s16_scalar(out + i, in + i, n - i, dither);
+}
+
+
+__attribute__((target("avx2")))
+static void float_s24_avx2(Sint32 *out, const float *in, int n)
+{
+	int i;
+	for(i = 0; i + 8 <= n; i += 8)
+	{
+		__m256 v = _mm256_mul_ps(_mm256_loadu_ps(in + i),
+				_mm256_set1_ps(8388608.0f));
+		v = _mm256_min_ps(v, _mm256_set1_ps(8388607.0f));
+		v = _mm256_max_ps(v, _mm256_set1_ps(-8388608.0f));
+		_mm256_storeu_si256((__m256i *)(out + i),
+				_mm256_cvtps_epi32(v));
+	}
+	if(i < n)
+		float_s24_scalar(out + i, in + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void saturate_avx2(float *buf, int n)
+{
+	int i;
+	for(i = 0; i + 8 <= n; i += 8)
+	{
+		__m256 s = _mm256_loadu_ps(buf + i);
+		__m256 c = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(
+				_mm256_set1_ps(0.5f), s), s), s);
+		s = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(1.5f), s), c);
+		s = _mm256_min_ps(s, _mm256_set1_ps(1.0f));
+		_mm256_storeu_ps(buf + i,
+				_mm256_max_ps(s, _mm256_set1_ps(-1.0f)));
+	}
+	if(i < n)
+		saturate_scalar(buf + i, n - i);
+}
+#endif	/* SMK_X86 */
+
+
+/*--------------------------------------------------------
+	Kernel selection
+--------------------------------------------------------*/
+
+smk_mix_func smk_mix_mono = mix_mono_scalar;
+smk_resample_func smk_resample = resample_scalar;
+smk_s32_float_func smk_s32_float = s32_float_scalar;
+smk_s32_s16_func smk_s32_s16 = s32_s16_scalar;
+smk_float_s16_func smk_float_s16 = float_s16_scalar;
+smk_float_s24_func smk_float_s24 = float_s24_scalar;
+smk_saturate_func smk_saturate = saturate_scalar;
+
+
+int smk_supported(SMK_isa isa)
+{
+	switch(isa)
+	{
+	  case SMK_SCALAR:
+		return 1;
+#ifdef SMK_X86
+	  case SMK_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2");
+	  case SMK_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+	  default:
+		return 0;
+	}
+}
+
+
+static smk_mix_func get_mix_mono(SMK_isa isa)
+{
+	switch(isa)
+	{
+#ifdef SMK_X86
+	  case SMK_SSE2:
+		return mix_mono_sse2;
+	  case SMK_AVX2:
+		return mix_mono_avx2;
+#endif
+	  default:
+		return mix_mono_scalar;
+	}
+}
+
+
+static smk_resample_func get_resample(SMK_isa isa)
+{
+	switch(isa)
+	{
+#ifdef SMK_X86
+	  case SMK_SSE2:
+		return resample_sse2;
+	  case SMK_AVX2:
+		return resample_avx2;
+#endif
+	  default:
+		return resample_scalar;
+	}
+}
+
+
+static smk_s32_float_func get_s32_float(SMK_isa isa)
+{
+	switch(isa)
+	{
+#ifdef SMK_X86
+	  case SMK_SSE2:
+		return s32_float_sse2;
+	  case SMK_AVX2:
+		return s32_float_avx2;
+#endif
+	  default:
+		return s32_float_scalar;
+	}
+}
+
+
+static smk_s32_s16_func get_s32_s16(SMK_isa isa)
+{
+	switch(isa)
+	{
+#ifdef SMK_X86
+	  case SMK_SSE2:
+		return s32_s16_sse2;
+	  case SMK_AVX2:
+		return s32_s16_avx2;
+#endif
+	  default:
+		return s32_s16_scalar;
+	}
+}
+
+
+static smk_float_s16_func get_float_s16(SMK_isa isa)
+{
+	switch(isa)
+	{
+#ifdef SMK_X86
+	  case SMK_SSE2:
+		return float_s16_sse2;
+	  case SMK_AVX2:
+		return float_s16_avx2;
+#endif
+	  default:
+		return float_s16_scalar;
+	}
+}
+
+
+static smk_float_s24_func get_float_s24(SMK_isa isa)
+{
+	switch(isa)
+	{
+#ifdef SMK_X86
+	  case SMK_SSE2:
+		return float_s24_sse2;
+	  case SMK_AVX2:
+		return float_s24_avx2;
+#endif
+	  default:
+		return float_s24_scalar;
+	}
+}
+
+
+static smk_saturate_func get_saturate(SMK_isa isa)
+{
+	switch(isa)
+	{
+#ifdef SMK_X86
+	  case SMK_SSE2:
+		return saturate_sse2;
+	  case SMK_AVX2:
+		return saturate_avx2;
+#endif
+	  default:
+		return saturate_scalar;
+	}
+}
+
+
+SMK_isa smk_init(SMK_isa max)
+{
+	SMK_isa isa = max;
+	while((isa > SMK_SCALAR) && !smk_supported(isa))
+		--isa;
+	smk_mix_mono = get_mix_mono(isa);
+	smk_resample = get_resample(isa);
+	smk_s32_float = get_s32_float(isa);
+	smk_s32_s16 = get_s32_s16(isa);
+	smk_float_s16 = get_float_s16(isa);
+	smk_float_s24 = get_float_s24(isa);
+	smk_saturate = get_saturate(isa);
+	return isa;
+}
+
+
+const char *smk_name(SMK_isa isa)
+{
+	switch(isa)
+	{
+	  case SMK_SCALAR:
+		return "scalar";
+	  case SMK_SSE2:
+		return "SSE2";
+	  case SMK_AVX2:
+		return "AVX2";
+	}
+	return "<unknown>";
+}
+
+
+/*--------------------------------------------------------
+	Verification
+--------------------------------------------------------*/
+
+#define	SMK_VERIFY_FRAMES	1000
+#define	SMK_VERIFY_RUNS		1000
+
+static Uint32 verify_rnd(Uint32 *state)
+{
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+
+/* Largest difference between 'n' elements of 'a' and 'b' */
+static int verify_diff(const Sint32 *a, const Sint32 *b, int n)
+{
+	int i;
+	int maxdiff = 0;
+	for(i = 0; i < n; ++i)
+	{
+		int d = abs(a[i] - b[i]);
+		if(d > maxdiff)
+			maxdiff = d;
+	}
+	return maxdiff;
+}
+
+
+static int verify_mix(smk_mix_func f, Sint16 *src, Sint32 *ref, Sint32 *out)
+{
+	int i, run;
+	int maxdiff = 0;
+	Uint32 rs = 42;
+	for(run = 0; run < SMK_VERIFY_RUNS; ++run)
+	{
+		/* Random length, alignment, start volumes and ramps */
+		int frames = verify_rnd(&rs) % (SMK_VERIFY_FRAMES - 8);
+		int offset = verify_rnd(&rs) % 8;
+		int lvol = verify_rnd(&rs) & 0xffffff;
+		int rvol = verify_rnd(&rs) & 0xffffff;
+		int lend = verify_rnd(&rs) & 0xffffff;
+		int rend = verify_rnd(&rs) & 0xffffff;
+		int dlvol = frames ? (lend - lvol) / frames : 0;
+		int drvol = frames ? (rend - rvol) / frames : 0;
+		int d;
+		for(i = 0; i < SMK_VERIFY_FRAMES; ++i)
+			src[i] = verify_rnd(&rs);
+		for(i = 0; i < SMK_VERIFY_FRAMES * 2; ++i)
+			ref[i] = out[i] = (Sint32)verify_rnd(&rs) - 0x800000;
+		mix_mono_scalar(ref + offset * 2, src + offset, frames,
+				lvol, rvol, dlvol, drvol);
+		f(out + offset * 2, src + offset, frames,
+				lvol, rvol, dlvol, drvol);
+		d = verify_diff(ref, out, SMK_VERIFY_FRAMES * 2);
+		if(d > maxdiff)
+			maxdiff = d;
+	}
+	return maxdiff;
+}
+
+
+static int verify_resample(smk_resample_func f, Sint16 *src, Sint32 *ref,
+		Sint32 *out)
+{
+	int i, run;
+	int maxdiff = 0;
+	Uint32 rs = 42;
+	Sint16 *filter = malloc((SMK_RS_PHASES + 1) * SMK_RS_TAPS *
+			sizeof(Sint16));
+	Sint16 *r16 = (Sint16 *)ref;
+	Sint16 *o16 = (Sint16 *)out;
+	if(!filter)
+		return -1;
+	for(run = 0; run < SMK_VERIFY_RUNS; ++run)
+	{
+		/*
+		 * Random coefficients within the documented limit,
+		 * full scale input, and random positions and steps,
+		 * from deep downsampling to extreme upsampling.
+		 */
+		int frames = verify_rnd(&rs) % (SMK_VERIFY_FRAMES / 16);
+		Uint64 step = ((Uint64)(verify_rnd(&rs) % 8) << 32) |
+				verify_rnd(&rs) << 8;
+		Uint64 pos = (Uint64)SMK_RS_TAPS << 32 |
+				verify_rnd(&rs) << 8;
+		int d;
+		for(i = 0; i < (SMK_RS_PHASES + 1) * SMK_RS_TAPS; ++i)
+			filter[i] = (int)(verify_rnd(&rs) % 4096) - 2048;
+		for(i = 0; i < SMK_VERIFY_FRAMES; ++i)
+			src[i] = verify_rnd(&rs);
+		memset(ref, 0, SMK_VERIFY_FRAMES * sizeof(Sint16));
+		memset(out, 0, SMK_VERIFY_FRAMES * sizeof(Sint16));
+		resample_scalar(r16, src, frames, pos, step, filter);
+		f(o16, src, frames, pos, step, filter);
+		for(i = 0; i < frames; ++i)
+		{
+			d = abs(r16[i] - o16[i]);
+			if(d > maxdiff)
+				maxdiff = d;
+		}
+	}
+	free(filter);
+	return maxdiff;
+}
+
+
+/*
+ * Random input in the range +/-1.5 of the float bus, or of the fixed
+ * point bus, with random lengths and alignments, and random dither
+ * generator states. The generator states must match afterwards too.
+ */
+static int verify_convert(SMK_isa isa, Sint32 *ref, Sint32 *out)
+{
+	int i, run;
+	int maxdiff = 0;
+	Uint32 rs = 42;
+	smk_s32_float_func s32_float = get_s32_float(isa);
+	smk_s32_s16_func s32_s16 = get_s32_s16(isa);
+	smk_float_s16_func float_s16 = get_float_s16(isa);
+	smk_float_s24_func float_s24 = get_float_s24(isa);
+	smk_saturate_func saturate = get_saturate(isa);
+	Sint32 *in = malloc(SMK_VERIFY_FRAMES * sizeof(Sint32));
+	float *fin = malloc(SMK_VERIFY_FRAMES * sizeof(float));
+	if(!in || !fin)
+	{
+		free(in);
+		free(fin);
+		return -1;
+	}
+	for(run = 0; run < SMK_VERIFY_RUNS; ++run)
+	{
+		int n = verify_rnd(&rs) % (SMK_VERIFY_FRAMES - 8);
+		int offset = verify_rnd(&rs) % 8;
+		Uint32 rd[SMK_DITHER_LANES], od[SMK_DITHER_LANES];
+		int d;
+		for(i = 0; i < SMK_VERIFY_FRAMES; ++i)
+		{
+			in[i] = (Sint32)(verify_rnd(&rs) % 0x1800000) -
+					0xc00000;
+			fin[i] = in[i] * (1.0f / 8388608.0f);
+		}
+		for(i = 0; i < SMK_DITHER_LANES; ++i)
+			rd[i] = od[i] = verify_rnd(&rs) | 1;
+
+		memset(ref, 0, SMK_VERIFY_FRAMES * sizeof(Sint32));
+		memset(out, 0, SMK_VERIFY_FRAMES * sizeof(Sint32));
+		s32_float_scalar((float *)ref, in + offset, n);
+		s32_float((float *)out, in + offset, n);
+		d = memcmp(ref, out, SMK_VERIFY_FRAMES * sizeof(Sint32)) ?
+				1 : 0;
+
+		memset(ref, 0, SMK_VERIFY_FRAMES * sizeof(Sint32));
+		memset(out, 0, SMK_VERIFY_FRAMES * sizeof(Sint32));
+		s32_s16_scalar((Sint16 *)ref, in + offset, n);
+		s32_s16((Sint16 *)out, in + offset, n);
+		if(memcmp(ref, out, SMK_VERIFY_FRAMES * sizeof(Sint32)))
+			d = 1;
+
+		memset(ref, 0, SMK_VERIFY_FRAMES * sizeof(Sint32));
+		memset(out, 0, SMK_VERIFY_FRAMES * sizeof(Sint32));
+		float_s16_scalar((Sint16 *)ref, fin + offset, n, rd);
+		float_s16((Sint16 *)out, fin + offset, n, od);
+		if(memcmp(ref, out, SMK_VERIFY_FRAMES * sizeof(Sint32)) ||
+				memcmp(rd, od, sizeof(rd)))
+			d = 1;
+
+		float_s24_scalar(ref, fin + offset, n);
+		float_s24(out, fin + offset, n);
+		i = verify_diff(ref, out, n);
+		if(i > d)
+			d = i;
+
+		/* Beyond +/-1.5, so the saturator folds over too */
+		for(i = 0; i < n; ++i)
+			((float *)ref)[i] = ((float *)out)[i] =
+					fin[offset + i] * 1.5f;
+		saturate_scalar((float *)ref, n);
+		saturate((float *)out, n);
+		if(memcmp(ref, out, n * sizeof(float)))
+			d = 1;
+
+		if(d > maxdiff)
+			maxdiff = d;
+	}
+	free(in);
+	free(fin);
+	return maxdiff;
+}
+
+
+int smk_verify(SMK_isa isa)
+{
+	int maxdiff, d;
+	Sint16 *src;
+	Sint32 *ref, *out;
+	if(!smk_supported(isa))
+		return -1;
+	src = malloc(SMK_VERIFY_FRAMES * sizeof(Sint16));
+	ref = malloc(SMK_VERIFY_FRAMES * 2 * sizeof(Sint32));
+	out = malloc(SMK_VERIFY_FRAMES * 2 * sizeof(Sint32));
+	if(!src || !ref || !out)
+	{
+		free(src);
+		free(ref);
+		free(out);
+		return -1;
+	}
+	maxdiff = verify_mix(get_mix_mono(isa), src, ref, out);
+	d = verify_resample(get_resample(isa), src, ref, out);
+	if(d > maxdiff)
+		maxdiff = d;
+	d = verify_convert(isa, ref, out);
+	if(d > maxdiff)
+		maxdiff = d;
+	free(src);
+	free(ref);
+	free(out);
+	return maxdiff;
+}
@@ -0,0 +1,116 @@
+/*
+ * smkernel.h - Block mixing kernels for the SDL mixer
+ *
+ * Copyright 2016 David Olofson
+ */
+
+#ifndef	SMKERNEL_H
+#define	SMKERNEL_H
+
+#include "SDL.h"
+
+/* Instruction sets we have kernels for */
+typedef enum
+{
+	SMK_SCALAR = 0,		/* Plain C reference implementation */
+	SMK_SSE2,
+	SMK_AVX2
+} SMK_isa;
+
+/*
+ * Mix 'frames' mono 16 bit samples from 'src' into the 8:24 stereo
+ * buffer 'buf', with linear volume ramps. For each frame 'i':
+ *
+ *	buf[i * 2] += src[i] * ((lvol + i * dlvol) >> 9) >> 7;
+ *	buf[i * 2 + 1] += src[i] * ((rvol + i * drvol) >> 9) >> 7;
+ *
+ * The volumes must stay within [0, 0xffffff] over the whole ramp.
+ * All kernels produce bit identical results.
+ */
+typedef void (*smk_mix_func)(Sint32 *buf, const Sint16 *src, int frames,
+		int lvol, int rvol, int dlvol, int drvol);
+
+/*
+ * Polyphase resampling filters. A filter is SMK_RS_PHASES + 1 rows of
+ * SMK_RS_TAPS Q15 coefficients, where row 'p' is the impulse response
+ * for a fractional source position of p / SMK_RS_PHASES, applied to
+ * the source samples at offsets -SMK_RS_TAPS / 2 + 1 through
+ * SMK_RS_TAPS / 2. The sum of the absolute values of a row must not
+ * exceed 2.0, or the accumulators may overflow.
+ */
+#define	SMK_RS_TAPS		16
+#define	SMK_RS_PHASEBITS	8
+#define	SMK_RS_PHASES		(1 << SMK_RS_PHASEBITS)
+
+/*
+ * Resample 'frames' 16 bit output samples into 'out' from 'src',
+ * starting at 32:32 fixed point position 'pos', advancing by 'step'
+ * per output sample. Output samples are interpolated linearly between
+ * adjacent filter phases. SMK_RS_TAPS / 2 samples before, and
+ * SMK_RS_TAPS / 2 samples after, the source range touched must be
+ * readable. All kernels produce bit identical results.
+ */
+typedef void (*smk_resample_func)(Sint16 *out, const Sint16 *src,
+		int frames, Uint64 pos, Uint64 step, const Sint16 *filter);
+
+/*
+ * Output conversion kernels. 'n' is the number of samples, not frames.
+ * The fixed point bus is 8:24, and the float bus has 0 dB at +/-1.0.
+ * All kernels produce bit identical results.
+ */
+
+/* Fixed point to float */
+typedef void (*smk_s32_float_func)(float *out, const Sint32 *in, int n);
+
+/* Fixed point to 16 bits, truncating and saturating */
+typedef void (*smk_s32_s16_func)(Sint16 *out, const Sint32 *in, int n);
+
+/*
+ * Float to 16 bits, saturating, with TPDF dither of +/-1 LSB. The
+ * dither noise comes from SMK_DITHER_LANES xorshift generators, which
+ * are used in turn, so that sample 'i' of each call is dithered by
+ * generator 'i % SMK_DITHER_LANES'. The generators must be seeded with
+ * non-zero values.
+ */
+#define	SMK_DITHER_LANES	8
+typedef void (*smk_float_s16_func)(Sint16 *out, const float *in, int n,
+		Uint32 *dither);
+
+/* Float to 24 bits, in 32 bit integers, rounded and saturated */
+typedef void (*smk_float_s24_func)(Sint32 *out, const float *in, int n);
+
+/*
+ * Soft saturation, 1.5 * x - 0.5 * x^3, followed by clipping to the
+ * range +/-1.0, in place on 'n' float samples.
+ */
+typedef void (*smk_saturate_func)(float *buf, int n);
+
+/* Currently selected kernels */
+extern smk_mix_func smk_mix_mono;
+extern smk_resample_func smk_resample;
+extern smk_s32_float_func smk_s32_float;
+extern smk_s32_s16_func smk_s32_s16;
+extern smk_float_s16_func smk_float_s16;
+extern smk_float_s24_func smk_float_s24;
+extern smk_saturate_func smk_saturate;
+
+/*
+ * Select the fastest kernels supported by the CPU, but not beyond
+ * 'max'. Returns the instruction set actually selected.
+ */
+SMK_isa smk_init(SMK_isa max);
+
+/* Returns 1 if the CPU (and build) supports 'isa' */
+int smk_supported(SMK_isa isa);
+
+/* Name of 'isa', for messages */
+const char *smk_name(SMK_isa isa);
+
+/*
+ * Run the 'isa' kernels and the scalar reference kernels on the same
+ * random input, and return the largest difference found in the
+ * output, or -1 if 'isa' is not supported.
+ */
+int smk_verify(SMK_isa isa);
+
+#endif	/* SMKERNEL_H */
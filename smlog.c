@@ -0,0 +1,117 @@
+/*
+ * smlog.c - Realtime safe message log
+ *
+ * Copyright 2016 David Olofson
+ */
+
+#include <stdarg.h>
+#include "smlog.h"
+#include "smring.h"
+
+/*
+ * The queue is a ring of slots, with a sequence number per slot, that
+ * tells whether the slot is ready for the writer that claimed the
+ * index 'seq', or holds a record for the reader at index 'seq - 1'.
+ * Writers claim indices by compare-and-swap, so any number of threads
+ * may write, while there's only one reader.
+ *    So that the queue works without initialization, the slots store
+ * their sequence numbers minus their own indices.
+ */
+typedef struct
+{
+	volatile unsigned	seq;
+	SM_logrecord		rec;
+} SM_logslot;
+
+static SM_logslot slots[SM_LOG_RECORDS];
+static volatile unsigned log_wr = 0;	/* Next index to claim */
+static unsigned log_rd = 0;		/* Next index to read */
+static volatile int log_dropped = 0;
+static volatile int log_queued = 0;
+static volatile int log_level = SM_LOG_INFO;	/* Lowest level logged */
+
+
+void sm_log_print(const SM_logrecord *rec, FILE *f)
+{
+	fprintf(f, "%s\n", rec->text);
+}
+
+
+void sm_log(SM_loglevels level, const char *format, ...)
+{
+	va_list args;
+	SM_logslot *s;
+	unsigned i, pos;
+
+	if(level < log_level)
+		return;
+	if(!log_queued)
+	{
+		FILE *f = level == SM_LOG_INFO ? stdout : stderr;
+		va_start(args, format);
+		vfprintf(f, format, args);
+		va_end(args);
+		fputc('\n', f);
+		return;
+	}
+
+	/* Claim a slot */
+	pos = SM_LOAD_ACQUIRE(log_wr);
+	while(1)
+	{
+		int d;
+		i = pos & (SM_LOG_RECORDS - 1);
+		s = &slots[i];
+		d = (int)(SM_LOAD_ACQUIRE(s->seq) + i - pos);
+		if(!d)
+		{
+			if(SM_ATOMIC_CAS(log_wr, pos, pos + 1))
+				break;
+		}
+		else if(d < 0)
+		{
+			/* Full; the reader hasn't freed the slot yet */
+			SM_ATOMIC_ADD(log_dropped, 1);
+			return;
+		}
+		pos = SM_LOAD_ACQUIRE(log_wr);
+	}
+
+	s->rec.time = SDL_GetTicks();
+	s->rec.level = level;
+	va_start(args, format);
+	vsnprintf(s->rec.text, SM_LOG_TEXT, format, args);
+	va_end(args);
+	SM_STORE_RELEASE(s->seq, pos + 1 - i);
+}
+
+
+void sm_log_queue(int queued)
+{
+	SM_STORE_RELEASE(log_queued, queued);
+}
+
+
+void sm_log_level(SM_loglevels level)
+{
+	log_level = level;
+}
+
+
+int sm_log_read(SM_logrecord *rec)
+{
+	unsigned i = log_rd & (SM_LOG_RECORDS - 1);
+	SM_logslot *s = &slots[i];
+	if(SM_LOAD_ACQUIRE(s->seq) + i != log_rd + 1)
+		return 0;
+	*rec = s->rec;
+	SM_STORE_RELEASE(s->seq, log_rd + SM_LOG_RECORDS - i);
+	++log_rd;
+	return 1;
+}
+
+
+unsigned sm_log_dropped(void)
+{
+	return SM_ATOMIC_EXCHANGE(log_dropped, 0);
+}
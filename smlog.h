@@ -0,0 +1,76 @@
+/*
+ * smlog.h - Realtime safe message log
+ *
+ * Copyright 2016 David Olofson
+ */
+
+#ifndef	SMLOG_H
+#define	SMLOG_H
+
+#include <stdio.h>
+#include "SDL.h"
+
+/* Maximum message length, including the terminating null */
+#define	SM_LOG_TEXT	120
+
+/* Number of records in the log queue */
+#define	SM_LOG_RECORDS	256
+
+typedef enum
+{
+	SM_LOG_INFO = 0,
+	SM_LOG_WARNING,
+	SM_LOG_ERROR
+} SM_loglevels;
+
+/* A log message */
+typedef struct
+{
+	Uint32		time;		/* SDL_GetTicks() when posted */
+	SM_loglevels	level;
+	char		text[SM_LOG_TEXT];	/* No newline */
+} SM_logrecord;
+
+#ifdef __GNUC__
+# define	SM_PRINTF(f, a)	__attribute__((format(printf, f, a)))
+#else
+# define	SM_PRINTF(f, a)
+#endif
+
+/*
+ * Log a message. By default, messages are printed right away; info
+ * messages to stdout, and warnings and errors to stderr.
+ *    In queued mode, messages are instead formatted into a record in
+ * a preallocated queue, for an application thread to pick up with
+ * sm_log_read(). That never allocates memory or blocks, and can be
+ * done from any thread, including the audio context. Messages that
+ * don't fit in the queue are dropped.
+ */
+void sm_log(SM_loglevels level, const char *format, ...) SM_PRINTF(2, 3);
+
+/*
+ * Switch to queued mode if 'queued' is non-zero, or back to printing
+ * directly. The messages still in the queue are left there.
+ */
+void sm_log_queue(int queued);
+
+/*
+ * Drop messages below 'level'. The default is SM_LOG_INFO; everything
+ * is logged.
+ */
+void sm_log_level(SM_loglevels level);
+
+/*
+ * Get the next message from the queue into 'rec'. Returns 1 if there
+ * was a message, or 0 if the queue is empty. Must be called from one
+ * thread only.
+ */
+int sm_log_read(SM_logrecord *rec);
+
+/* Number of messages dropped since the last call */
+unsigned sm_log_dropped(void);
+
+/* Print 'rec' to 'f', as sm_log() does in direct mode */
+void sm_log_print(const SM_logrecord *rec, FILE *f);
+
+#endif	/* SMLOG_H */
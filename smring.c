@@ -0,0 +1,198 @@
+/*
+ * smring.c - Wait-free single reader/single writer ring buffer
+ *
+ * Copyright 2016 David Olofson
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "smring.h"
+
+
+SM_ring *sm_ring_new(unsigned elsize, unsigned count)
+{
+	SM_ring *r = calloc(1, sizeof(SM_ring));
+	if(!r)
+		return NULL;
+	r->size = 1;
+	while(r->size < count)
+		r->size <<= 1;
+	r->elsize = elsize;
+	r->data = malloc(r->size * elsize);
+	if(!r->data)
+	{
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+
+void sm_ring_free(SM_ring *r)
+{
+	if(!r)
+		return;
+	free(r->data);
+	free(r);
+}
+
+
+unsigned sm_ring_space(SM_ring *r)
+{
+	return r->size - (r->wr - SM_LOAD_ACQUIRE(r->rd));
+}
+
+
+unsigned sm_ring_avail(SM_ring *r)
+{
+	return SM_LOAD_ACQUIRE(r->wr) - r->rd;
+}
+
+
+unsigned sm_ring_write(SM_ring *r, const void *data, unsigned count)
+{
+	unsigned wr = r->wr;
+	unsigned i = wr & (r->size - 1);
+	unsigned n = sm_ring_space(r);
+	if(count > n)
+		count = n;
+	if(!count)
+		return 0;
+
+	/* Copy in up to two segments, as we may wrap */
+	n = r->size - i;
+	if(n > count)
+		n = count;
+	memcpy(r->data + i * r->elsize, data, n * r->elsize);
+	if(count > n)
+		memcpy(r->data, (const Uint8 *)data + n * r->elsize,
+				(count - n) * r->elsize);
+
+	SM_STORE_RELEASE(r->wr, wr + count);
+	return count;
+}
+
+
+unsigned sm_ring_read(SM_ring *r, void *data, unsigned count)
+{
+	unsigned rd = r->rd;
+	unsigned i = rd & (r->size - 1);
+	unsigned n = sm_ring_avail(r);
+	if(count > n)
+		count = n;
+	if(!count)
+		return 0;
+
+	n = r->size - i;
+	if(n > count)
+		n = count;
+	memcpy(data, r->data + i * r->elsize, n * r->elsize);
+	if(count > n)
+		memcpy((Uint8 *)data + n * r->elsize, r->data,
+				(count - n) * r->elsize);
+
+	SM_STORE_RELEASE(r->rd, rd + count);
+	return count;
+}
+
+
+void *sm_ring_peek(SM_ring *r, unsigned index)
+{
+	if(index >= sm_ring_avail(r))
+		return NULL;
+	return r->data + ((r->rd + index) & (r->size - 1)) * r->elsize;
+}
+
+
+void sm_ring_skip(SM_ring *r, unsigned count)
+{
+	unsigned n = sm_ring_avail(r);
+	if(count > n)
+		count = n;
+	SM_STORE_RELEASE(r->rd, r->rd + count);
+}
+
+
+SM_capture *sm_capture_new(unsigned elsize, unsigned count)
+{
+	SM_capture *c = calloc(1, sizeof(SM_capture));
+	if(!c)
+		return NULL;
+	c->size = 1;
+	while(c->size < count)
+		c->size <<= 1;
+	c->elsize = elsize;
+	c->data = calloc(c->size, elsize);
+	if(!c->data)
+	{
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+
+void sm_capture_free(SM_capture *c)
+{
+	if(!c)
+		return;
+	free(c->data);
+	free(c);
+}
+
+
+/*
+ * Like a sequence lock; 'head' is moved ahead before the data is
+ * written, so readers can tell what might have been overwritten
+ * while they were copying, and then 'wr' is moved to publish it.
+ */
+void sm_capture_write(SM_capture *c, const void *data, unsigned count)
+{
+	unsigned wr = c->wr;
+	unsigned i = wr & (c->size - 1);
+	unsigned n = c->size - i;
+	SM_STORE_RELEASE(c->head, wr + count);
+	SM_MEMORY_BARRIER();
+	if(n > count)
+		n = count;
+	memcpy(c->data + i * c->elsize, data, n * c->elsize);
+	if(count > n)
+		memcpy(c->data, (const Uint8 *)data + n * c->elsize,
+				(count - n) * c->elsize);
+	SM_STORE_RELEASE(c->wr, wr + count);
+}
+
+
+unsigned sm_capture_position(SM_capture *c)
+{
+	return SM_LOAD_ACQUIRE(c->wr);
+}
+
+
+unsigned sm_capture_snapshot(SM_capture *c, void *data, unsigned start,
+		unsigned count)
+{
+	unsigned wr = SM_LOAD_ACQUIRE(c->wr);
+	while(1)
+	{
+		unsigned i, n;
+		if(((int)(start + count - wr) > 0) ||
+				(wr - start > c->size))
+			start = wr - count;
+
+		i = start & (c->size - 1);
+		n = c->size - i;
+		if(n > count)
+			n = count;
+		memcpy(data, c->data + i * c->elsize, n * c->elsize);
+		if(count > n)
+			memcpy((Uint8 *)data + n * c->elsize, c->data,
+					(count - n) * c->elsize);
+
+		/* Anything overwritten while we were copying? */
+		SM_MEMORY_BARRIER();
+		if(SM_LOAD_ACQUIRE(c->head) - start <= c->size)
+			return start;
+		wr = SM_LOAD_ACQUIRE(c->wr);
+	}
+}
@@ -0,0 +1,165 @@
+/*
+ * smring.h - Wait-free single reader/single writer ring buffer
+ *
+ * Copyright 2016 David Olofson
+ */
+
+#ifndef	SMRING_H
+#define	SMRING_H
+
+#include "SDL.h"
+
+/*
+ * Memory ordering for the ring indices. The writer publishes data with
+ * a release store of the write index, and the reader frees space with
+ * a release store of the read index. Each side picks up the other's
+ * index with an acquire load.
+ *    SM_ATOMIC_EXCHANGE() stores a new value and returns the old one,
+ * SM_ATOMIC_ADD() adds to a value and returns the result, and
+ * SM_ATOMIC_CAS() stores a new value if the current value is the
+ * expected one, returning non-zero if it did, all atomically. Without
+ * compiler support, they're plain operations.
+ */
+#if defined(__GNUC__) && ((__GNUC__ > 4) || \
+		((__GNUC__ == 4) && (__GNUC_MINOR__ >= 7)))
+# define	SM_LOAD_ACQUIRE(x)	__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+# define	SM_STORE_RELEASE(x, v)	__atomic_store_n(&(x), (v), \
+						__ATOMIC_RELEASE)
+# define	SM_MEMORY_BARRIER()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+# define	SM_ATOMIC_EXCHANGE(x, v)	__atomic_exchange_n(&(x), (v), \
+							__ATOMIC_ACQ_REL)
+# define	SM_ATOMIC_ADD(x, v)	__atomic_add_fetch(&(x), (v), \
+						__ATOMIC_ACQ_REL)
+# define	SM_ATOMIC_CAS(x, o, v)	({ __typeof__((x) + 0) _o = (o); \
+					__atomic_compare_exchange_n(&(x), \
+					&_o, (v), 0, __ATOMIC_ACQ_REL, \
+					__ATOMIC_ACQUIRE); })
+#elif defined(__GNUC__)
+# define	SM_LOAD_ACQUIRE(x)	({ unsigned _v = (x); \
+						__sync_synchronize(); _v; })
+# define	SM_STORE_RELEASE(x, v)	do { __sync_synchronize(); \
+						(x) = (v); } while(0)
+# define	SM_MEMORY_BARRIER()	__sync_synchronize()
+# define	SM_ATOMIC_EXCHANGE(x, v)	__sync_lock_test_and_set(&(x), (v))
+# define	SM_ATOMIC_ADD(x, v)	__sync_add_and_fetch(&(x), (v))
+# define	SM_ATOMIC_CAS(x, o, v)	__sync_bool_compare_and_swap(&(x), \
+						(o), (v))
+#else
+# define	SM_LOAD_ACQUIRE(x)	(x)
+# define	SM_STORE_RELEASE(x, v)	((x) = (v))
+# define	SM_MEMORY_BARRIER()
+# define	SM_ATOMIC_EXCHANGE(x, v)	sm_exchange(&(x), (v))
+# define	SM_ATOMIC_ADD(x, v)	sm_add(&(x), (v))
+# define	SM_ATOMIC_CAS(x, o, v)	sm_cas(&(x), (o), (v))
+static inline int sm_exchange(volatile int *x, int v)
+{
+	int old = *x;
+	*x = v;
+	return old;
+}
+static inline int sm_add(volatile int *x, int v)
+{
+	return *x += v;
+}
+static inline int sm_cas(volatile unsigned *x, unsigned o, unsigned v)
+{
+	if(*x != o)
+		return 0;
+	*x = v;
+	return 1;
+}
+#endif
+
+/*
+ * A ring buffer of fixed size elements. The indices are free running,
+ * and wrap to the buffer with a mask, so the size is always a power of
+ * two. One thread may write, and one other thread may read, at the
+ * same time, without locking.
+ */
+typedef struct SM_ring
+{
+	Uint8		*data;
+	unsigned	size;		/* Capacity (elements); power of two */
+	unsigned	elsize;		/* Element size (bytes) */
+	volatile unsigned	rd;	/* Read index (owned by the reader) */
+	volatile unsigned	wr;	/* Write index (owned by the writer) */
+} SM_ring;
+
+/* Create a ring for at least 'count' elements of 'elsize' bytes */
+SM_ring *sm_ring_new(unsigned elsize, unsigned count);
+void sm_ring_free(SM_ring *r);
+
+/* Number of elements that can be written right now (writer side) */
+unsigned sm_ring_space(SM_ring *r);
+
+/* Number of elements that can be read right now (reader side) */
+unsigned sm_ring_avail(SM_ring *r);
+
+/*
+ * Write up to 'count' elements from 'data'. Returns the number of
+ * elements actually written.
+ */
+unsigned sm_ring_write(SM_ring *r, const void *data, unsigned count);
+
+/*
+ * Read up to 'count' elements into 'data'. Returns the number of
+ * elements actually read.
+ */
+unsigned sm_ring_read(SM_ring *r, void *data, unsigned count);
+
+/*
+ * Get a pointer to element 'index' from the read position, without
+ * reading it, or NULL if it hasn't been written yet. The element stays
+ * valid until it's skipped or read. (Reader side)
+ */
+void *sm_ring_peek(SM_ring *r, unsigned index);
+
+/* Drop up to 'count' elements without reading them (reader side) */
+void sm_ring_skip(SM_ring *r, unsigned count);
+
+/*
+ * A capture ring, for one thread continuously writing a stream, and
+ * another thread looking at recent parts of it. The writer never
+ * waits, and overwrites the oldest data as needed. The reader takes
+ * snapshots of windows of the stream, which are checked against the
+ * writer, and retaken if the writer overwrote them while copying.
+ *    Stream positions are free running element counts, so they wrap
+ * around, and should only be compared through differences.
+ */
+typedef struct SM_capture
+{
+	Uint8		*data;
+	unsigned	size;		/* Capacity (elements); power of two */
+	unsigned	elsize;		/* Element size (bytes) */
+	volatile unsigned	head;	/* End of the data being written */
+	volatile unsigned	wr;	/* End of the written data */
+} SM_capture;
+
+/*
+ * Create a capture ring for at least 'count' elements of 'elsize'
+ * bytes. Before anything is written, the ring reads as zeros.
+ */
+SM_capture *sm_capture_new(unsigned elsize, unsigned count);
+void sm_capture_free(SM_capture *c);
+
+/*
+ * Append 'count' elements from 'data' to the stream. 'count' must be
+ * less than the capacity of the ring. (Writer side)
+ */
+void sm_capture_write(SM_capture *c, const void *data, unsigned count);
+
+/* Stream position of the end of the written data */
+unsigned sm_capture_position(SM_capture *c);
+
+/*
+ * Copy the 'count' elements from stream position 'start' into 'data'.
+ * If the window extends past the written data, it's moved back to end
+ * there, and if it's been overwritten, it's moved to the latest data.
+ * Returns the start position of the window actually copied. 'count'
+ * should be well below the capacity, to leave room for the writer.
+ * (Reader side)
+ */
+unsigned sm_capture_snapshot(SM_capture *c, void *data, unsigned start,
+		unsigned count);
+
+#endif	/* SMRING_H */
@@ -0,0 +1,88 @@
+/*
+ * smwav.c - WAV file output for rendered audio
+ *
+ * Copyright 2016 David Olofson
+ */
+
+#include <string.h>
+#include "smwav.h"
+
+
+static void put16(Uint8 *p, Uint16 v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+
+static void put32(Uint8 *p, Uint32 v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+
+int sm_wav_framesize(SM_formats format)
+{
+	switch(format)
+	{
+	  case SM_FORMAT_FLOAT:
+		return 2 * 4;
+	  case SM_FORMAT_S24:
+		return 2 * 3;
+	  default:
+		return 2 * 2;
+	}
+}
+
+
+int sm_wav_header(FILE *f, int rate, SM_formats format, Uint32 bytes)
+{
+	Uint8 h[44];
+	int fs = sm_wav_framesize(format);
+	memcpy(h, "RIFF", 4);
+	put32(h + 4, bytes > 0xffffffff - 36 ? 0xffffffff : bytes + 36);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put32(h + 16, 16);
+	put16(h + 20, (format == SM_FORMAT_FLOAT) ? 3 : 1);
+	put16(h + 22, 2);
+	put32(h + 24, rate);
+	put32(h + 28, rate * fs);
+	put16(h + 32, fs);
+	put16(h + 34, fs / 2 * 8);
+	memcpy(h + 36, "data", 4);
+	put32(h + 40, bytes);
+	return fwrite(h, sizeof(h), 1, f) == 1 ? 0 : -1;
+}
+
+
+int sm_wav_write(FILE *f, void *buf, int frames, SM_formats format)
+{
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+	int i;
+	Uint8 *d = (Uint8 *)buf;
+	if(format == SM_FORMAT_S24)
+		;	/* Always little endian */
+	else if(format == SM_FORMAT_FLOAT)
+		for(i = 0; i < frames * 2 * 4; i += 4)
+		{
+			Uint8 x = d[i];
+			d[i] = d[i + 3];
+			d[i + 3] = x;
+			x = d[i + 1];
+			d[i + 1] = d[i + 2];
+			d[i + 2] = x;
+		}
+	else
+		for(i = 0; i < frames * 2 * 2; i += 2)
+		{
+			Uint8 x = d[i];
+			d[i] = d[i + 1];
+			d[i + 1] = x;
+		}
+#endif
+	return fwrite(buf, frames * sm_wav_framesize(format), 1, f) == 1 ?
+			0 : -1;
+}
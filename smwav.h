@@ -0,0 +1,30 @@
+/*
+ * smwav.h - WAV file output for rendered audio
+ *
+ * Copyright 2016 David Olofson
+ */
+
+#ifndef	SMWAV_H
+#define	SMWAV_H
+
+#include <stdio.h>
+#include "smixer.h"
+
+/*
+ * Write a RIFF WAVE header for 'bytes' bytes of stereo data in
+ * 'format' at 'rate' Hz. When streaming to a pipe, we don't know
+ * the size up front, so pass 0xffffffff, which most readers accept.
+ */
+int sm_wav_header(FILE *f, int rate, SM_formats format, Uint32 bytes);
+
+/*
+ * Write 'frames' stereo frames of native endian data as little endian.
+ * (SM_FORMAT_S24 is little endian already, and is written as is.)
+ * NOTE: On big endian machines, 'buf' is byte swapped in place!
+ */
+int sm_wav_write(FILE *f, void *buf, int frames, SM_formats format);
+
+/* Bytes per stereo frame of 'format' */
+int sm_wav_framesize(SM_formats format);
+
+#endif	/* SMWAV_H */
@@ -6,8 +6,11 @@
 
 #include "sseq.h"
 #include "smixer.h"
+#include "smring.h"
+#include "smlog.h"
 #include "version.h"
 #include "SDL_audio.h"
+#include "SDL_thread.h"
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -15,13 +18,37 @@
 #define	SONG_FILE_VERSION	1
 
 
-/* A sequencer track */
+/* Event opcodes */
+typedef enum
+{
+	SSEQ_OP_NONE = 0,	/* Nothing; '.', or a command argument */
+	SSEQ_OP_NOTE,		/* Play note; 'a' is the note character */
+	SSEQ_OP_CUT,		/* Cut note */
+	SSEQ_OP_DECAY,		/* Set note decay to 'a' */
+	SSEQ_OP_JUMP,		/* Jump to step 'v' */
+	SSEQ_OP_TEMPO,		/* Set tempo to 'v' BPM */
+	SSEQ_OP_VOLUME,		/* Set L/R volume to 'a'/'v' */
+	SSEQ_OP_ZERO		/* Zero time step */
+} SSEQ_ops;
+
+
+/* One step of a compiled track, with the arguments parsed */
+typedef struct
+{
+	Uint8	op;
+	Uint8	a;
+	Uint16	v;
+} SSEQ_event;
+
+
+/* A sequencer track (owned by the audio context) */
 typedef struct
 {
-	char	*data;
+	SSEQ_event	*events;	/* One per step */
 	int	length;
-	int	skip;
 	int	mute;
+	int	sound;		/* Sound slot played by the track */
+	int	polyphony;
 	float	decay;
 	float	lvol;
 	float	rvol;
@@ -41,18 +68,92 @@ struct SSEQ_tag
 /* A simple pattern sequencer */
 typedef struct
 {
-	SSEQ_track	tracks[SSEQ_TRACKS];
-	SSEQ_tag	*tags;
+	SSEQ_track	*tracks;
+	int		ntracks;
+	Uint32		*mask;		/* Tracks with events, per step */
+	int		maskwords;	/* 32 bit words per step in 'mask' */
+	int		masklength;	/* Length of 'mask' in steps */
 	int		last_position;
 	int		position;
-	int		interval;
+	double		interval;	/* Step length in frames */
+	double		frac;		/* Accumulated fraction of a frame */
 	int		loop_start;
 	int		loop_end;
+	int		loops;		/* Backward jumps/loops taken */
+	int		paused;
 } SSEQ_sequencer;
 
 
-static SSEQ_sequencer seq;
-static int paused = 0;
+/*
+ * The application side copy of a track. The editing calls work on
+ * this, and pass changes on to the sequencer through the mixer's
+ * command queue, so they never need to lock the audio thread.
+ */
+typedef struct
+{
+	char		*data;
+	SSEQ_event	*events;	/* Compiled 'data' */
+	int		length;
+	int		seqlength;	/* Length of the sequencer's copy */
+	int		mute;
+	int		sound;		/* Sound slot played by the track */
+	int		polyphony;	/* Voices the track can play at once */
+} SSEQ_trackview;
+
+
+/*
+ * Track data and sounds to install in the audio context. After the
+ * swap, the same struct carries the old data back for freeing.
+ */
+typedef struct
+{
+	SSEQ_track	*tracks;
+	int		ntracks;
+	Uint32		*mask;
+	int		maskwords;
+	int		masklength;
+	SM_bank		*bank;
+} SSEQ_swap;
+
+
+/* A complete song, as built by the loader */
+typedef struct
+{
+	char		*filename;
+	SSEQ_tag	*tags;
+	SSEQ_trackview	*views;
+	int		ntracks;
+	Uint32		*mask;
+	int		maskwords;
+	int		masklength;
+	SSEQ_swap	*swap;
+	int		result;
+	volatile int	done;		/* Set by the loader thread */
+} SSEQ_song;
+
+
+/* A sequencer instance, playing one song on one mixer */
+struct SSEQ_seq
+{
+	SM_mixer	*mixer;
+	SSEQ_sequencer	seq;		/* Owned by the audio context */
+
+	/* Application side */
+	SSEQ_trackview	*views;
+	int		ntracks;
+	Uint32		*mask;		/* Step bitmap */
+	int		maskwords;
+	int		masklength;
+	int		seqmasklength;	/* Length of the sequencer's mask */
+	SSEQ_tag	*tags;
+
+	/* Background loader */
+	SDL_Thread	*loader;
+	SSEQ_song	*loading;
+};
+
+/* The sequencer used by the sseq_*() calls */
+static SSEQ_seq *defseq = NULL;
 
 
 /*
@@ -73,56 +174,228 @@ static int get_index(const char *s, int *v)
 }
 
 
-static void _set_tempo(float bpm)
+static void _set_tempo(SSEQ_seq *sq, float bpm)
 {
 	if(bpm <= 0)
-		seq.interval = 0;
+		sq->seq.interval = 0;
 	else
-		seq.interval = (int)(44100.0 / bpm * 60.0 / 4.0);
-	sm_force_interval(seq.interval);
+		sq->seq.interval = (double)sm_mixer_get_rate(sq->mixer) / bpm *
+				60.0 / 4.0;
+	sm_mixer_force_interval(sq->mixer, (int)sq->seq.interval);
 }
 
 
-static void _set_defaults(void)
+static void _set_defaults(SSEQ_seq *sq)
 {
 	int i;
-	_set_tempo(120.0f);
-	for(i = 0; i < SSEQ_TRACKS; ++i)
+	_set_tempo(sq, 120.0f);
+	for(i = 0; i < sq->seq.ntracks; ++i)
 	{
-		seq.tracks[i].decay = 0.0f;
-		seq.tracks[i].lvol = 1.0f;
-		seq.tracks[i].rvol = 1.0f;
+		sq->seq.tracks[i].decay = 0.0f;
+		sq->seq.tracks[i].lvol = 1.0f;
+		sq->seq.tracks[i].rvol = 1.0f;
 	}
 }
 
 
-static void _play_note(int trk, char note)
+/*
+ * Play a note with the sound of track 'trk', using the voice group of
+ * the same index as the track. Tracks can only play one note at a time
+ * by default, so a new note cuts the previous one off, unless the
+ * polyphony of the track is set.
+ */
+static void _play_note(SSEQ_seq *sq, int trk, char note)
 {
+	SSEQ_track *tr = &sq->seq.tracks[trk];
 	float vel = (note - '0') * (1.0f / 9.0f);
 	if(vel)
 		vel = 0.3f + vel * 0.7f;
-	sm_play(trk, trk, vel * seq.tracks[trk].lvol,
-			vel * seq.tracks[trk].rvol);
-	sm_decay(trk, seq.tracks[trk].decay);
+	int v = sm_mixer_start(sq->mixer, trk, tr->sound,
+			vel * tr->lvol, vel * tr->rvol);
+	sm_mixer_decay(sq->mixer, v, tr->decay);
 }
 
 
-void sseq_mute(int trk, int do_mute)
+/*-------------------------------------------------------------------
+	Track compiler
+-------------------------------------------------------------------*/
+
+/* Maximum number of argument characters of a command */
+#define	SSEQ_MAXARGS	3
+
+/* Number of argument characters of command 'c' */
+static int command_args(char c)
 {
-	seq.tracks[trk].mute = do_mute;
+	switch(c)
+	{
+	  case 'D':
+		return 1;
+	  case 'V':
+		return 2;
+	  case 'J':
+	  case 'T':
+		return 3;
+	  default:
+		return 0;
+	}
 }
 
 
-int sseq_muted(int trk)
+/* Decimal value of step 'pos' of 'v', or 0 if it's not a digit */
+static int digit(SSEQ_trackview *v, int pos)
+{
+	if(pos >= v->length)
+		return 0;
+	if(v->data[pos] < '0' || v->data[pos] > '9')
+		return 0;
+	return v->data[pos] - '0';
+}
+
+
+/*
+ * Check if step 'pos' of 'v' is an argument of a command. Notes in
+ * command arguments are not played. Only the latest of the D, T and V
+ * commands before the step counts, as those restart the argument
+ * count, whereas J jumps away, and never gets to the argument steps.
+ */
+static int is_argument(SSEQ_trackview *v, int pos)
+{
+	int p;
+	for(p = pos - 1; (p >= 0) && (p >= pos - SSEQ_MAXARGS); --p)
+		switch(v->data[p])
+		{
+		  case 'D':
+		  case 'T':
+		  case 'V':
+			return pos - p <= command_args(v->data[p]);
+		}
+	return 0;
+}
+
+
+/* Compile steps 'first' through 'last' of 'v' into events */
+static void compile(SSEQ_trackview *v, int first, int last)
+{
+	int pos;
+	for(pos = first; pos <= last; ++pos)
+	{
+		SSEQ_event *e = &v->events[pos];
+		e->op = SSEQ_OP_NONE;
+		e->a = 0;
+		e->v = 0;
+		switch(v->data[pos])
+		{
+		  case '0':
+		  case '1':
+		  case '2':
+		  case '3':
+		  case '4':
+		  case '5':
+		  case '6':
+		  case '7':
+		  case '8':
+		  case '9':
+			if(is_argument(v, pos))
+				break;
+			e->op = SSEQ_OP_NOTE;
+			e->a = v->data[pos];
+			break;
+		  case 'C':
+			e->op = SSEQ_OP_CUT;
+			break;
+		  case 'D':
+			e->op = SSEQ_OP_DECAY;
+			e->a = digit(v, pos + 1);
+			break;
+		  case 'J':
+		  case 'T':
+			e->op = v->data[pos] == 'J' ?
+					SSEQ_OP_JUMP : SSEQ_OP_TEMPO;
+			e->v = digit(v, pos + 1) * 100 +
+					digit(v, pos + 2) * 10 +
+					digit(v, pos + 3);
+			break;
+		  case 'V':
+			e->op = SSEQ_OP_VOLUME;
+			e->a = digit(v, pos + 1);
+			e->v = digit(v, pos + 2);
+			break;
+		  case 'Z':
+			e->op = SSEQ_OP_ZERO;
+			break;
+		}
+	}
+}
+
+
+/* Pack an event into an int, for sending as a command argument */
+static int pack_event(SSEQ_event *e)
+{
+	return (e->op << 24) | (e->a << 16) | e->v;
+}
+
+
+/* Number of 32 bit words in the track bitmap of one step */
+static inline int mask_words(int ntracks)
+{
+	return (ntracks + 31) / 32;
+}
+
+
+/*
+ * Update the bits of 'track' in 'mask', of 'words' words per step, for
+ * steps 'first'..'last'.
+ */
+static void update_mask(Uint32 *mask, int words, int track,
+		SSEQ_event *events, int first, int last)
+{
+	int pos;
+	int w = track / 32;
+	Uint32 bit = 1u << (track % 32);
+	for(pos = first; pos <= last; ++pos)
+	{
+		Uint32 *m = mask + pos * words + w;
+		if(events[pos].op != SSEQ_OP_NONE)
+			*m |= bit;
+		else
+			*m &= ~bit;
+	}
+}
+
+
+/* Index of the lowest set bit of 'bits', which must be non-zero */
+static inline int lowest_bit(Uint32 bits)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(bits);
+#else
+	int i = 0;
+	while(!(bits & 1))
+	{
+		bits >>= 1;
+		++i;
+	}
+	return i;
+#endif
+}
+
+
+/* Allocate a copy of 'size' bytes from 'data' */
+static void *copy(const void *data, size_t size)
 {
-	return seq.tracks[trk].mute;
+	void *p;
+	if(!size)
+		return NULL;
+	p = malloc(size);
+	if(p)
+		memcpy(p, data, size);
+	return p;
 }
 
 
 /* Find specified tag by label */
-static SSEQ_tag *find_tag(const char *label)
+static SSEQ_tag *find_tag(SSEQ_tag *tag, const char *label)
 {
-	SSEQ_tag *tag = seq.tags;
 	while(tag)
 	{
 		if(!strcmp(tag->label, label))
@@ -134,7 +407,8 @@ static SSEQ_tag *find_tag(const char *label)
 
 
 /* Add a new tag, even if there are others with the same label */
-static SSEQ_tag *add_tag(const char *label, const char *data)
+static SSEQ_tag *add_tag(SSEQ_tag **list, const char *label,
+		const char *data)
 {
 	SSEQ_tag *tag = malloc(sizeof(SSEQ_tag));
 	if(!tag)
@@ -142,11 +416,11 @@ static SSEQ_tag *add_tag(const char *label, const char *data)
 	tag->label = strdup(label);
 	tag->data = strdup(data);
 	tag->next = NULL;
-	if(!seq.tags)
-		seq.tags = tag;
+	if(!*list)
+		*list = tag;
 	else
 	{
-		SSEQ_tag *lt = seq.tags;
+		SSEQ_tag *lt = *list;
 		while(lt->next)
 			lt = lt->next;
 		lt->next = tag;
@@ -156,25 +430,26 @@ static SSEQ_tag *add_tag(const char *label, const char *data)
 
 
 /* Set or create tag 'label' and assign 'data' to it */
-static SSEQ_tag *set_tag(const char *label, const char *data)
+static SSEQ_tag *set_tag(SSEQ_tag **list, const char *label,
+		const char *data)
 {
-	SSEQ_tag *tag = find_tag(label);
+	SSEQ_tag *tag = find_tag(*list, label);
 	if(tag)
 	{
 		free(tag->data);
 		tag->data = strdup(data);
 		return tag;
 	}
-	return add_tag(label, data);
+	return add_tag(list, label, data);
 }
 
 
-static void remove_tags(void)
+static void remove_tags(SSEQ_tag **list)
 {
-	while(seq.tags)
+	while(*list)
 	{
-		SSEQ_tag *tag = seq.tags;
-		seq.tags = tag->next;
+		SSEQ_tag *tag = *list;
+		*list = tag->next;
 		free(tag->label);
 		free(tag->data);
 		free(tag);
@@ -182,31 +457,186 @@ static void remove_tags(void)
 }
 
 
-void _clear(void)
+/*-------------------------------------------------------------------
+	Songs
+-------------------------------------------------------------------*/
+
+/*
+ * Grow the track views '*views', of '*count' tracks, to 'n' tracks. New
+ * tracks play the sound of the same index, one note at a time.
+ */
+static int grow_views(SSEQ_trackview **views, int *count, int n)
+{
+	SSEQ_trackview *nv;
+	int i;
+	if(n <= *count)
+		return 0;
+	if(n > SSEQ_MAXTRACKS)
+		return -1;
+	nv = realloc(*views, n * sizeof(SSEQ_trackview));
+	if(!nv)
+		return -1;
+	memset(nv + *count, 0, (n - *count) * sizeof(SSEQ_trackview));
+	for(i = *count; i < n; ++i)
+	{
+		nv[i].sound = i;
+		nv[i].polyphony = 1;
+	}
+	*views = nv;
+	*count = n;
+	return 0;
+}
+
+
+/* Set up sequencer tracks 'first' through 'last' from 'views' */
+static void init_tracks(SSEQ_track *tracks, SSEQ_trackview *views,
+		int first, int last)
 {
 	int i;
-	remove_tags();
-	_set_defaults();
-	for(i = 0; i < SSEQ_TRACKS; ++i)
+	for(i = first; i <= last; ++i)
 	{
-		free(seq.tracks[i].data);
-		seq.tracks[i].data = NULL;
-		seq.tracks[i].length = 0;
-		seq.tracks[i].mute = 0;
-		sm_unload(i);
+		tracks[i].sound = views[i].sound;
+		tracks[i].polyphony = views[i].polyphony;
+		tracks[i].lvol = tracks[i].rvol = 1.0f;
 	}
 }
 
 
-void sseq_clear(void)
+static void free_tracks(SSEQ_track *tracks, int count)
+{
+	int i;
+	if(!tracks)
+		return;
+	for(i = 0; i < count; ++i)
+		free(tracks[i].events);
+	free(tracks);
+}
+
+
+static void free_views(SSEQ_trackview *views, int count)
+{
+	int i;
+	if(!views)
+		return;
+	for(i = 0; i < count; ++i)
+	{
+		free(views[i].data);
+		free(views[i].events);
+	}
+	free(views);
+}
+
+
+static void free_swap(SSEQ_swap *sw)
+{
+	if(!sw)
+		return;
+	free_tracks(sw->tracks, sw->ntracks);
+	free(sw->mask);
+	sm_bank_free(sw->bank);
+	free(sw);
+}
+
+
+static void free_song(SSEQ_song *s)
+{
+	if(!s)
+		return;
+	free_views(s->views, s->ntracks);
+	free(s->mask);
+	remove_tags(&s->tags);
+	free_swap(s->swap);
+	free(s->filename);
+	free(s);
+}
+
+
+/* Create a new, empty song, of SSEQ_TRACKS tracks */
+static SSEQ_song *new_song(void)
+{
+	SSEQ_song *s = calloc(1, sizeof(SSEQ_song));
+	if(!s)
+		return NULL;
+	s->swap = calloc(1, sizeof(SSEQ_swap));
+	if(!s->swap || !(s->swap->bank = sm_bank_new()) ||
+			(grow_views(&s->views, &s->ntracks, SSEQ_TRACKS) < 0))
+	{
+		free_song(s);
+		return NULL;
+	}
+	return s;
+}
+
+
+/* Append 'data' to a track of a song under construction */
+static int song_add(SSEQ_song *s, int track, const char *data)
+{
+	SSEQ_trackview *v;
+	int len = strlen(data);
+	char *nv;
+	if(grow_views(&s->views, &s->ntracks, track + 1) < 0)
+		return -1;
+	v = &s->views[track];
+	nv = realloc(v->data, v->length + len + 1);
+	if(!nv)
+		return -1;
+	memcpy(nv + v->length, data, len + 1);
+	v->data = nv;
+	v->length += len;
+	return 0;
+}
+
+
+/*
+ * Compile the tracks of a loaded song, and make the sequencer's
+ * copies of the tracks and the step bitmap.
+ */
+static int song_finalize(SSEQ_song *s)
 {
-	SDL_LockAudio();
-	_clear();
-	SDL_UnlockAudio();
+	SSEQ_swap *sw = s->swap;
+	int i;
+	sw->tracks = calloc(s->ntracks, sizeof(SSEQ_track));
+	if(!sw->tracks)
+		return -1;
+	sw->ntracks = s->ntracks;
+	init_tracks(sw->tracks, s->views, 0, s->ntracks - 1);
+	for(i = 0; i < s->ntracks; ++i)
+	{
+		SSEQ_trackview *v = &s->views[i];
+		if(!v->length)
+			continue;
+		v->events = malloc(v->length * sizeof(SSEQ_event));
+		if(!v->events)
+			return -1;
+		compile(v, 0, v->length - 1);
+		if(v->length > s->masklength)
+			s->masklength = v->length;
+		sw->tracks[i].events = copy(v->events,
+				v->length * sizeof(SSEQ_event));
+		if(!sw->tracks[i].events)
+			return -1;
+		sw->tracks[i].length = v->length;
+		v->seqlength = v->length;
+	}
+	s->maskwords = sw->maskwords = mask_words(s->ntracks);
+	if(!s->masklength)
+		return 0;
+	s->mask = calloc(s->masklength * s->maskwords, sizeof(Uint32));
+	if(!s->mask)
+		return -1;
+	for(i = 0; i < s->ntracks; ++i)
+		update_mask(s->mask, s->maskwords, i, s->views[i].events, 0,
+				s->views[i].length - 1);
+	sw->mask = copy(s->mask,
+			s->masklength * s->maskwords * sizeof(Uint32));
+	if(!sw->mask)
+		return -1;
+	sw->masklength = s->masklength;
+	return 0;
 }
 
 
-static int load_line(const char *label, const char *data)
+static int load_line(SSEQ_song *s, const char *label, const char *data)
 {
 	int i;
 	if(label[0] == 'I')
@@ -214,8 +644,8 @@ static int load_line(const char *label, const char *data)
 		/* Instrument file reference? */
 		if(get_index(label + 1, &i) >= 0)
 		{
-			add_tag(label, data);
-			return sm_load(i, data);
+			add_tag(&s->tags, label, data);
+			return sm_bank_load(s->swap->bank, i, data);
 		}
 	}
 	else if(label[0] == 'S')
@@ -223,53 +653,97 @@ static int load_line(const char *label, const char *data)
 		/* Synth instrument definition? */
 		if(get_index(label + 1, &i) >= 0)
 		{
-			add_tag(label, data);
-			return sm_load_synth(i, data);
+			add_tag(&s->tags, label, data);
+			return sm_bank_load_synth(s->swap->bank, i, data);
+		}
+	}
+	else if(label[0] == 'P')
+	{
+		/* Track polyphony? */
+		if(get_index(label + 1, &i) >= 0)
+		{
+			int n = atoi(data);
+			if(i < 0 || i >= SSEQ_MAXTRACKS || n < 1 ||
+					n > SM_MAXVOICES)
+			{
+				sm_log(SM_LOG_WARNING, "WARNING: Bad polyphony "
+						"\"%s:%s\"!", label, data);
+				return 1;
+			}
+			if(grow_views(&s->views, &s->ntracks, i + 1) < 0)
+				return -1;
+			add_tag(&s->tags, label, data);
+			s->views[i].polyphony = n;
+			return 0;
+		}
+	}
+	else if(label[0] == 'M')
+	{
+		/* Track to sound mapping? */
+		if(get_index(label + 1, &i) >= 0)
+		{
+			int n = atoi(data);
+			if(i < 0 || i >= SSEQ_MAXTRACKS || n < 0 ||
+					n >= SM_MAXSOUNDS)
+			{
+				sm_log(SM_LOG_WARNING, "WARNING: Bad sound "
+						"mapping \"%s:%s\"!", label, data);
+				return 1;
+			}
+			if(grow_views(&s->views, &s->ntracks, i + 1) < 0)
+				return -1;
+			add_tag(&s->tags, label, data);
+			s->views[i].sound = n;
+			return 0;
 		}
 	}
 	else if(get_index(label, &i) >= 0)
 	{
-		sseq_add(i, data);	/* Track data */
-		return 0;
+		if(i < 0 || i >= SSEQ_MAXTRACKS)
+		{
+			sm_log(SM_LOG_WARNING, "WARNING: Track %d out of "
+					"range!", i);
+			return 1;
+		}
+		return song_add(s, i, data);	/* Track data */
 	}
 
 	/* Check for tags */
 	i = 0;
 	if(!strcmp(label, "CREATOR"))
-		printf("        File creator: %s\n", data);
+		sm_log(SM_LOG_INFO, "        File creator: %s", data);
 	else if(!strcmp(label, "VERSION"))
-		printf("File creator version: %s\n", data);
+		sm_log(SM_LOG_INFO, "File creator version: %s", data);
 	else if(!strcmp(label, "AUTHOR"))
-		printf("         Song author: %s\n", data);
+		sm_log(SM_LOG_INFO, "         Song author: %s", data);
 	else if(!strcmp(label, "TITLE"))
-		printf("          Song title: %s\n", data);
+		sm_log(SM_LOG_INFO, "          Song title: %s", data);
 	else
 	{
-		fprintf(stderr, "WARNING: Unknown tag \"%s\"\n", label);
+		sm_log(SM_LOG_WARNING, "WARNING: Unknown tag \"%s\"", label);
 		i = 1;
 	}
 
 	/* Store the tag, so we can write it back when saving */
-	add_tag(label, data);
+	add_tag(&s->tags, label, data);
 	return i;
 }
 
 
-int _load_song(const char *fn)
+/* Load song file 'fn' into 's'. Runs in the loader thread! */
+static int load_file(SSEQ_song *s, const char *fn)
 {
 	int i;
 	char *buf;
 	int size;
 
-	_clear();
-
-	printf("Loading Song \"%s\"...\n", fn);
+	sm_log(SM_LOG_INFO, "Loading Song \"%s\"...", fn);
 
 	/* Read file */
 	FILE *f = fopen(fn, "rb");
 	if(!f)
 	{
-		fprintf(stderr, "Could not open song \"%s\": %s\n",
+		sm_log(SM_LOG_ERROR, "Could not open song \"%s\": %s",
 				fn, strerror(errno));
 		return -1;
 	}
@@ -277,7 +751,7 @@ int _load_song(const char *fn)
 	size = ftell(f);
 	if(size < 0)
 	{
-		fprintf(stderr, "Could not load song \"%s\": %s\n",
+		sm_log(SM_LOG_ERROR, "Could not load song \"%s\": %s",
 				fn, strerror(errno));
 		fclose(f);
 		return -1;
@@ -286,15 +760,15 @@ int _load_song(const char *fn)
 	buf = malloc(size + 1);
 	if(!buf)
 	{
-		fprintf(stderr, "Could not load song \"%s\": "
-				"Out of memory!\n", fn);
+		sm_log(SM_LOG_ERROR, "Could not load song \"%s\": "
+				"Out of memory!", fn);
 		fclose(f);
 		return -1;
 	}
 	buf[size] = 0;		/* Safety NUL terminator */
 	if(fread(buf, size, 1, f) < 1)
 	{
-		fprintf(stderr, "Could not load song \"%s\": %s\n",
+		sm_log(SM_LOG_ERROR, "Could not load song \"%s\": %s",
 				fn, strerror(errno));
 		fclose(f);
 		return -1;
@@ -304,20 +778,20 @@ int _load_song(const char *fn)
 	/* Check format */
 	if(strncmp(buf, "DT42", 4) != 0)
 	{
-		fprintf(stderr, "\"%s\" is not a DT42 file!\n", fn);
+		sm_log(SM_LOG_ERROR, "\"%s\" is not a DT42 file!", fn);
 		free(buf);
 		return -1;
 	}
 	if(strncmp(buf + 4, "SONG", 4) != 0)
 	{
-		fprintf(stderr, "\"%s\" is not a SONG file!\n", fn);
+		sm_log(SM_LOG_ERROR, "\"%s\" is not a SONG file!", fn);
 		free(buf);
 		return -1;
 	}
 	if(atoi(buf + 8) > SONG_FILE_VERSION)
 	{
-		fprintf(stderr, "\"%s\" was created by a newer version"
-				" of DT-42!\n", fn);
+		sm_log(SM_LOG_ERROR, "\"%s\" was created by a newer version"
+				" of DT-42!", fn);
 		free(buf);
 		return -1;
 	}
@@ -343,8 +817,8 @@ int _load_song(const char *fn)
 			;
 		if(i >= size)
 		{
-			fprintf(stderr, "Could not load song \"%s\": "
-					"Tag parse error in label!\n", fn);
+			sm_log(SM_LOG_ERROR, "Could not load song \"%s\": "
+					"Tag parse error in label!", fn);
 			free(buf);
 			return -1;
 		}
@@ -359,52 +833,197 @@ int _load_song(const char *fn)
 			;
 		if(i >= size)
 		{
-			fprintf(stderr, "Could not load song \"%s\": "
-					"Tag parse error in data!\n", fn);
+			sm_log(SM_LOG_ERROR, "Could not load song \"%s\": "
+					"Tag parse error in data!", fn);
 			free(buf);
 			return -1;
 		}
 		buf[i] = 0;	/* Terminate. */
 
 		/* Process the tag! */
-		if(load_line(label, data) < 0)
+		if(load_line(s, label, data) < 0)
 		{
-			fprintf(stderr, "Could not load song \"%s\": "
-					"Critical parse error!\n", fn);
+			sm_log(SM_LOG_ERROR, "Could not load song \"%s\": "
+					"Critical parse error!", fn);
 			free(buf);
 			return -1;
 		}
 	}
 
-	printf("Song \"%s\" loaded!\n", fn);
 	free(buf);
+	if(song_finalize(s) < 0)
+	{
+		sm_log(SM_LOG_ERROR, "Could not load song \"%s\": "
+				"Out of memory!", fn);
+		return -1;
+	}
+	sm_log(SM_LOG_INFO, "Song \"%s\" loaded!", fn);
 	return 0;
 }
 
 
-int sseq_load_song(const char *fn)
+/* Reply handler: Free data passed back from cmd_set_song() */
+static void cmd_free_song(SM_command *cmd)
+{
+	free_swap((SSEQ_swap *)cmd->p);
+}
+
+
+/* Install new tracks and sounds (audio context) */
+static void cmd_set_song(SM_command *cmd)
+{
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	SSEQ_swap *sw = (SSEQ_swap *)cmd->p;
+	int i;
+	SSEQ_track *t = sq->seq.tracks;
+	int n = sq->seq.ntracks;
+	Uint32 *m = sq->seq.mask;
+	int mwords = sq->seq.maskwords;
+	int mlen = sq->seq.masklength;
+	sq->seq.tracks = sw->tracks;
+	sq->seq.ntracks = sw->ntracks;
+	sw->tracks = t;
+	sw->ntracks = n;
+	for(i = 0; i < sq->seq.ntracks; ++i)
+		sm_mixer_set_polyphony(sq->mixer, i,
+				sq->seq.tracks[i].polyphony);
+	for( ; i < n; ++i)
+		sm_mixer_set_polyphony(sq->mixer, i, 1);
+	sq->seq.mask = sw->mask;
+	sq->seq.maskwords = sw->maskwords;
+	sq->seq.masklength = sw->masklength;
+	sw->mask = m;
+	sw->maskwords = mwords;
+	sw->masklength = mlen;
+	sw->bank = sm_mixer_swap_bank(sq->mixer, sw->bank);
+	_set_defaults(sq);
+	sq->seq.loops = 0;
+	cmd->cb = cmd_free_song;
+	sm_mixer_reply(sq->mixer, cmd);
+}
+
+
+/*
+ * Take over the application side data of 's', and send the rest to
+ * the audio context, where everything is installed in one go.
+ */
+static void install_song(SSEQ_seq *sq, SSEQ_song *s)
+{
+	SM_command cmd;
+	free_views(sq->views, sq->ntracks);
+	sq->views = s->views;
+	sq->ntracks = s->ntracks;
+	s->views = NULL;
+	s->ntracks = 0;
+	free(sq->mask);
+	sq->mask = s->mask;
+	sq->maskwords = s->maskwords;
+	sq->masklength = sq->seqmasklength = s->masklength;
+	s->mask = NULL;
+	remove_tags(&sq->tags);
+	sq->tags = s->tags;
+	s->tags = NULL;
+	cmd.cb = cmd_set_song;
+	cmd.target = sq;
+	cmd.p = s->swap;
+	s->swap = NULL;
+	sm_mixer_send(sq->mixer, &cmd);
+	sm_mixer_poll(sq->mixer);
+}
+
+
+void sseq_seq_clear(SSEQ_seq *sq)
+{
+	SSEQ_song *s = new_song();
+	if(!s)
+		return;
+	if(song_finalize(s) >= 0)
+		install_song(sq, s);
+	free_song(s);
+}
+
+
+static int loader_thread(void *data)
+{
+	SSEQ_song *s = (SSEQ_song *)data;
+	s->result = load_file(s, s->filename);
+	SM_STORE_RELEASE(s->done, 1);
+	return 0;
+}
+
+
+int sseq_seq_load_start(SSEQ_seq *sq, const char *fn)
+{
+	if(sq->loading)
+		return -1;
+	sq->loading = new_song();
+	if(!sq->loading)
+		return -1;
+	sq->loading->filename = strdup(fn);
+	if(!sq->loading->filename)
+	{
+		free_song(sq->loading);
+		sq->loading = NULL;
+		return -1;
+	}
+	sq->loader = SDL_CreateThread(loader_thread, sq->loading);
+	if(!sq->loader)
+	{
+		sm_log(SM_LOG_ERROR, "Could not start loader thread!");
+		free_song(sq->loading);
+		sq->loading = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Wait for the loader to finish, and install the song if it loaded */
+static int finish_load(SSEQ_seq *sq)
 {
 	int res;
-	SDL_LockAudio();
-	res = _load_song(fn);
-	SDL_UnlockAudio();
+	SDL_WaitThread(sq->loader, NULL);
+	sq->loader = NULL;
+	res = sq->loading->result;
+	if(res >= 0)
+		install_song(sq, sq->loading);
+	free_song(sq->loading);
+	sq->loading = NULL;
 	return res;
 }
 
 
-int sseq_save_song(const char *fn)
+SSEQ_load_states sseq_seq_load_poll(SSEQ_seq *sq)
+{
+	if(!sq->loading)
+		return SSEQ_LOAD_IDLE;
+	if(!SM_LOAD_ACQUIRE(sq->loading->done))
+		return SSEQ_LOAD_BUSY;
+	return finish_load(sq) < 0 ? SSEQ_LOAD_FAILED : SSEQ_LOAD_DONE;
+}
+
+
+int sseq_seq_load_song(SSEQ_seq *sq, const char *fn)
+{
+	if(sseq_seq_load_start(sq, fn) < 0)
+		return -1;
+	return finish_load(sq);
+}
+
+
+int sseq_seq_save_song(SSEQ_seq *sq, const char *fn)
 {
 	int t;
 	int errs = 0;
 	SSEQ_tag *tag;
 
-	printf("Saving Song \"%s\"...\n", fn);
+	sm_log(SM_LOG_INFO, "Saving Song \"%s\"...", fn);
 
 	/* Open file */
 	FILE *f = fopen(fn, "wb");
 	if(!f)
 	{
-		fprintf(stderr, "Could not open/create file \"%s\": %s\n",
+		sm_log(SM_LOG_ERROR, "Could not open/create file \"%s\": %s",
 				fn, strerror(errno));
 		return -1;
 	}
@@ -413,17 +1032,17 @@ int sseq_save_song(const char *fn)
 	errs += fprintf(f, "DT42SONG%d\n", SONG_FILE_VERSION) < 0;
 
 	/* Set application metatags */
-	set_tag("CREATOR", "DT-42 DrumToy");
-	set_tag("VERSION", VERSION);
+	set_tag(&sq->tags, "CREATOR", "DT-42 DrumToy");
+	set_tag(&sq->tags, "VERSION", VERSION);
 
 	/* Fill in any missing info tags */
-	if(!find_tag("AUTHOR"))
-		set_tag("AUTHOR", "Unknown");
-	if(!find_tag("TITLE"))
-		set_tag("TITLE", fn);
+	if(!find_tag(sq->tags, "AUTHOR"))
+		set_tag(&sq->tags, "AUTHOR", "Unknown");
+	if(!find_tag(sq->tags, "TITLE"))
+		set_tag(&sq->tags, "TITLE", fn);
 
 	/* Write tags */
-	tag = seq.tags;
+	tag = sq->tags;
 	while(tag)
 	{
 		errs += fprintf(f, "%s:%s\n", tag->label, tag->data) < 0;
@@ -432,271 +1051,874 @@ int sseq_save_song(const char *fn)
 	errs += fprintf(f, "\n") < 0;
 
 	/* Write track data */
-	for(t = 0; t < SSEQ_TRACKS; ++t)
+	for(t = 0; t < sq->ntracks; ++t)
 	{
 /*
 TODO: Nicer formatting...
  */
-		if(!seq.tracks[t].data)
+		if(!sq->views[t].data)
 			continue;
-		errs += fprintf(f, "%d:%s\n", t, seq.tracks[t].data) < 0;
+		errs += fprintf(f, "%d:%s\n", t, sq->views[t].data) < 0;
 	}
 
 	if(errs)
 	{
-		fprintf(stderr, "Error writing \"%s\": %s\n",
+		sm_log(SM_LOG_ERROR, "Error writing \"%s\": %s",
 				fn, strerror(errno));
 		fclose(f);
 		return -1;
 	}
 
-	printf("Song \"%s\" saved!\n", fn);
+	sm_log(SM_LOG_INFO, "Song \"%s\" saved!", fn);
 	fclose(f);
 	return 0;
 }
 
 
+/* Execute the event of track 't' at the current position */
+static inline void run_event(SSEQ_seq *sq, int t, int *again,
+		int *newpos)
+{
+	SSEQ_track *tr = &sq->seq.tracks[t];
+	SSEQ_event *e;
+	if(sq->seq.position >= tr->length)
+		return;
+	e = &tr->events[sq->seq.position];
+	switch(e->op)
+	{
+	  case SSEQ_OP_NOTE:
+		if(!tr->mute)
+			_play_note(sq, t, e->a);
+		break;
+	  case SSEQ_OP_CUT:
+		sm_mixer_group_decay(sq->mixer, t, 0.9f);
+		break;
+	  case SSEQ_OP_DECAY:
+		tr->decay = e->a * 0.1f;
+		break;
+	  case SSEQ_OP_JUMP:
+		*newpos = e->v;
+		*again = 2;
+		break;
+	  case SSEQ_OP_TEMPO:
+		_set_tempo(sq, e->v);
+		break;
+	  case SSEQ_OP_VOLUME:
+		tr->lvol = e->a * (1.0f / 9.0f);
+		tr->rvol = e->v * (1.0f / 9.0f);
+		break;
+	  case SSEQ_OP_ZERO:
+		*again = 1;
+		break;
+	}
+}
+
+
 /*
  * Run the sequencer time for 'frames' sample frames,
  * and execute any events for that time period.
  */
-static unsigned sseq_process(void)
+static unsigned sseq_process(void *userdata)
 {
-	seq.last_position = seq.position;
-	if(paused || !seq.interval)
-		return 16;
+	SSEQ_seq *sq = (SSEQ_seq *)userdata;
+	int frames;
+	sq->seq.last_position = sq->seq.position;
+	if(sq->seq.paused || !sq->seq.interval)
+		return SM_MAXFRAGMENT;
 	while(1)
 	{
 		int again = 0;
+		int looped = 0;
 		int t;
-		int newpos = seq.position + 1;
-		if(seq.position == 0)
-			_set_defaults();
-		if(seq.loop_end >= 0)
+		int newpos = sq->seq.position + 1;
+		if(sq->seq.position == 0)
+			_set_defaults(sq);
+		if(sq->seq.loop_end >= 0)
 		{
-			if(newpos >= seq.loop_end)
+			if(newpos >= sq->seq.loop_end)
 			{
-				if(seq.loop_start >= 0)
-					newpos = seq.loop_start;
+				if(sq->seq.loop_start >= 0)
+					newpos = sq->seq.loop_start;
 				else
 					newpos = 0;
+				looped = 1;
 			}
 		}
-		for(t = 0; t < SSEQ_TRACKS; ++t)
+		if(sq->seq.position < sq->seq.masklength)
 		{
-			char *d = seq.tracks[t].data + seq.position;
-			int skip = seq.tracks[t].mute;
-			if(seq.tracks[t].skip)
-			{
-				--seq.tracks[t].skip;
-				skip = 1;
-			}
-			if(seq.position >= seq.tracks[t].length)
-				continue;
-			switch(*d)
+			/* Only visit the tracks that have events here */
+			Uint32 *m = sq->seq.mask +
+					sq->seq.position * sq->seq.maskwords;
+			int w;
+			for(w = 0; w < sq->seq.maskwords; ++w)
 			{
-			  /* Note */
-			  case '0':
-			  case '1':
-			  case '2':
-			  case '3':
-			  case '4':
-			  case '5':
-			  case '6':
-			  case '7':
-			  case '8':
-			  case '9':
-				/* Don't play command arguments! */
-				if(skip)
-					break;
-				_play_note(t, *d);
-				break;
-			  /* Cut note */
-			  case 'C':
-				sm_decay(t, 0.9f);
-				break;
-			  /* Set note decay */
-			  case 'D':
-				seq.tracks[t].decay = (d[1] - '0') * 0.1f;
-				seq.tracks[t].skip = 1;
-				break;
-			  /* Jump to position */
-			  case 'J':
-			  {
-				int v = (d[1] - '0') * 100;
-				v += (d[2] - '0') * 10;
-				v += (d[3] - '0');
-				newpos = v;
-				again = 2;
-				break;
-			  }
-			  /* Set tempo */
-			  case 'T':
-			  {
-				int v = (d[1] - '0') * 100;
-				v += (d[2] - '0') * 10;
-				v += (d[3] - '0');
-				_set_tempo(v);
-				seq.tracks[t].skip = 3;
-				break;
-			  }
-			  /* Set volume/balance */
-			  case 'V':
-				seq.tracks[t].lvol = (d[1] - '0') * (1.0f / 9.0f);
-				seq.tracks[t].rvol = (d[2] - '0') * (1.0f / 9.0f);
-				seq.tracks[t].skip = 2;
-				break;
-			  /* Zero time step */
-			  case 'Z':
-				again = 1;
-				break;
+				Uint32 bits = m[w];
+				while(bits)
+				{
+					t = w * 32 + lowest_bit(bits);
+					bits &= bits - 1;
+					run_event(sq, t, &again, &newpos);
+				}
 			}
 		}
-		seq.position = newpos;
+		if((again == 2) && (newpos <= sq->seq.position))
+			looped = 1;
+
+		/* A step that wraps and also jumps back is still one loop */
+		if(looped)
+			++sq->seq.loops;
+		sq->seq.position = newpos;
 		if(!again)
 			break;
-		/*
-		 * Prevent the skip feature from killing notes after a jump.
-		 * Note that this will break if you jump to some place where
-		 * you land in the middle of the arguments to a command!
-		 * (But that probably wouldn't play correctly anyway, so who
-		 * cares?)
-		 */
-		if(again == 2)
-			for(t = 0; t < SSEQ_TRACKS; ++t)
-				seq.tracks[t].skip = 0;
 	}
-	return seq.interval;
+
+	/* Carry the fraction over, so the average tempo is exact */
+	sq->seq.frac += sq->seq.interval;
+	frames = (int)sq->seq.frac;
+	sq->seq.frac -= frames;
+	return frames;
 }
 
 
-void sseq_pause(int pause)
+/*-------------------------------------------------------------------
+	Commands; these run in the audio context
+-------------------------------------------------------------------*/
+
+/* Reply handler: Free memory passed back from the audio context */
+static void cmd_free(SM_command *cmd)
 {
-	paused = pause;
+	free(cmd->p);
 }
 
 
-void sseq_set_tempo(float bpm)
+static void cmd_pause(SM_command *cmd)
 {
-	SDL_LockAudio();
-	_set_tempo(bpm);
-	SDL_UnlockAudio();
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	sq->seq.paused = cmd->i[0];
+	if(!sq->seq.paused)
+		sm_mixer_force_interval(sq->mixer, 0);
 }
 
 
-float sseq_get_tempo(void)
+static void cmd_tempo(SM_command *cmd)
 {
-	return 44100.0 / seq.interval * 60.0 / 4.0;
+	_set_tempo((SSEQ_seq *)cmd->target, cmd->f);
 }
 
 
-void sseq_play_note(int trk, char note)
+static void cmd_play_note(SM_command *cmd)
 {
-	SDL_LockAudio();
-	_play_note(trk, note);
-	SDL_UnlockAudio();
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	if(cmd->i[0] < sq->seq.ntracks)
+		_play_note(sq, cmd->i[0], cmd->i[1]);
 }
 
 
-int sseq_get_position(void)
+static void cmd_position(SM_command *cmd)
 {
-	/*
-	 * Note: We don't want seq.position, because that's
-	 * actually the NEXT step in the sequence, whereas
-	 * we want the CURRENTLY PLAYING step.
-	 */
-	return seq.last_position;
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	sq->seq.position = cmd->i[0];
+	sq->seq.loops = 0;
 }
 
 
-int sseq_get_next_position(void)
+static void cmd_loop(SM_command *cmd)
 {
-	return seq.position;
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	sq->seq.loop_start = cmd->i[0];
+	sq->seq.loop_end = cmd->i[1];
 }
 
 
-void sseq_set_position(unsigned pos)
+static void cmd_mute(SM_command *cmd)
 {
-	seq.position = pos;
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	sq->seq.tracks[cmd->i[0]].mute = cmd->i[1];
 }
 
 
-void sseq_loop(int start, int end)
+static void cmd_polyphony(SM_command *cmd)
 {
-	SDL_LockAudio();
-	seq.loop_start = start;
-	seq.loop_end = end;
-	SDL_UnlockAudio();
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	sq->seq.tracks[cmd->i[0]].polyphony = cmd->i[1];
+	sm_mixer_set_polyphony(sq->mixer, cmd->i[0], cmd->i[1]);
 }
 
 
-int sseq_get_note(unsigned pos, unsigned track)
+static void cmd_track_sound(SM_command *cmd)
 {
-	if(track >= SSEQ_TRACKS)
-		return -1;
-	if(pos >= seq.tracks[track].length)
-		return -1;
-	return seq.tracks[track].data[pos];
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	sq->seq.tracks[cmd->i[0]].sound = cmd->i[1];
 }
 
 
-void sseq_set_note(unsigned pos, unsigned track, int note)
+/* Set one event; i[2] is from pack_event() */
+static void cmd_set_event(SM_command *cmd)
+{
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	int t = cmd->i[0];
+	int pos = cmd->i[1];
+	SSEQ_event *e;
+	if(pos >= sq->seq.tracks[t].length)
+		return;
+	e = &sq->seq.tracks[t].events[pos];
+	e->op = (cmd->i[2] >> 24) & 0xff;
+	e->a = (cmd->i[2] >> 16) & 0xff;
+	e->v = cmd->i[2] & 0xffff;
+	if(pos < sq->seq.masklength)
+		update_mask(sq->seq.mask, sq->seq.maskwords, t,
+				sq->seq.tracks[t].events, pos, pos);
+}
+
+
+/* Install new events for a track, and pass the old ones back */
+static void cmd_set_track(SM_command *cmd)
+{
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	int t = cmd->i[0];
+	SSEQ_track *tr = &sq->seq.tracks[t];
+	SM_command reply;
+	int n;
+	reply.cb = cmd_free;
+	reply.target = sq;
+	reply.p = tr->events;
+	tr->events = cmd->p;
+	tr->length = cmd->i[1];
+	n = tr->length < sq->seq.masklength ? tr->length : sq->seq.masklength;
+	update_mask(sq->seq.mask, sq->seq.maskwords, t, tr->events, 0, n - 1);
+	if(reply.p)
+		sm_mixer_reply(sq->mixer, &reply);
+}
+
+
+/*
+ * Install a new (larger) step bitmap, of i[0] steps of i[1] words, and
+ * pass the old one back.
+ */
+static void cmd_set_mask(SM_command *cmd)
+{
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	SM_command reply;
+	reply.cb = cmd_free;
+	reply.target = sq;
+	reply.p = sq->seq.mask;
+	sq->seq.mask = cmd->p;
+	sq->seq.masklength = cmd->i[0];
+	sq->seq.maskwords = cmd->i[1];
+	if(reply.p)
+		sm_mixer_reply(sq->mixer, &reply);
+}
+
+
+/*
+ * Install a larger track array, of i[0] tracks. The current tracks are
+ * moved over, and the old array is passed back.
+ */
+static void cmd_set_tracks(SM_command *cmd)
+{
+	SSEQ_seq *sq = (SSEQ_seq *)cmd->target;
+	SSEQ_track *t = (SSEQ_track *)cmd->p;
+	SM_command reply;
+	int i;
+	if(sq->seq.ntracks)
+		memcpy(t, sq->seq.tracks, sq->seq.ntracks * sizeof(SSEQ_track));
+	for(i = sq->seq.ntracks; i < cmd->i[0]; ++i)
+		sm_mixer_set_polyphony(sq->mixer, i, t[i].polyphony);
+	reply.cb = cmd_free;
+	reply.target = sq;
+	reply.p = sq->seq.tracks;
+	sq->seq.tracks = t;
+	sq->seq.ntracks = cmd->i[0];
+	if(reply.p)
+		sm_mixer_reply(sq->mixer, &reply);
+}
+
+
+static void send(SSEQ_seq *sq, sm_command_cb cb, int i0, int i1, int i2,
+		float f, void *p)
+{
+	SM_command cmd;
+	cmd.cb = cb;
+	cmd.target = sq;
+	cmd.i[0] = i0;
+	cmd.i[1] = i1;
+	cmd.i[2] = i2;
+	cmd.f = f;
+	cmd.p = p;
+	sm_mixer_send(sq->mixer, &cmd);
+}
+
+
+/*
+ * Send copies of the application side events of 'track', and the step
+ * bitmap if it has grown, to the sequencer.
+ */
+static void send_track(SSEQ_seq *sq, int track)
 {
-	SDL_LockAudio();
-	if(track < SSEQ_TRACKS)
+	SSEQ_trackview *v = &sq->views[track];
+	SSEQ_event *e;
+	if(sq->masklength > sq->seqmasklength)
 	{
-		if(pos >= seq.tracks[track].length)
+		Uint32 *m = copy(sq->mask, sq->masklength *
+				sq->maskwords * sizeof(Uint32));
+		if(!m)
+			return;
+		sq->seqmasklength = sq->masklength;
+		send(sq, cmd_set_mask, sq->masklength, sq->maskwords, 0,
+				0.0f, m);
+	}
+	e = copy(v->events, v->length * sizeof(SSEQ_event));
+	if(!e)
+		return;
+	v->seqlength = v->length;
+	send(sq, cmd_set_track, track, v->length, 0, 0.0f, e);
+}
+
+
+/*
+ * Recompile steps 'first' through 'last' of 'track', after an edit,
+ * and update the step bitmap. Changed events within the sequencer's
+ * copy of the track are sent over.
+ */
+static void recompile(SSEQ_seq *sq, int track, int first, int last)
+{
+	SSEQ_trackview *v = &sq->views[track];
+	int pos;
+	if(first < 0)
+		first = 0;
+	if(last >= v->length)
+		last = v->length - 1;
+	for(pos = first; pos <= last; ++pos)
+	{
+		SSEQ_event e = v->events[pos];
+		compile(v, pos, pos);
+		if(!memcmp(&e, &v->events[pos], sizeof(SSEQ_event)))
+			continue;
+		update_mask(sq->mask, sq->maskwords, track, v->events,
+				pos, pos);
+		if(pos < v->seqlength)
+			send(sq, cmd_set_event, track, pos,
+					pack_event(&v->events[pos]),
+					0.0f, NULL);
+	}
+}
+
+
+/*
+ * Make room for 'length' steps in 'track', and the step bitmap.
+ * New steps are filled with '.'.
+ */
+static int grow_track(SSEQ_seq *sq, int track, int length)
+{
+	SSEQ_trackview *v = &sq->views[track];
+	char *nd;
+	SSEQ_event *ne;
+	if(length <= v->length)
+		return 0;
+	if(length > sq->masklength)
+	{
+		Uint32 *nm = realloc(sq->mask,
+				length * sq->maskwords * sizeof(Uint32));
+		if(!nm)
+			return -1;
+		memset(nm + sq->masklength * sq->maskwords, 0,
+				(length - sq->masklength) * sq->maskwords *
+				sizeof(Uint32));
+		sq->mask = nm;
+		sq->masklength = length;
+	}
+	nd = realloc(v->data, length + 1);
+	if(!nd)
+		return -1;
+	v->data = nd;
+	ne = realloc(v->events, length * sizeof(SSEQ_event));
+	if(!ne)
+		return -1;
+	v->events = ne;
+	memset(v->data + v->length, '.', length - v->length);
+	memset(v->events + v->length, 0,
+			(length - v->length) * sizeof(SSEQ_event));
+	v->data[length] = 0;
+	v->length = length;
+	return 0;
+}
+
+
+/*
+ * Add tracks, so there are at least 'n'. If the step bitmap needs more
+ * words per step, a new one is sent over first, as bits are only set
+ * for tracks that exist. Then the sequencer gets a new track array,
+ * with the new tracks set up, to move its current tracks into.
+ */
+static int grow_tracks(SSEQ_seq *sq, int n)
+{
+	SSEQ_track *t;
+	int words = mask_words(n);
+	if(n <= sq->ntracks)
+		return 0;
+	if(n > SSEQ_MAXTRACKS)
+		return -1;
+	if(words > sq->maskwords)
+	{
+		Uint32 *nm = NULL;
+		Uint32 *m;
+		int pos;
+		if(sq->masklength)
 		{
-			char *nt = realloc(seq.tracks[track].data,
-					pos + 2);
-			if(!nt)
-			{
-				SDL_UnlockAudio();
-				return;
-			}
-			memset(nt + seq.tracks[track].length, '.',
-					pos - seq.tracks[track].length);
-			seq.tracks[track].data = nt;
-			seq.tracks[track].data[pos + 1] = 0;
-			seq.tracks[track].length = pos + 1;
+			nm = calloc(sq->masklength * words, sizeof(Uint32));
+			if(!nm)
+				return -1;
+			for(pos = 0; pos < sq->masklength; ++pos)
+				memcpy(nm + pos * words,
+						sq->mask + pos * sq->maskwords,
+						sq->maskwords * sizeof(Uint32));
 		}
-		seq.tracks[track].data[pos] = note;
+		m = copy(nm, sq->masklength * words * sizeof(Uint32));
+		if(sq->masklength && !m)
+		{
+			free(nm);
+			return -1;
+		}
+		free(sq->mask);
+		sq->mask = nm;
+		sq->maskwords = words;
+		sq->seqmasklength = sq->masklength;
+		send(sq, cmd_set_mask, sq->masklength, words, 0, 0.0f, m);
+	}
+	t = calloc(n, sizeof(SSEQ_track));
+	if(!t)
+		return -1;
+	if(grow_views(&sq->views, &sq->ntracks, n) < 0)
+	{
+		free(t);
+		return -1;
 	}
-	SDL_UnlockAudio();
+	init_tracks(t, sq->views, 0, n - 1);
+	send(sq, cmd_set_tracks, n, 0, 0, 0.0f, t);
+	return 0;
+}
+
+
+/*-------------------------------------------------------------------
+	Real time control
+-------------------------------------------------------------------*/
+
+void sseq_seq_pause(SSEQ_seq *sq, int pause)
+{
+	send(sq, cmd_pause, pause, 0, 0, 0.0f, NULL);
+}
+
+
+void sseq_seq_set_tempo(SSEQ_seq *sq, float bpm)
+{
+	send(sq, cmd_tempo, 0, 0, 0, bpm, NULL);
+}
+
+
+float sseq_seq_get_tempo(SSEQ_seq *sq)
+{
+	if(!sq->seq.interval)
+		return 0.0f;
+	return (double)sm_mixer_get_rate(sq->mixer) / sq->seq.interval *
+			60.0 / 4.0;
+}
+
+
+void sseq_seq_play_note(SSEQ_seq *sq, int trk, char note)
+{
+	if(trk < 0 || trk >= sq->ntracks)
+		return;
+	send(sq, cmd_play_note, trk, note, 0, 0.0f, NULL);
+}
+
+
+void sseq_seq_mute(SSEQ_seq *sq, int trk, int do_mute)
+{
+	if(trk < 0 || trk >= sq->ntracks)
+		return;
+	sq->views[trk].mute = do_mute;
+	send(sq, cmd_mute, trk, do_mute, 0, 0.0f, NULL);
+}
+
+
+int sseq_seq_muted(SSEQ_seq *sq, int trk)
+{
+	if(trk < 0 || trk >= sq->ntracks)
+		return 0;
+	return sq->views[trk].mute;
+}
+
+
+void sseq_seq_set_polyphony(SSEQ_seq *sq, int trk, int voices)
+{
+	char label[16];
+	char data[16];
+	if(trk < 0 || voices < 1 || voices > SM_MAXVOICES ||
+			grow_tracks(sq, trk + 1) < 0)
+		return;
+	sq->views[trk].polyphony = voices;
+	snprintf(label, sizeof(label), "P%d", trk);
+	snprintf(data, sizeof(data), "%d", voices);
+	if((voices > 1) || find_tag(sq->tags, label))
+		set_tag(&sq->tags, label, data);
+	send(sq, cmd_polyphony, trk, voices, 0, 0.0f, NULL);
+}
+
+
+int sseq_seq_get_polyphony(SSEQ_seq *sq, int trk)
+{
+	if(trk < 0 || trk >= sq->ntracks)
+		return 0;
+	return sq->views[trk].polyphony;
+}
+
+
+void sseq_seq_set_sound(SSEQ_seq *sq, int trk, int sound)
+{
+	char label[16];
+	char data[16];
+	if(trk < 0 || sound < 0 || sound >= SM_MAXSOUNDS ||
+			grow_tracks(sq, trk + 1) < 0)
+		return;
+	sq->views[trk].sound = sound;
+	snprintf(label, sizeof(label), "M%d", trk);
+	snprintf(data, sizeof(data), "%d", sound);
+	if((sound != trk) || find_tag(sq->tags, label))
+		set_tag(&sq->tags, label, data);
+	send(sq, cmd_track_sound, trk, sound, 0, 0.0f, NULL);
+}
+
+
+int sseq_seq_get_sound(SSEQ_seq *sq, int trk)
+{
+	if(trk < 0 || trk >= sq->ntracks)
+		return -1;
+	return sq->views[trk].sound;
+}
+
+
+int sseq_seq_get_tracks(SSEQ_seq *sq)
+{
+	return sq->ntracks;
+}
+
+
+int sseq_seq_get_position(SSEQ_seq *sq)
+{
+	/*
+	 * Note: We don't want sq->seq.position, because that's
+	 * actually the NEXT step in the sequence, whereas
+	 * we want the CURRENTLY PLAYING step.
+	 */
+	return sq->seq.last_position;
+}
+
+
+int sseq_seq_get_next_position(SSEQ_seq *sq)
+{
+	return sq->seq.position;
+}
+
+
+void sseq_seq_set_position(SSEQ_seq *sq, unsigned pos)
+{
+	send(sq, cmd_position, pos, 0, 0, 0.0f, NULL);
+}
+
+
+/* Get the length of the song in steps; that is, of the longest track */
+int sseq_seq_get_length(SSEQ_seq *sq)
+{
+	int t;
+	int len = 0;
+	for(t = 0; t < sq->ntracks; ++t)
+		if(sq->views[t].length > len)
+			len = sq->views[t].length;
+	return len;
+}
+
+
+/*
+ * Get the number of times the sequencer has jumped back or
+ * wrapped around a loop since the song was loaded or the
+ * position was last set.
+ */
+int sseq_seq_get_loops(SSEQ_seq *sq)
+{
+	return sq->seq.loops;
+}
+
+
+void sseq_seq_loop(SSEQ_seq *sq, int start, int end)
+{
+	send(sq, cmd_loop, start, end, 0, 0.0f, NULL);
 }
 
 
+/*-------------------------------------------------------------------
+	Editing
+-------------------------------------------------------------------*/
+
+int sseq_seq_get_note(SSEQ_seq *sq, unsigned pos, unsigned track)
+{
+	if(track >= (unsigned)sq->ntracks)
+		return -1;
+	if(pos >= sq->views[track].length)
+		return -1;
+	return sq->views[track].data[pos];
+}
+
+
+void sseq_seq_set_note(SSEQ_seq *sq, unsigned pos, unsigned track,
+		int note)
+{
+	SSEQ_trackview *v;
+	if(track >= SSEQ_MAXTRACKS || grow_tracks(sq, track + 1) < 0)
+		return;
+	v = &sq->views[track];
+	if(grow_track(sq, track, pos + 1) < 0)
+		return;
+	v->data[pos] = note;
+
+	/*
+	 * A step can be an argument of a command up to SSEQ_MAXARGS
+	 * steps before it, and can itself be a command with arguments
+	 * after it.
+	 */
+	recompile(sq, track, (int)pos - SSEQ_MAXARGS, pos + SSEQ_MAXARGS);
+
+	/* The sequencer's copy needs to grow? Then send a new one. */
+	if(v->length > v->seqlength)
+		send_track(sq, track);
+	sm_mixer_poll(sq->mixer);
+}
+
+
+void sseq_seq_add(SSEQ_seq *sq, int track, const char *data)
+{
+	SSEQ_trackview *v;
+	int start;
+	int len = strlen(data);
+	if(track < 0 || grow_tracks(sq, track + 1) < 0)
+		return;
+	v = &sq->views[track];
+	start = v->length;
+	if(grow_track(sq, track, v->length + len) < 0)
+		return;
+	memcpy(v->data + start, data, len);
+	recompile(sq, track, start - SSEQ_MAXARGS, v->length - 1);
+	send_track(sq, track);
+	sm_mixer_poll(sq->mixer);
+}
+
+
+/*-------------------------------------------------------------------
+	Open/close
+-------------------------------------------------------------------*/
+
+SSEQ_seq *sseq_seq_new(SM_mixer *m)
+{
+	SSEQ_seq *sq = calloc(1, sizeof(SSEQ_seq));
+	if(!sq)
+		return NULL;
+	sq->mixer = m;
+	sm_mixer_set_control_cb(m, sseq_process, sq);
+	sseq_seq_loop(sq, -1, -1);
+	sseq_seq_clear(sq);
+	return sq;
+}
+
+
+void sseq_seq_free(SSEQ_seq *sq)
+{
+	if(!sq)
+		return;
+	if(sq->loading)
+		finish_load(sq);
+	sm_mixer_set_control_cb(sq->mixer, NULL, NULL);
+	sseq_seq_clear(sq);
+	sm_mixer_sync(sq->mixer);
+	free_tracks(sq->seq.tracks, sq->seq.ntracks);
+	free(sq->seq.mask);
+	free_views(sq->views, sq->ntracks);
+	free(sq->mask);
+	remove_tags(&sq->tags);
+	free(sq);
+}
+
+
+/*-------------------------------------------------------------------
+	Default sequencer
+-------------------------------------------------------------------*/
+
 void sseq_open(void)
 {
-	memset(&seq, 0, sizeof(seq));
-	sm_set_control_cb(sseq_process);
-	sseq_loop(-1, -1);
-	sseq_clear();
+	if(defseq)
+		return;
+	defseq = sseq_seq_new(sm_default());
+	if(!defseq)
+		sm_log(SM_LOG_ERROR, "Could not create sequencer!");
 }
 
 
 void sseq_close(void)
 {
-	sm_set_control_cb(NULL);
-	sseq_clear();
-	memset(&seq, 0, sizeof(seq));
+	sseq_seq_free(defseq);
+	defseq = NULL;
+}
+
+
+SSEQ_seq *sseq_default(void)
+{
+	return defseq;
+}
+
+
+int sseq_load_song(const char *fn)
+{
+	return sseq_seq_load_song(defseq, fn);
+}
+
+
+int sseq_save_song(const char *fn)
+{
+	return sseq_seq_save_song(defseq, fn);
+}
+
+
+void sseq_clear(void)
+{
+	sseq_seq_clear(defseq);
+}
+
+
+int sseq_load_start(const char *fn)
+{
+	return sseq_seq_load_start(defseq, fn);
+}
+
+
+SSEQ_load_states sseq_load_poll(void)
+{
+	return sseq_seq_load_poll(defseq);
+}
+
+
+float sseq_get_tempo(void)
+{
+	return sseq_seq_get_tempo(defseq);
+}
+
+
+void sseq_set_tempo(float bpm)
+{
+	sseq_seq_set_tempo(defseq, bpm);
+}
+
+
+void sseq_pause(int pause)
+{
+	sseq_seq_pause(defseq, pause);
+}
+
+
+int sseq_get_position(void)
+{
+	return sseq_seq_get_position(defseq);
+}
+
+
+int sseq_get_next_position(void)
+{
+	return sseq_seq_get_next_position(defseq);
+}
+
+
+void sseq_set_position(unsigned pos)
+{
+	sseq_seq_set_position(defseq, pos);
+}
+
+
+int sseq_get_length(void)
+{
+	return sseq_seq_get_length(defseq);
+}
+
+
+int sseq_get_loops(void)
+{
+	return sseq_seq_get_loops(defseq);
+}
+
+
+void sseq_loop(int start, int end)
+{
+	sseq_seq_loop(defseq, start, end);
+}
+
+
+void sseq_play_note(int trk, char note)
+{
+	sseq_seq_play_note(defseq, trk, note);
+}
+
+
+void sseq_mute(int trk, int do_mute)
+{
+	sseq_seq_mute(defseq, trk, do_mute);
+}
+
+
+int sseq_muted(int trk)
+{
+	return sseq_seq_muted(defseq, trk);
+}
+
+
+void sseq_set_polyphony(int trk, int voices)
+{
+	sseq_seq_set_polyphony(defseq, trk, voices);
+}
+
+
+int sseq_get_polyphony(int trk)
+{
+	return sseq_seq_get_polyphony(defseq, trk);
+}
+
+
+void sseq_set_sound(int trk, int sound)
+{
+	sseq_seq_set_sound(defseq, trk, sound);
+}
+
+
+int sseq_get_sound(int trk)
+{
+	return sseq_seq_get_sound(defseq, trk);
+}
+
+
+int sseq_get_tracks(void)
+{
+	return sseq_seq_get_tracks(defseq);
 }
 
 
 void sseq_add(int track, const char *data)
 {
-	SDL_LockAudio();
-	if(!seq.tracks[track].data)
-		seq.tracks[track].data = strdup(data);
-	else
-	{
-		char *new_track = malloc(strlen(seq.tracks[track].data) +
-				strlen(data) + 1);
-		strcpy(new_track, seq.tracks[track].data);
-		strcat(new_track, data);
-		free(seq.tracks[track].data);
-		seq.tracks[track].data = new_track;
-	}
-	seq.tracks[track].length = strlen(seq.tracks[track].data);
-	SDL_UnlockAudio();
+	sseq_seq_add(defseq, track, data);
+}
+
+
+int sseq_get_note(unsigned pos, unsigned track)
+{
+	return sseq_seq_get_note(defseq, pos, track);
+}
+
+
+void sseq_set_note(unsigned pos, unsigned track, int note)
+{
+	sseq_seq_set_note(defseq, pos, track, note);
 }
@@ -7,16 +7,55 @@
 #ifndef	SSEQ_H
 #define	SSEQ_H
 
-/* Number of sequencer tracks */
+#include "smixer.h"
+
+/*
+ * Number of tracks of a new song, and the most a song can have. Tracks
+ * are added as songs and edits use them. Each track uses the voice group
+ * of the same index, so there can't be more tracks than groups.
+ */
 #define	SSEQ_TRACKS	16
+#define	SSEQ_MAXTRACKS	SM_GROUPS
 
+/*
+ * The sseq_*() calls operate on the default sequencer, which plays on
+ * the default mixer. It is created by sseq_open(), after sm_open() or
+ * sm_open_offline(). Each call has an sseq_seq_*() counterpart that
+ * operates on the sequencer passed as the first argument.
+ */
 void sseq_open(void);
 void sseq_close(void);
 
+/*
+ * Load a song, waiting for it to finish. The song and its sounds
+ * are loaded without locking the audio context, and then replace
+ * the current song in one go. On failure, the current song stays.
+ */
 int sseq_load_song(const char *fn);
 int sseq_save_song(const char *fn);
 void sseq_clear(void);
 
+/* Background loading */
+typedef enum
+{
+	SSEQ_LOAD_IDLE = 0,	/* No load in progress */
+	SSEQ_LOAD_BUSY,		/* Still loading */
+	SSEQ_LOAD_DONE,		/* Loaded and installed */
+	SSEQ_LOAD_FAILED	/* Failed; old song still there */
+} SSEQ_load_states;
+
+/*
+ * Start loading a song in a background thread. Returns -1 if a load
+ * is already in progress, or the thread could not be started.
+ */
+int sseq_load_start(const char *fn);
+
+/*
+ * Check on the background loader, and install the new song when it's
+ * done. DONE or FAILED is returned once per load.
+ */
+SSEQ_load_states sseq_load_poll(void);
+
 /* Real time control */
 float sseq_get_tempo(void);
 void sseq_set_tempo(float bpm);
@@ -24,14 +63,74 @@ void sseq_pause(int pause);
 int sseq_get_position(void);
 int sseq_get_next_position(void);
 void sseq_set_position(unsigned pos);
+int sseq_get_length(void);
+int sseq_get_loops(void);
 void sseq_loop(int start, int end);
 void sseq_play_note(int trk, char note);
 void sseq_mute(int trk, int do_mute);
 int sseq_muted(int trk);
 
+/*
+ * Number of notes track 'trk' can play at once; 1 by default. Stored
+ * in songs as "P<track>:<voices>".
+ */
+void sseq_set_polyphony(int trk, int voices);
+int sseq_get_polyphony(int trk);
+
+/*
+ * Sound slot played by track 'trk'. Tracks play the sound of the same
+ * index by default. Stored in songs as "M<track>:<sound>".
+ */
+void sseq_set_sound(int trk, int sound);
+int sseq_get_sound(int trk);
+
+/* Number of tracks of the current song */
+int sseq_get_tracks(void);
+
 /* Editing */
 void sseq_add(int track, const char *data);
 int sseq_get_note(unsigned pos, unsigned track);
 void sseq_set_note(unsigned pos, unsigned track, int note);
 
+
+/*
+ * Sequencer instances. Each sequencer installs itself as the control
+ * callback of 'mixer', so there can be only one sequencer per mixer.
+ * A sequencer must be freed before its mixer is closed.
+ */
+typedef struct SSEQ_seq SSEQ_seq;
+
+SSEQ_seq *sseq_seq_new(SM_mixer *mixer);
+void sseq_seq_free(SSEQ_seq *sq);
+
+/* The default sequencer, or NULL if it's not open */
+SSEQ_seq *sseq_default(void);
+
+int sseq_seq_load_song(SSEQ_seq *sq, const char *fn);
+int sseq_seq_save_song(SSEQ_seq *sq, const char *fn);
+void sseq_seq_clear(SSEQ_seq *sq);
+int sseq_seq_load_start(SSEQ_seq *sq, const char *fn);
+SSEQ_load_states sseq_seq_load_poll(SSEQ_seq *sq);
+float sseq_seq_get_tempo(SSEQ_seq *sq);
+void sseq_seq_set_tempo(SSEQ_seq *sq, float bpm);
+void sseq_seq_pause(SSEQ_seq *sq, int pause);
+int sseq_seq_get_position(SSEQ_seq *sq);
+int sseq_seq_get_next_position(SSEQ_seq *sq);
+void sseq_seq_set_position(SSEQ_seq *sq, unsigned pos);
+int sseq_seq_get_length(SSEQ_seq *sq);
+int sseq_seq_get_loops(SSEQ_seq *sq);
+void sseq_seq_loop(SSEQ_seq *sq, int start, int end);
+void sseq_seq_play_note(SSEQ_seq *sq, int trk, char note);
+void sseq_seq_mute(SSEQ_seq *sq, int trk, int do_mute);
+int sseq_seq_muted(SSEQ_seq *sq, int trk);
+void sseq_seq_set_polyphony(SSEQ_seq *sq, int trk, int voices);
+int sseq_seq_get_polyphony(SSEQ_seq *sq, int trk);
+void sseq_seq_set_sound(SSEQ_seq *sq, int trk, int sound);
+int sseq_seq_get_sound(SSEQ_seq *sq, int trk);
+int sseq_seq_get_tracks(SSEQ_seq *sq);
+void sseq_seq_add(SSEQ_seq *sq, int track, const char *data);
+int sseq_seq_get_note(SSEQ_seq *sq, unsigned pos, unsigned track);
+void sseq_seq_set_note(SSEQ_seq *sq, unsigned pos, unsigned track,
+		int note);
+
 #endif	/* SSEQ_H */